@@ -24,6 +24,9 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  * 
+ * Version 3.0 paulvha October 2026
+ *  - daemon mode with queries on a Unix socket
+ *
  * Version 2.1 paulvha Ocobter 2023
  *  - fixed issue with wakeup after setting to sleep
  * 
@@ -35,6 +38,15 @@
  */
 
 #include "sds011_lib.h"
+#include "sds.h"
+#include "sds_fleet.h"
+#include "sds_daemon.h"
+#include "sds_filter.h"
+#include "sds_loop.h"
+#include "sds_plan.h"
+#include "sds_sched.h"
+#include "sds_trace.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <termios.h>
@@ -44,32 +56,20 @@
 #include <getopt.h>
 #include <stdarg.h>
 
-#define PROGVERSION "2.1 / October 2023 / paulvha"
+#define PROGVERSION "3.0 / October 2026 / paulvha"
 
-/* indicate these serial calls are C-programs and not to be linked */
-extern "C" {
-    void configure_interface(int fd, int speed);
-    void set_blocking(int fd, int should_block);
-    void restore_ser(int fd);
-}
+#define CAL_STEP_MS  2000         // time of each calibration step
+#define CAL_QUERIES  5            // min queries in each calibration step
 
 // global variables
 int  fd = 0xff;                   // file pointer
 char progname[20];
-char port[20] = "/dev/ttyUSB0";
+char port[PORT_LEN + 10] = "/dev/ttyUSB0";
+bool lazy = false;                // connected without probe
 
 /*=======================================================================
-    to display in color
+    to display in color (see sds.h)
   -----------------------------------------------------------------------*/
-void p_printf (int level, char *format, ...);
-
-/*! color display enable */
-#define RED     1
-#define GREEN   2
-#define YELLOW  3
-#define BLUE    4
-#define WHITE   5
-
 #define REDSTR "\e[1;31m%s\e[00m"
 #define GRNSTR "\e[1;92m%s\e[00m"
 #define YLWSTR "\e[1;93m%s\e[00m"
@@ -87,19 +87,40 @@ typedef struct settings
 
     bool        g_data;           // display data: true continuous, false : query
     uint16_t    loop;             // how many loop or reading
-    uint16_t    delay;            // delay between reading data
+    long        delay;            // ms between reading data
+    bool        align;            // read on wall clock multiples of delay
 
     bool        s_devid;          // change devid
     uint8_t     newid[2];         // hold new device id
     uint8_t     s_working_mode;   // set working mode
     uint8_t     s_working_period; // set working period
+
+    bool        timing;           // report startup time to first reading
+    bool        discover;         // find sensors on all serial ports
+    bool        calibrate;        // find the max query rate of the sensor
+    long        rate;             // ms between queries it keeps up with (0 = unknown)
+    char        *apply;           // file with wanted configuration
+    int         plan;             // seconds between samples to plan laser use for
+    bool        run_daemon;       // keep sensors open and serve queries
+    char        *query;           // query to send to a running daemon
 } settings ;
 
 // global structure
 struct settings action;
 
+// report by exception (-E, -B)
+deadband band;
+
+// swinging door compression (-O)
+float swing_dev = 0;             // compression deviation (0 = off)
+
+// startup timing (-T)
+struct timespec t_start;
+double t_driver, t_open, t_connect;
+
 /* global constructor SDS011 */ 
 SDS011 MySensor;
+sds011_bus bus;             // when the port is a multi-drop bus
 
 /*********************************************************************
 *  @brief close program correctly
@@ -107,6 +128,10 @@ SDS011 MySensor;
 **********************************************************************/
 void closeout(int val)
 {
+    // daemon mode
+    daemon_close();
+    fleet_close_all();
+
     if (fd != 0xff) {
         
         // restore serial/USB to orginal setting
@@ -118,6 +143,68 @@ void closeout(int val)
     exit(val);
 }
 
+/*********************************************************************
+ * @brief : milliseconds since program start
+ *********************************************************************/
+double elapsed_ms()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return((now.tv_sec - t_start.tv_sec) * 1000.0 + (now.tv_nsec - t_start.tv_nsec) / 1e6);
+}
+
+/*********************************************************************
+ * @brief : load a kernel module, unless it is loaded already
+ * @param mod : name of module
+ *********************************************************************/
+void load_module(const char *mod)
+{
+    char path[60];
+
+    snprintf(path, sizeof(path), "/sys/module/%s", mod);
+
+    if (access(path, F_OK) == 0) return;
+
+    snprintf(path, sizeof(path), "modprobe %s", mod);
+    system(path);
+}
+
+/*********************************************************************
+ * @brief : make sure the driver is loaded before opening /dev/ttyUSBx
+ *
+ * you need the driver to be loaded before opening /dev/ttyUSBx
+ * otherwise it will hang. The SDS-011 has an HL-341 chip, checked
+ * with lsusb. The name of the driver is ch341.
+ *
+ * If the device(s) exist, the driver is loaded (or built in). Else only
+ * the modules missing in /sys/module are loaded, instead of starting
+ * modprobe each time.
+ *********************************************************************/
+void load_driver()
+{
+    char name[PORT_LEN + 10];
+    bool missing = false;
+    int  i;
+
+    /* with a table, port holds the -u pattern: check the ports it was
+     * expanded to. Else the port without @devid of a bus */
+    for (i = 0; i < fleet_cnt; i++)
+        if (access(fleet[i].port, F_OK) != 0) missing = true;
+
+    if (fleet_cnt == 0) {
+        strcpy(name, port);
+        port_split(name);
+        missing = access(name, F_OK) != 0;
+    }
+
+    if (! missing) return;
+
+    load_module("usbserial");
+    load_module("ch341");
+}
+
 /*********************************************************************
  * @brief Display in color
  * @param format : Message to display and optional arguments
@@ -165,41 +252,20 @@ void p_printf(int level, char *format, ...) {
     free(col);
 }
 
-/*********************************************************************
- * @brief : catch signals to close out correctly
- * @param sig_num : signal raised to program
- *********************************************************************/
-void signal_handler(int sig_num)
-{
-    switch(sig_num)
-    {
-        case SIGINT:
-        case SIGKILL:
-        case SIGABRT:
-        case SIGTERM:
-        default:
-            p_printf(YELLOW, (char *) "\nStopping SDS-011 monitor\n");
-            closeout(EXIT_SUCCESS);
-            break;
-    }
-}
-
 /*********************************************************************
  * @brief : setup signals
+ *
+ * The signals are caught on a self-pipe (see loop_signals()), so no
+ * output and no close out is done inside the handler. The program stops
+ * from its own context: the daemon sets all sensors to sleep, a reading
+ * loop ends after the current reading.
  *********************************************************************/
 void set_signals()
 {
-    struct sigaction act;
-
-    memset(&act, 0x0,sizeof(act));
-    act.sa_handler = &signal_handler;
-    sigemptyset(&act.sa_mask);
+    int sigs[] = {SIGTERM, SIGINT};
 
-    sigaction(SIGTERM,&act, NULL);
-    sigaction(SIGINT,&act, NULL);
-    sigaction(SIGABRT,&act, NULL);
-    sigaction(SIGSEGV,&act, NULL);
-    sigaction(SIGKILL,&act, NULL);
+    if (loop_signals(sigs, sizeof(sigs) / sizeof(sigs[0])) < 0)
+        p_printf(RED, (char *) "could not catch signals : %s\n", strerror(errno));
 }
 
 /*********************************************************************
@@ -215,12 +281,24 @@ void init_variables()
 
     action.g_data = true;            // use continuous data
     action.loop  = 10;                // how many read loops 
-    action.delay = 5;                 // delay between query read data
+    action.delay = 5000;              // ms between query read data
+    action.align = false;             // no alignment on wall clock
 
     action.s_devid = false;          // change devid
 
     action.s_working_mode = 0xff;     // set working mode (sleep/work)
     action.s_working_period = 0xff;   // set working period ( 0 - 30 min)
+
+    action.timing = false;            // report startup timing
+    action.discover = false;          // find sensors
+    action.calibrate = false;         // find max query rate
+    action.rate = 0;                  // not calibrated
+    action.apply = NULL;              // no wanted configuration
+    action.plan = 0;                  // no laser plan
+    action.run_daemon = false;        // run as daemon
+    action.query = NULL;              // query a daemon
+
+    deadband_init(&band, 0, 0, 0);    // all readings are reported
 }
 
 /*********************************************************************
@@ -240,6 +318,11 @@ void usage ()
     "-d             get Device ID\n"
     "-f             get firmware version\n"
     "-q             use query reporting mode       (default : continuous)\n"
+    "-L             find sensors on all serial ports (or -u patterns)\n"
+    "-X file        apply wanted configuration of file to all sensors\n"
+    "-c             find the max query rate of the sensor (saved in -F file)\n"
+    "-G sec         sample every sec seconds with the fewest laser hours\n"
+    "               (sets the working period, or the duty cycle with -S)\n"
 
     "\nSDS-011 setting: \n\n"
 
@@ -247,34 +330,115 @@ void usage ()
     "-P [ 0 - 30 ]  Set working period (minutes)\n"
     "-D [ 0xaabb ]  Set new device ID\n"
 
+    "\nDaemon: \n\n"
+    "-S             run as daemon, keep sensor(s) open and streaming\n"
+    "-C query       query running daemon         (data, stats, config, sched, laser,\n"
+    "                                             snap or trace)\n"
+    "-k path        socket of daemon             (default : %s)\n"
+    "-A             attach / detach sensors on hotplug (CH341)\n"
+    "-U path        simulate hotplug: read uevents from socket path\n"
+    "-Y sec         duty cycle: sleep between samples every sec seconds\n"
+    "-W sec         max warm up after wake up (default : %d seconds)\n"
+    "-V pct         warm when readings vary less than pct %% (default : %d %%)\n"
+    "-Q sec         query mode: query each sensor every sec (e.g. 0.5) seconds\n"
+    "-J x           max queries in flight with -Q  (default : %d)\n"
+    "-Z sec         adaptive: up to sec seconds between samples on stable air\n"
+    "               (query interval with -Q, else the working period)\n"
+    "-N sec         snapshot: query all sensors at once every sec seconds\n"
+
     "\nProgram setting: \n\n"
     "-l x           loop x times (0 = endless)   (default : %d loops)\n"
-    "-w x           x seconds between query data (default : %d seconds)\n"
+    "-w x           x seconds between query data (default : %ld seconds)\n"
+    "               (can be less than a second, e.g. 0.5)\n"
+    "-a             query on multiples of -w on the clock (e.g. :00, :05)\n"
+    "-E x[%%]        only report a reading that moved more than x ug/m3 or x %%\n"
+    "               (can be given twice: absolute and relative)\n"
+    "-B sec         with -E report a reading at least every sec seconds\n"
+    "-O dev         only report the points to rebuild the readings within\n"
+    "               dev ug/m3 (swinging door compression, not with -E)\n"
     "-H #           set correction for humidity  (e.g. 33.5 for 33.5%)\n"
     "-u device      set new device-port          (default : %s)\n"
+    "               (daemon: can be repeated or a pattern, e.g. /dev/ttyUSB*)\n"
+    "               (multi-drop bus: port@devid, e.g. /dev/ttyUSB0@1001)\n"
     "-b             set no color output          (default : color)\n"
+    "-T             report startup time to first reading\n"
+    "-t ms[:ms]     max wait on answer[:connect] (default : %d:%d ms)\n"
+    "-F file        state file for a warm start  (default : %s, \"\" = none)\n"
+    "-R file        flight recorder, written on SIGUSR1, crash or query 'trace'\n"
+    "                                            (default : %s, \"\" = none)\n"
     "-h             show help info\n"
     "-v             set verbose / debug info     (default : NOT set\n",
-     progname, PROGVERSION, action.loop, action.delay,port);
+     progname, PROGVERSION, sock_path, DUTY_WARMUP_DEF, WARM_TOL_DEF, QUERY_FLIGHT_DEF, action.loop, action.delay / 1000, port,
+     SDS011_ANSWER_TIMEOUT, SDS011_CONNECT_TIMEOUT, FLEET_STATE_FILE, TRACE_FILE);
+}
+
+/**
+ * compress the readings with a swinging door and print the points to
+ * archive, with the time (seconds since epoch)
+ *
+ * @param flush : end of the series, print the last points
+ */
+void swing_print(swing_door *sdt, float pm25, float pm10, bool flush = false)
+{
+    const char *name[2] = { "PM 2.5", "PM10" };
+    struct timespec ts;
+    sdt_point p;
+    float v[2] = { pm25, pm10 };
+    int i;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    for (i = 0; i < 2; i++) {
+        if (flush ? swing_flush(&sdt[i], &p) : swing_add(&sdt[i], ts.tv_sec + ts.tv_nsec / 1e9, v[i], &p))
+            printf("%.3f %s %f\n", p.t, name[i], p.v);
+    }
 }
 
 /**
  * read the PM values either in query or continuous mode
+ *
+ * @param first : the first measurement is received already (in pm25, pm10)
  */
 
-void read_PM()
+void read_PM(bool first, float pm25, float pm10)
 {
-    float pm25, pm10;
     int loopcount = action.loop;
+    int missed;
     uint8_t rmode = REPORT_QUERY;
+    loop_tick tick;         // period between queries
+    swing_door sdt[2];      // PM2.5 and PM10 with -O
+
+    swing_init(&sdt[0], swing_dev);
+    swing_init(&sdt[1], swing_dev);
   
     if (action.g_data) {
         rmode = REPORT_STREAM;
         p_printf(GREEN, (char *) "Continuously capturing data\n");
+
+        /* if the sensor is streaming already, a measurement is on its way.
+         * Use that, it also tells the reporting mode does not need a set */
+        if (! first && MySensor.Get_data(&pm25, &pm10) == SDS011_OK) first = true;
+
+        /* nothing received: the sensor could be asleep (e.g. after a daemon
+         * shutdown). Connect as usual, this wakes it up */
+        else if (! first && lazy && MySensor.begin(fd) == SDS011_ERROR) {
+            p_printf(RED, (char*) "Error during trying to connect\n");
+            closeout(EXIT_FAILURE);
+        }
+    }
+    else {
+        /* not faster than the sensor was calibrated to keep up with */
+        if (action.rate > action.delay) {
+            p_printf(YELLOW, (char *) "Sensor keeps up with one query per %.3g seconds (see -c)\n",
+                action.rate / 1000.0);
+            action.delay = action.rate;
+        }
+
+        p_printf(GREEN, (char *) "Query for data with an %.3g seconds interval\n", action.delay / 1000.0);
     }
-    else
-        p_printf(GREEN, (char *) "Query for data with an %d seconds interval\n", action.delay);
 
+    /* only sent when not known to be in this mode already: a streaming
+     * measurement or an earlier answer of the sensor is cached */
     if (MySensor.Set_data_reporting_mode(rmode) == SDS011_ERROR) {
         p_printf(RED, (char *)"error during setting reading mode\n");
         closeout(EXIT_FAILURE);
@@ -282,13 +446,29 @@ void read_PM()
     
     // if endless
     if (loopcount == 0) loopcount = 1; 
+
+    /* the time between queries is kept by a periodic timer, so the time
+     * of the query and output does not make the period drift */
+    if (! action.g_data) {
+        if (tick_start(&tick, action.delay, action.align) < 0) {
+            p_printf(RED, (char *)"error during starting timer\n");
+            closeout(EXIT_FAILURE);
+        }
+
+        // first query on a multiple of the interval
+        if (action.align) tick_wait(&tick);
+    }
     
-    while (loopcount)
+    while (loopcount && ! loop_signal)
     {
-        if (action.g_data){
+        if (first) {
+            first = false;      // already received
+        }
+        else if (action.g_data){
             
             // continuous mode
             if (MySensor.Get_data(&pm25, &pm10) == SDS011_ERROR) {
+                if (loop_signal) break;
                 p_printf(RED, (char *)"error during reading data\n");
                 closeout(EXIT_FAILURE);
             }
@@ -297,24 +477,191 @@ void read_PM()
             
             /* query data */
             if (MySensor.Query_data(&pm25, &pm10) == SDS011_ERROR) {
+                if (loop_signal) break;
                 p_printf(RED, (char *)"error during query data\n");
                 closeout(EXIT_FAILURE);
             }
         }
 
-        printf("PM 2.5 %f, PM10 %f\n", pm25, pm10);
+        if (action.timing) {
+            p_printf(BLUE, (char *) "Startup: driver %.1f ms, open %.1f ms, connect %.1f ms, first reading %.1f ms\n",
+                t_driver, t_open - t_driver, t_connect - t_open, elapsed_ms());
+            action.timing = false;
+        }
+
+        if (swing_dev)
+            swing_print(sdt, pm25, pm10);
+        else if (deadband_pass(&band, pm25, pm10))
+            printf("PM 2.5 %f, PM10 %f\n", pm25, pm10);
         
         // if not endless loop
         if (action.loop != 0)  loopcount--;
    
-        if (loopcount) {
+        // wait on next query
+        if (loopcount && ! action.g_data) {
             
-            // wait in between reading during query (if set)
-            if (action.delay && action.g_data == false) sleep(action.delay);
+            if ((missed = tick_wait(&tick)) > 0)
+                p_printf(RED, (char *)"missed %d deadline(s): query took longer than the interval\n", missed);
         }
     }
-    
-    printf("Number of requested loops reached\n");
+
+    if (! action.g_data) {
+        if (tick.missed)
+            p_printf(RED, (char *)"missed %lu of %lu deadlines\n", (unsigned long) tick.missed,
+                (unsigned long) tick.ticks);
+        tick_stop(&tick);
+    }
+
+    if (swing_dev) {
+        swing_print(sdt, 0, 0, true);
+        p_printf(YELLOW, (char *) "archived %lu of %lu points (ratio %.1f)\n",
+            sdt[0].out + sdt[1].out, sdt[0].in + sdt[1].in, swing_ratio(sdt, 2));
+    }
+
+    if (band.abs || band.rel)
+        p_printf(YELLOW, (char *) "reported %lu of %lu readings (%.1f %%), %lu on heartbeat\n",
+            band.out, band.in, deadband_ratio(&band), band.beats);
+
+    if (loop_signal)
+        p_printf(YELLOW, (char *) "\nStopping SDS-011 monitor\n");
+    else
+        printf("Number of requested loops reached\n");
+}
+
+/*********************************************************************
+ * @brief : follow the readings after wake up till they are stable
+ *
+ * The readings during warm up are shown, marked as warming, instead of
+ * thrown away after a fixed wait. The sensor is taken as warm after the
+ * max warm up (-W) anyway.
+ *
+ * @param pm25, pm10 : to store the first stable measurement
+ *
+ * @return : true if a stable measurement was stored
+ *********************************************************************/
+bool warm_up(float *pm25, float *pm10)
+{
+    int ret = WARM_BUSY, ok = SDS011_ERROR;
+    uint8_t rmode;
+    loop_tick tick;
+    warm_mon w;
+
+    if (MySensor.Get_data_reporting_mode(&rmode) == SDS011_ERROR) rmode = REPORT_STREAM;
+
+    p_printf(YELLOW, (char *)"Warming up till the readings are stable (max %d seconds)\n", duty_warmup);
+
+    // in query mode a query each second, as a streaming sensor sends
+    if (rmode == REPORT_QUERY && tick_start(&tick, 1000, false) < 0) {
+        p_printf(RED, (char *)"error during starting timer\n");
+        closeout(EXIT_FAILURE);
+    }
+
+    warm_start(&w, duty_warmup);
+
+    while (ret == WARM_BUSY && ! loop_signal)
+    {
+        if (rmode == REPORT_QUERY) {
+            if (w.cnt) tick_wait(&tick);
+            ok = MySensor.Query_data(pm25, pm10);
+        }
+        else
+            ok = MySensor.Get_data(pm25, pm10);
+
+        if (ok == SDS011_ERROR) {
+            ret = warm_expired(&w);
+            continue;
+        }
+
+        ret = warm_check(&w, *pm25, *pm10);
+
+        if (ret == WARM_BUSY) printf("PM 2.5 %f, PM10 %f (warming)\n", *pm25, *pm10);
+    }
+
+    if (rmode == REPORT_QUERY) tick_stop(&tick);
+
+    p_printf(GREEN, (char *)"Ready after %.1f seconds (%s)\n", warm_time(&w),
+        ret == WARM_READY ? "readings stable" : "max warm up");
+
+    return(ok == SDS011_OK);
+}
+
+/*********************************************************************
+ * @brief : find how fast the sensor (and its USB bridge) answers queries
+ *
+ * Each step queries at a shorter interval, with a periodic timer. The
+ * sensor keeps up with an interval when all queries are answered within
+ * it and no deadline was missed. It stops at the first step that fails.
+ * The shortest interval is kept in action.rate, to be saved.
+ *********************************************************************/
+void calibrate()
+{
+    long step[] = {1000, 500, 200, 100, 50, 20, 10, 5};
+    double t, lat, lat_sum, lat_max;
+    int  i, j, n, failed, missed;
+    uint8_t data[3], rmode;
+    float pm25, pm10;
+    loop_tick tick;
+
+    /* all values of the state must be known to save the result */
+    if (MySensor.Get_Firmware_Version(data) == SDS011_ERROR ||
+        MySensor.Get_Working_Period(data) == SDS011_ERROR ||
+        MySensor.Get_data_reporting_mode(&rmode) == SDS011_ERROR ||
+        MySensor.Set_data_reporting_mode(REPORT_QUERY) == SDS011_ERROR) {
+        p_printf(RED, (char *)"error during preparing sensor\n");
+        closeout(EXIT_FAILURE);
+    }
+
+    p_printf(GREEN, (char *) "Calibrating query rate of 0x%04x\n", MySensor.Get_DevID());
+    action.rate = 0;
+
+    for (i = 0; i < (int) (sizeof(step) / sizeof(step[0])); i++)
+    {
+        n = CAL_STEP_MS / step[i];
+        if (n < CAL_QUERIES) n = CAL_QUERIES;
+
+        failed = missed = 0;
+        lat_sum = lat_max = 0;
+
+        if (tick_start(&tick, step[i], false) < 0) {
+            p_printf(RED, (char *)"error during starting timer\n");
+            closeout(EXIT_FAILURE);
+        }
+
+        for (j = 0; j < n; j++)
+        {
+            t = elapsed_ms();
+
+            if (MySensor.Query_data(&pm25, &pm10) == SDS011_ERROR)
+                failed++;
+            else {
+                lat = elapsed_ms() - t;
+                lat_sum += lat;
+                if (lat > lat_max) lat_max = lat;
+            }
+
+            if (loop_signal) break;
+            if (j < n - 1) missed += tick_wait(&tick);
+        }
+
+        tick_stop(&tick);
+
+        printf("%5ld ms (%5.1f /s) : %3d queries, latency avg %6.1f max %6.1f ms, %d failed, %d missed\n",
+            step[i], 1000.0 / step[i], n, n > failed ? lat_sum / (n - failed) : 0, lat_max,
+            failed, missed);
+
+        if (failed || missed || lat_max >= step[i] || loop_signal) break;
+
+        action.rate = step[i];
+    }
+
+    if (action.rate)
+        p_printf(GREEN, (char *) "Sensor keeps up with %.1f queries per second (%ld ms)\n",
+            1000.0 / action.rate, action.rate);
+    else
+        p_printf(RED, (char *) "Sensor does not keep up with 1 query per second\n");
+
+    // back to the reporting mode it had
+    MySensor.Set_data_reporting_mode(rmode);
 }
 
 /*********************************************************************
@@ -329,6 +676,8 @@ void parse_cmdline(int opt, char *option)
     char *p = option;
     uint8_t i = 0;
     char buf[4];
+    double val;
+    long answer, connect;
 
     switch (opt) {
 
@@ -357,11 +706,176 @@ void parse_cmdline(int opt, char *option)
         break;
 
     case 'u':   // Set new device
-        strncpy(port,option,sizeof(port));
+        strncpy(port,option,sizeof(port) - 1);
+
+        // a pattern (e.g. /dev/ttyUSB*) adds all matching ports
+        if (strpbrk(option, "*?[")) {
+            fleet_add_glob(option);
+            break;
+        }
+
+        if (fleet_add(option) == NULL) {
+            p_printf(RED, (char*) "Too many devices (max %d)\n", FLEET_MAX_SENSORS);
+            exit(EXIT_FAILURE);
+        }
         break;
 
     case 'v':   // set debug output
+        if (! SDS011_DEBUG)
+            p_printf(YELLOW, (char *) "Debug output of the library is not compiled in (make DEBUG=1)\n");
+
         MySensor.EnableDebugging(1);
+        fleet_debug = true;
+        break;
+
+    case 't':   // set timeouts answer[:connect]
+        answer = strtol(option, &p, 10);
+        connect = fleet_connect_timeout;
+
+        if (*p == ':') connect = strtol(p + 1, &p, 10);
+
+        if (*p != 0x0 || answer < 1 || answer > 0xffff || connect < 1 || connect > 0xffff) {
+            p_printf(RED, (char *) "Invalid timeout %s [ms or ms:ms, 1 - 65535]\n", option);
+            exit(EXIT_FAILURE);
+        }
+
+        fleet_answer_timeout = (uint16_t) answer;
+        fleet_connect_timeout = (uint16_t) connect;
+
+        MySensor.Set_Timeout(fleet_answer_timeout, fleet_connect_timeout);
+        break;
+
+    case 'L':   // find sensors
+        action.discover = true;
+        break;
+
+    case 'c':   // find max query rate
+        action.calibrate = true;
+        break;
+
+    case 'F':   // state file
+        strncpy(fleet_state_file, option, sizeof(fleet_state_file) - 1);
+        break;
+
+    case 'G':   // plan laser use
+        action.plan = (int) strtol(option, NULL, 10);
+
+        if (action.plan < 1) {
+            p_printf(RED, (char *) "Invalid sample interval %s [seconds, more than 0]\n", option);
+            exit(EXIT_FAILURE);
+        }
+        break;
+
+    case 'X':   // apply wanted configuration
+        action.apply = option;
+        break;
+
+    case 'T':   // report startup timing
+        action.timing = true;
+        break;
+
+    case 'S':   // run as daemon
+        action.run_daemon = true;
+        break;
+
+    case 'C':   // query daemon
+        action.query = option;
+        break;
+
+    case 'A':   // hotplug
+        daemon_hotplug = true;
+        break;
+
+    case 'U':   // simulated hotplug
+        daemon_hotplug = true;
+        daemon_uevent_sim = option;
+        break;
+
+    case 'Y':   // duty cycle period
+        duty_period = (int) strtol(option, NULL, 10);
+        break;
+
+    case 'Z':   // adaptive sampling
+        adapt_max = (int) strtol(option, NULL, 10);
+
+        if (adapt_max < 1) {
+            p_printf(RED, (char *) "Invalid max interval %s [seconds, more than 0]\n", option);
+            exit(EXIT_FAILURE);
+        }
+        break;
+
+    case 'E':   // deadband: absolute or relative (with %)
+        val = strtod(option, &p);
+
+        if (val <= 0 || (*p != 0x0 && strcmp(p, "%") != 0)) {
+            p_printf(RED, (char *) "Invalid deadband %s [ug/m3 or percent, e.g. 2 or 10%%]\n", option);
+            exit(EXIT_FAILURE);
+        }
+
+        if (*p == '%') band.rel = val;
+        else band.abs = val;
+        break;
+
+    case 'B':   // heartbeat of the deadband
+        band.heartbeat = strtol(option, NULL, 10) * 1000L;
+
+        if (band.heartbeat < 1000) {
+            p_printf(RED, (char *) "Invalid heartbeat %s [seconds, more than 0]\n", option);
+            exit(EXIT_FAILURE);
+        }
+        break;
+
+    case 'R':   // flight recorder file
+        strncpy(trace_file, option, sizeof(trace_file) - 1);
+        break;
+
+    case 'O':   // swinging door compression
+        swing_dev = strtod(option, NULL);
+
+        if (swing_dev <= 0) {
+            p_printf(RED, (char *) "Invalid compression deviation %s [ug/m3, more than 0]\n", option);
+            exit(EXIT_FAILURE);
+        }
+        break;
+
+    case 'N':   // synchronised snapshots
+        snap_interval = (int) strtol(option, NULL, 10);
+        fleet_report_mode = REPORT_QUERY;
+
+        if (snap_interval < 1) {
+            p_printf(RED, (char *) "Invalid snapshot interval %s [seconds, more than 0]\n", option);
+            exit(EXIT_FAILURE);
+        }
+        break;
+
+    case 'V':   // variation of stable readings after warm up
+        warm_tol = (int) strtol(option, NULL, 10);
+
+        if (warm_tol < 1) {
+            p_printf(RED, (char *) "Invalid warm up variation %s [%%]\n", option);
+            exit(EXIT_FAILURE);
+        }
+        break;
+
+    case 'W':   // max warm up
+        duty_warmup = (int) strtol(option, NULL, 10);
+        break;
+
+    case 'Q':   // query scheduler interval
+        query_interval = (long) (strtod(option, NULL) * 1000);
+        fleet_report_mode = REPORT_QUERY;
+        break;
+
+    case 'J':   // max queries in flight
+        query_flight = (int) strtol(option, NULL, 10);
+        break;
+
+    case 'k':   // socket path of daemon
+        strncpy(sock_path, option, sizeof(sock_path) - 1);
+        break;
+
+    case 'a':   // align queries on the clock
+        action.align = true;
         break;
 
     case 'q':   // Set query reporting mode
@@ -386,23 +900,13 @@ void parse_cmdline(int opt, char *option)
         break;
     
     case 'w':   // delay between data reading
-        i = 0;
-        while (*p != 0x0){
-
-             buf[i++] = *p++;
-
-             if (i > sizeof(buf) -1) {
-                p_printf(RED, (char*) "Delay amount too long %s\n", option);
-                exit(EXIT_FAILURE);
-             }
-        }
-
-        buf[i] = 0x0;
-        action.delay = (uint8_t) strtod(buf, NULL);
+        action.delay = (long) (strtod(option, &p) * 1000);
         
-        if (action.delay < 3)
+        /* any interval the sensor can keep up with: a deadline that is
+         * missed is reported */
+        if (*p != 0x0 || action.delay < 1)
         {
-            p_printf(RED, (char*) "Delay of %d is less than 3 seconds\n", action.delay);
+            p_printf(RED, (char*) "Invalid delay %s [seconds, more than 0]\n", option);
             exit(EXIT_FAILURE);
         }           
 
@@ -474,6 +978,8 @@ void parse_cmdline(int opt, char *option)
 void main_action()
 {
     uint8_t data[3];
+    float pm25, pm10;
+    bool first = false;     // first stable measurement after wake up
     
     if (action.g_firmware){
         
@@ -548,11 +1054,10 @@ void main_action()
         }
         
         if (action.s_working_mode == MODE_WORK){ // added V 2.1
-            p_printf(YELLOW, (char*)"wait 30 seconds to stabalize working mode\n");
-    
-            sleep(30);
-            tcflush(fd,TCIOFLUSH);  // remove any received package during wait
 
+            /* the readings are followed till stable (was a wait of 30
+             * seconds and a flush of what was received in that time) */
+            first = warm_up(&pm25, &pm10);
         }
         else     // added V 2.1
         {
@@ -573,8 +1078,230 @@ void main_action()
         }
     }
     
+    if (action.calibrate) {
+        calibrate();
+        return;
+    }
+
     // check for reading PM values
-    read_PM();
+    read_PM(first, pm25, pm10);
+}
+
+/*********************************************************************
+ * @brief : find sensors on all candidate serial ports at the same time
+ * and display the inventory
+ *********************************************************************/
+void discover()
+{
+    int  i, found;
+    sensor_t *s;
+
+    // the ports of -u (patterns are expanded), else all USB serial ports
+    if (fleet_cnt == 0) {
+        fleet_add_glob("/dev/ttyUSB*");
+        fleet_add_glob("/dev/ttyACM*");
+    }
+
+    if (fleet_cnt == 0) {
+        p_printf(RED, (char *) "No serial ports found\n");
+        closeout(EXIT_FAILURE);
+    }
+
+    p_printf(YELLOW, (char *) "Searching on %d port(s)\n", fleet_cnt);
+
+    found = fleet_discover(fleet_connect_timeout);
+
+    for (i = 0; i < fleet_cnt; i++)
+    {
+        s = &fleet[i];
+
+        if (s->found)
+            printf("%-20s devid 0x%04x firmware %d-%d-%d\n", s->port,
+                s->sds.Get_DevID(), s->fw[0], s->fw[1], s->fw[2]);
+        else
+            printf("%-20s no sensor\n", s->port);
+    }
+
+    p_printf(GREEN, (char *) "Found %d sensor(s) in %.1f ms\n", found, elapsed_ms());
+}
+
+/*********************************************************************
+ * @brief : parse the wanted values of a line of the configuration file
+ *
+ * @return :
+ *  SDS011_ERROR : unknown or invalid value
+ *  SDS011_OK    : all good
+ *********************************************************************/
+int parse_conf(char *tok, sds011_conf_t *c)
+{
+    char *val;
+    long v;
+
+    for ( ; tok ; tok = strtok(NULL, " \t\n"))
+    {
+        if ((val = strchr(tok, '=')) == NULL) return(SDS011_ERROR);
+        *val++ = 0x0;
+
+        if (strcmp(tok, "report") == 0) {
+            if (strcmp(val, "query") == 0) c->rmode = REPORT_QUERY;
+            else if (strcmp(val, "stream") == 0) c->rmode = REPORT_STREAM;
+            else return(SDS011_ERROR);
+        }
+        else if (strcmp(tok, "mode") == 0) {
+            if (strcmp(val, "work") == 0) c->wmode = MODE_WORK;
+            else if (strcmp(val, "sleep") == 0) c->wmode = MODE_SLEEP;
+            else return(SDS011_ERROR);
+        }
+        else if (strcmp(tok, "period") == 0) {
+            v = strtol(val, NULL, 10);
+            if (v < 0 || v > 30) return(SDS011_ERROR);
+            c->period = v;
+        }
+        else if (strcmp(tok, "devid") == 0) {
+            v = strtol(val, NULL, 16);
+            if (v < 1 || v > 0xfffe) return(SDS011_ERROR);
+            c->devid = v;
+        }
+        else
+            return(SDS011_ERROR);
+    }
+
+    return(SDS011_OK);
+}
+
+/*********************************************************************
+ * @brief : bring all sensors to the configuration in a file
+ *
+ * Each line has a port (or port@devid on a bus) or * for all sensors,
+ * followed by the wanted values, e.g.
+ *
+ *   *             report=query period=0 mode=work
+ *   /dev/ttyUSB0  devid=1001
+ *
+ * The values of a port line take precedence over the * line. The
+ * sensors of -u (or else all USB serial ports) get the * line.
+ *********************************************************************/
+void apply_conf(char *file)
+{
+    sds011_conf_t all = {0xff, 0xff, 0xff, 0}, *w;
+    char line[200], *tok;
+    int  i, found, lineno = 0;
+    sensor_t *s;
+    FILE *fp;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        p_printf(RED, (char *) "Can not open %s\n", file);
+        closeout(EXIT_FAILURE);
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        lineno++;
+
+        if ((tok = strchr(line, '#'))) *tok = 0x0;
+        if ((tok = strtok(line, " \t\n")) == NULL) continue;
+
+        if (strcmp(tok, "*") == 0) w = &all;
+        else if ((s = fleet_find(tok)) == NULL && (s = fleet_add(tok)) == NULL) {
+            p_printf(RED, (char *) "Too many devices (max %d)\n", FLEET_MAX_SENSORS);
+            closeout(EXIT_FAILURE);
+        }
+        else w = &s->want;
+
+        if (parse_conf(strtok(NULL, " \t\n"), w) == SDS011_ERROR) {
+            p_printf(RED, (char *) "%s line %d: invalid value\n", file, lineno);
+            closeout(EXIT_FAILURE);
+        }
+    }
+
+    fclose(fp);
+
+    if (all.devid) {
+        p_printf(RED, (char *) "A device ID can not be the same for all sensors\n");
+        closeout(EXIT_FAILURE);
+    }
+
+    if (fleet_cnt == 0) {
+        fleet_add_glob("/dev/ttyUSB*");
+        fleet_add_glob("/dev/ttyACM*");
+    }
+
+    for (i = 0; i < fleet_cnt; i++)
+    {
+        w = &fleet[i].want;
+        if (w->rmode == 0xff) w->rmode = all.rmode;
+        if (w->wmode == 0xff) w->wmode = all.wmode;
+        if (w->period == 0xff) w->period = all.period;
+    }
+
+    p_printf(YELLOW, (char *) "Applying configuration to %d sensor(s)\n", fleet_cnt);
+
+    found = fleet_reconcile(FLEET_RECONCILE);
+
+    for (i = 0; i < fleet_cnt; i++)
+    {
+        s = &fleet[i];
+
+        if (s->synced)
+            printf("%-25s devid 0x%04x %s\n", s->name, s->sds.Get_DevID(),
+                s->sets ? "changed" : "unchanged");
+        else
+            printf("%-25s not done\n", s->name);
+    }
+
+    p_printf(found == fleet_cnt ? GREEN : RED, (char *) "%d of %d sensor(s) configured in %.1f ms\n",
+        found, fleet_cnt, elapsed_ms());
+}
+
+/*********************************************************************
+ * @brief : take samples with the fewest laser hours
+ *
+ * The daemon takes the plan over: the working period set on connect, or
+ * its duty cycle. Else the working period is applied to all sensors
+ * (see apply_conf()), a duty cycle needs the daemon.
+ *********************************************************************/
+void apply_plan()
+{
+    laser_plan plan;
+    int i;
+
+    plan_laser(action.plan, duty_warmup, &plan);
+
+    p_printf(GREEN, (char *) "Sample every %d seconds with %s", plan.interval, plan_name(&plan));
+    if (plan.type == PLAN_PERIOD) p_printf(GREEN, (char *) " of %d minute(s)", plan.period);
+    p_printf(GREEN, (char *) ": laser on %.1f %%, %.0f hours a year\n", plan.duty * 100,
+        plan.duty * PLAN_HOURS_YEAR);
+
+    if (action.run_daemon) {
+
+        if (query_interval) {
+            p_printf(RED, (char *) "A laser plan can not be used with -Q\n");
+            closeout(EXIT_FAILURE);
+        }
+
+        fleet_work_period = plan.period;
+        duty_period = plan.type == PLAN_DUTY ? plan.interval : 0;
+        return;
+    }
+
+    if (plan.type == PLAN_DUTY) {
+        p_printf(YELLOW, (char *) "A duty cycle needs the daemon: %s -S -G %d\n", progname, action.plan);
+        closeout(EXIT_SUCCESS);
+    }
+
+    if (fleet_cnt == 0) fleet_add(port);
+
+    for (i = 0; i < fleet_cnt; i++) {
+        fleet[i].want.period = plan.period;
+        fleet[i].want.wmode = MODE_WORK;
+    }
+
+    i = fleet_reconcile(FLEET_RECONCILE);
+
+    p_printf(i == fleet_cnt ? GREEN : RED, (char *) "%d of %d sensor(s) set to working period %d\n",
+        i, fleet_cnt, plan.period);
+
+    closeout(i == fleet_cnt ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 /*********************************************************************
@@ -583,11 +1310,11 @@ void main_action()
 int main(int argc, char *argv[])
 {
     int opt;
+    uint16_t addr;
+    sds011_state_t *st;
+    char name[PORT_LEN + 16];
 
-    if (geteuid() != 0)  {
-        p_printf(RED,(char *)"You must be super user\n");
-        exit(EXIT_FAILURE);
-    }
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
 
     /* save name for (potential) usage display */
     strncpy(progname,argv[0],20);
@@ -595,54 +1322,146 @@ int main(int argc, char *argv[])
     init_variables();
 
     /* parse commandline */
-    while ((opt = getopt(argc, argv, "H:hbmprdfvM:P:D:u:ql:w:")) != -1)
+    while ((opt = getopt(argc, argv, "H:hbmprdfvcM:P:D:u:qal:w:SC:k:Tt:AU:LY:W:V:Q:J:X:F:G:Z:N:E:B:O:R:")) != -1)
        parse_cmdline(opt, optarg);
 
+    if (swing_dev && (band.abs || band.rel)) {
+        p_printf(RED, (char *) "Swinging door compression (-O) can not be used with a deadband (-E)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* query a running daemon, does not touch any sensor */
+    if (action.query) {
+        if (client_query(action.query) == SDS011_ERROR) {
+            p_printf(RED, (char *) "could not connect to daemon on %s\n", sock_path);
+            exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    if (geteuid() != 0)  {
+        p_printf(RED,(char *)"You must be super user\n");
+        exit(EXIT_FAILURE);
+    }
+
     /* set signals */
     set_signals();
 
-    /* you need the driver to be loaded before opening /dev/ttyUSBx
-     * otherwise it will hang. The SDS-011 has an HL-341 chip, checked
-     * with lsusb. The name of the driver is ch341.
-     * One can change the system setup so this is done automatically
-     * when reboot and then you can remove the call below. */
-    system("modprobe usbserial");
-    system("modprobe ch341");
+    /* the flight recorder is written on a crash, the file is opened now.
+     * The readings of the sensors are added, to recover on a restart */
+    if (trace_start() == SDS011_ERROR)
+        p_printf(RED, (char *) "could not open flight recorder %s : %s\n", trace_file, strerror(errno));
+
+    trace_add(fleet_crash_write);
+
+    /* load driver if needed */
+    load_driver();
+    t_driver = elapsed_ms();
+
+    if (action.discover) {
+        discover();
+        closeout(EXIT_SUCCESS);
+    }
+
+    if (action.apply) {
+        apply_conf(action.apply);
+        closeout(EXIT_SUCCESS);
+    }
+
+    if (action.plan) apply_plan();
 
-    fd = open(port, O_RDWR | O_NOCTTY | O_SYNC);
+    if (action.run_daemon) {
+
+        if (duty_period && (duty_warmup < 1 || duty_period < duty_warmup + DUTY_SLACK)) {
+            p_printf(RED, (char *) "Duty cycle of %d seconds is too short for warm up of %d seconds\n",
+                duty_period, duty_warmup);
+            closeout(EXIT_FAILURE);
+        }
+
+        if (query_interval && (duty_period || query_interval < 100 || query_flight < 1)) {
+            p_printf(RED, (char *) "Query interval must be at least 0.1 second, with -J 1 or more and without -Y\n");
+            closeout(EXIT_FAILURE);
+        }
+
+        if (adapt_max && (duty_period || fleet_work_period != 0xff ||
+            (query_interval && adapt_max * 1000L < query_interval))) {
+            p_printf(RED, (char *) "Adaptive sampling can not be used with a duty cycle or laser plan, and -Z must be more than -Q\n");
+            closeout(EXIT_FAILURE);
+        }
+
+        // streaming adapts the working period, which is in minutes
+        if (adapt_max && ! query_interval && adapt_max < 60) {
+            p_printf(RED, (char *) "Without -Q, -Z is the max working period and must be at least 60 seconds\n");
+            closeout(EXIT_FAILURE);
+        }
+
+        if (snap_interval && (duty_period || query_interval || adapt_max || fleet_work_period != 0xff)) {
+            p_printf(RED, (char *) "Snapshots can not be used with -Y, -Q, -Z or -G\n");
+            closeout(EXIT_FAILURE);
+        }
+
+        // default port if none was given (not needed with hotplug)
+        if (fleet_cnt == 0 && ! daemon_hotplug) fleet_add(port);
+
+        closeout(daemon_run() == SDS011_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    /* When only streaming data is needed, there is no need to probe the
+     * sensor first nor to flush: a measurement that is already received
+     * can be used right away. */
+    lazy = action.g_data && ! action.g_firmware && ! action.g_devid &&
+           ! action.s_devid && ! action.g_reporting_mode &&
+           ! action.g_working_mode && ! action.g_working_period &&
+           action.s_working_mode == 0xff && action.s_working_period == 0xff &&
+           ! action.calibrate;
+
+    /* port@devid : talk to one sensor on a multi-drop bus */
+    addr = port_split(port);
+    if (addr) MySensor.Join_Bus(&bus, addr);
+
+    /* saved state of an earlier run */
+    strcpy(name, port);
+    if (addr) sprintf(name + strlen(name), "@%04x", addr);
+    st = lazy ? NULL : fleet_state_find(name);
+    action.rate = fleet_rate_get(name);
+
+    /* open, configure and flush (see open_port() for the flush problem) */
+    fd = open_port(port, ! lazy && st == NULL);
+
+    /* -T measures from the open: a measurement that was received before
+     * would show as a first reading in no time */
+    if (action.timing && fd >= 0) tcflush(fd, TCIFLUSH);
+    t_open = elapsed_ms();
 
     if (fd < 0) {
+        fd = 0xff;
         p_printf(RED, (char *) "could not open %s\n", port);
         exit(EXIT_FAILURE);
     }
 
-    configure_interface(fd, B9600);
-    set_blocking(fd, 0);
-
-   /* There is a problem with flushing buffers on a serial USB that can
-    * not be solved. The only thing one can try is to flush any buffers
-    * after some delay:
-    *
-    * https://bugzilla.kernel.org/show_bug.cgi?id=5730
-    * https://stackoverflow.com/questions/13013387/clearing-the-serial-ports-buffer
-    */
-    usleep(10000);                      // required to make flush work, for some reason
-    tcflush(fd,TCIOFLUSH);
-
     p_printf(YELLOW, (char *) "Connecting to SDS-011\n");
     
     /* try overcome connection problems before real actions (see document)
      * this will also inform the driver about the file description to use for writting
      * and reading */
-    if (MySensor.begin(fd) == SDS011_ERROR)
+    if ((st == NULL || MySensor.Warm_Start(fd, st) == SDS011_ERROR) &&
+        MySensor.begin(fd, lazy) == SDS011_ERROR)
     {
         p_printf(RED, (char*) "Error during trying to connect\n");
         closeout(EXIT_FAILURE);
     }
+    t_connect = elapsed_ms();
     p_printf(GREEN, (char *) "Connected\n");
     
     /* perform the requested actions */
     main_action();
 
+    /* for a warm start next time */
+    fleet_state_put(name, &MySensor);
+
+    if (action.calibrate && action.rate && fleet_rate_put(name, action.rate) == SDS011_ERROR)
+        p_printf(RED, (char *) "Could not save query rate (see -F)\n");
+    fleet_state_save();
+
     closeout(EXIT_SUCCESS);
 }
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Shared definitions of the sds program modules
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SDS_H
+#define _SDS_H
+
+/*! color display enable */
+#define RED     1
+#define GREEN   2
+#define YELLOW  3
+#define BLUE    4
+#define WHITE   5
+
+/**
+ * @brief Display in color
+ * @param format : Message to display and optional arguments
+ *                 same as printf
+ * @param level :  1 = RED, 2 = GREEN, 3 = YELLOW 4 = BLUE 5 = WHITE
+ */
+void p_printf (int level, char *format, ...);
+
+/**
+ * @brief close program correctly
+ * @param val : exit value
+ */
+void closeout(int val);
+
+/* indicate these serial calls are C-programs and not to be linked */
+extern "C" {
+    void configure_interface(int fd, int speed);
+    void set_blocking(int fd, int should_block);
+    void restore_ser(int fd);
+}
+
+#endif /* _SDS_H */
@@ -31,36 +31,266 @@
  */
 
 #include "sds011_lib.h"
+#include "sds_trace.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
 
-uint8_t SDS011_Packet[SDS011_SENDPACKET_LEN];
-bool    _PendingConfReq = false;   // indicate configuration request pending
-uint8_t  _dev_id[2]= {0xff,0xff};  //  holds current device ID
-float   _RelativeHumidity = 0;     // for humidity correction
-int     _fd;                       // file description to use
-bool    _sdsDebug = false;         // enable debug messages
-sds011_response_t data;            // holds parsed received data
+// debug output is on (constant false with SDS011_DEBUG 0: left out)
+#define DEBUG_ON (SDS011_DEBUG && _sdsDebug)
+
+/********************************************************************
+ * @brief : monotonic clock in milliseconds, for the deadlines
+ ********************************************************************/
+static long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return(ts.tv_sec * 1000L + ts.tv_nsec / 1000000L);
+}
 
 /********************************************************************
  * @brief : constructor and initialize variables
+ *
+ * All state is kept per instance, so one SDS011 object can be used
+ * for each connected sensor.
  ********************************************************************/
 SDS011::SDS011(void)
 {
+    pthread_mutexattr_t attr;
+
     _fd = 0xff;
+    _PendingConfReq = false;
+    _dev_id[0] = _dev_id[1] = 0xff;
+    _RelativeHumidity = 0;
+    _sdsDebug = false;
+    _rx_cnt = 0;
+    _rxp = _rx;
+    _rxp_cnt = &_rx_cnt;
+    _bus = NULL;
+    _in_cnt = 0;
+    _reg_valid = 0;
+    _qdata_sent = false;
+    _woken = false;
+    _var_cnt = 0;
+    _q_cnt = 0;
+    _q_seq = _q_merged = _q_timeouts = 0;
+    _pending_since = 0;
+
+    // Queue_Next() sends with Send_Command() while holding the lock
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&_q_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    _answer_timeout = SDS011_ANSWER_TIMEOUT;
+    _connect_timeout = SDS011_CONNECT_TIMEOUT;
+    memset(&data, 0x0, sizeof(data));
+}
+
+/********************************************************************
+ * @brief : set the timeouts used on the next calls
+ *
+ * @param answer : max milliseconds to wait on an answer or measurement
+ * @param connect : max milliseconds for begin() to connect
+ ********************************************************************/
+void SDS011::Set_Timeout(uint16_t answer, uint16_t connect)
+{
+    _answer_timeout = answer;
+    _connect_timeout = connect;
 }
+/********************************************************************
+ * @brief : add the sensor to a multi-drop bus
+ *
+ * @param bus : bus shared by the sensors on the port
+ * @param devid : device ID of this sensor
+ *
+ * @return :
+ *  SDS011_ERROR : bus is full
+ *  SDS011_OK    : all good
+ ********************************************************************/
+int SDS011::Join_Bus(sds011_bus *bus, uint16_t devid)
+{
+    if (_bus != bus) {
+        Leave_Bus();
+
+        if (bus->cnt == SDS011_BUS_MAX) return(SDS011_ERROR);
+
+        bus->dev[bus->cnt++] = this;
+        _bus = bus;
+        _rxp = bus->rx;
+        _rxp_cnt = &bus->rx_cnt;
+    }
+
+    _dev_id[0] = devid & 0xff;
+    _dev_id[1] = (devid >> 8) & 0xff;
+    _in_cnt = 0;
+
+    return(SDS011_OK);
+}
+
+/********************************************************************
+ * @brief : remove the sensor from its bus (if any)
+ ********************************************************************/
+void SDS011::Leave_Bus()
+{
+    int i;
+
+    if (_bus == NULL) return;
+
+    for (i = 0; i < _bus->cnt; i++) {
+        if (_bus->dev[i] == this) {
+            _bus->dev[i] = _bus->dev[--_bus->cnt];
+            break;
+        }
+    }
+
+    _bus = NULL;
+    _rxp = _rx;
+    _rxp_cnt = &_rx_cnt;
+    _in_cnt = 0;
+}
+
 /********************************************************************
  * @brief : first call to initiatize the library
  * 
  * @param fd: file descriptor of opened device
+ * @param lazy: if true, do not probe the sensor for the firmware
  * 
  * @return :
  *  SDS011_ERROR : could not send command
  *  SDS011_OK    : all good
  ********************************************************************/
-int SDS011::begin(int fd)
+int SDS011::begin(int fd, bool lazy)
 {
+    pthread_mutex_lock(&_q_lock);
+    _q_cnt = 0;
+    _q_merged = _q_timeouts = 0;
+    _qdata_sent = false;
+    pthread_mutex_unlock(&_q_lock);
+
+    // could be another sensor, or changed since
+    _reg_valid = 0;
+    _var_cnt = 0;
+    _woken = false;
+
+    if (lazy) {
+        if (DEBUG_ON) printf("\n\tConnect without probe\n");
+
+        _fd = fd;
+        _rx_cnt = 0;
+        _in_cnt = 0;
+        _PendingConfReq = false;
+        return(SDS011_OK);
+    }
+
     return(Try_Connect(fd));
 }
 
+/********************************************************************
+ * @brief : connect using the state saved from an earlier connection
+ *
+ * @param fd: file descriptor of opened device
+ * @param st: state saved with Get_State()
+ *
+ * @return :
+ *  SDS011_ERROR : no measurement of the saved device ID: call begin()
+ *  SDS011_OK    : connected
+ ********************************************************************/
+int SDS011::Warm_Start(int fd, const sds011_state_t *st)
+{
+    sds011_response_t r;
+    long deadline;
+
+    if (st->devid == 0) return(SDS011_ERROR);
+
+    if (DEBUG_ON) printf("\n\tWarm start for device 0x%04x\n", st->devid);
+
+    begin(fd, true);
+
+    // on a bus the device ID is known already
+    if (_bus == NULL) _dev_id[0] = _dev_id[1] = 0xff;
+
+    // streaming: a measurement can be waiting. Else ask for one
+    if (Read_Response(&r) != SDS011_OK || r.cmd_id != SDS011_DATA) {
+
+        prepare_packet(SDS011_QDATA);
+        if (write_sds() == SDS011_ERROR) return(SDS011_ERROR);
+
+        // do not lose much time on a different sensor: begin() follows
+        deadline = now_ms() + (_answer_timeout < SDS011_WARM_TIMEOUT ? _answer_timeout : SDS011_WARM_TIMEOUT);
+
+        do {
+            if (read_sds(deadline - now_ms()) == SDS011_ERROR) break;
+        } while (data.cmd_id != SDS011_DATA);
+
+        if (data.cmd_id != SDS011_DATA) r.devid = 0;
+        else r = data;
+    }
+
+    if (Warm_Accept(st, &r) == SDS011_ERROR) {
+        _reg_valid = 0;
+        return(SDS011_ERROR);
+    }
+
+    return(SDS011_OK);
+}
+
+/********************************************************************
+ * @brief : take the saved state in the cache if a measurement comes
+ * from the saved device
+ *
+ * @param st: state saved with Get_State()
+ * @param r : received response
+ *
+ * @return :
+ *  SDS011_ERROR : not a measurement of the saved device ID
+ *  SDS011_OK    : connected
+ ********************************************************************/
+int SDS011::Warm_Accept(const sds011_state_t *st, const sds011_response_t *r)
+{
+    if (st->devid == 0 || r->cmd_id != SDS011_DATA || r->devid != st->devid) {
+        if (DEBUG_ON) printf("\n\tNo measurement of saved device\n");
+        return(SDS011_ERROR);
+    }
+
+    // the rest of the saved state (a streaming measurement tells better)
+    memcpy(_fw, st->fw, 3);
+    _reg[SDS011_PERIOD] = st->period;
+    if (! (_reg_valid & (1 << SDS011_MODE))) _reg[SDS011_MODE] = st->rmode;
+    _reg_valid |= (1 << SDS011_FWVER) | (1 << SDS011_MODE) | (1 << SDS011_PERIOD);
+
+    trace_state(TRACE_CONNECT, _fd, st->devid, 0);
+
+    return(SDS011_OK);
+}
+
+/********************************************************************
+ * @brief : get the state to save for Warm_Start() from the cache.
+ * Only the values that are known are filled in st.
+ *
+ * @return :
+ *  SDS011_ERROR : not all values are known
+ *  SDS011_OK    : all values filled in st
+ ********************************************************************/
+int SDS011::Get_State(sds011_state_t *st)
+{
+    uint16_t need = (1 << SDS011_FWVER) | (1 << SDS011_MODE) | (1 << SDS011_PERIOD);
+
+    if (Get_DevID() != 0xffff) st->devid = Get_DevID();
+    if (_reg_valid & (1 << SDS011_FWVER)) memcpy(st->fw, _fw, 3);
+    if (_reg_valid & (1 << SDS011_MODE)) st->rmode = _reg[SDS011_MODE];
+    if (_reg_valid & (1 << SDS011_PERIOD)) st->period = _reg[SDS011_PERIOD];
+
+    if ((_reg_valid & need) != need || Get_DevID() == 0xffff) return(SDS011_ERROR);
+
+    return(SDS011_OK);
+}
+
 /**
  * @brief : Enable or disable the printing of sent/response HEX values.
  *
@@ -106,7 +336,9 @@ uint8_t SDS011::ProcessResponse(const uint8_t *packet, uint8_t length)
 {
     int i; 
     
-    if (_sdsDebug) {
+    trace_frame(TRACE_RX, _fd, packet, length);
+
+    if (DEBUG_ON) {
         printf("Received: ");
         for (i=0 ; i < length; i++) printf("%02X ", packet[i]);
         printf("\n");
@@ -133,7 +365,23 @@ uint8_t SDS011::ProcessResponse(const uint8_t *packet, uint8_t length)
         if (_RelativeHumidity){
             data.pm25 = data.pm25 * 2.8 * pow((100 - _RelativeHumidity), -0.3745);
         }
-        
+
+        Track_Variation(data.pm25, data.pm10);
+
+        // measuring, and streaming when this was not an answer on a query
+        _reg[SDS011_SLEEP] = MODE_WORK;
+        _reg_valid |= 1 << SDS011_SLEEP;
+
+        pthread_mutex_lock(&_q_lock);
+
+        if (! _qdata_sent) {
+            _reg[SDS011_MODE] = REPORT_STREAM;
+            _reg_valid |= 1 << SDS011_MODE;
+        }
+
+        _qdata_sent = false;
+        pthread_mutex_unlock(&_q_lock);
+
         return(SDS011_OK);
     } 
     else if (data.cmd_id == SDS011_CONF) {
@@ -148,21 +396,29 @@ uint8_t SDS011::ProcessResponse(const uint8_t *packet, uint8_t length)
                 data.type = packet[3];
                 data.mode = packet[4];
 
+                // the answer on a query and on a set has the current value
+                _reg[data.confcmd] = data.mode;
+                _reg_valid |= 1 << data.confcmd;
+
             case SDS011_DEVID:      // already handled 
                 break;
 
             case SDS011_FWVER:
-                data.year = packet[3];
-                data.month = packet[4];
-                data.day = packet[5];
+                data.year = _fw[0] = packet[3];
+                data.month = _fw[1] = packet[4];
+                data.day = _fw[2] = packet[5];
+                _reg_valid |= 1 << SDS011_FWVER;
                 break;
 
             default: return(SDS011_ERROR);
         }
             
-        // got response on configuration
+        // got response on configuration: next waiting command can go
+        pthread_mutex_lock(&_q_lock);
         _PendingConfReq = false;
-        
+        Queue_Next();
+        pthread_mutex_unlock(&_q_lock);
+
         return(SDS011_OK);
     } 
 
@@ -178,26 +434,57 @@ uint8_t SDS011::ProcessResponse(const uint8_t *packet, uint8_t length)
  * is still a data packet. The _PendingConfReq-flag will prevent sending
  * another configuration request if not received answer on previous yet
  *
+ * The wait ends as soon as the answer is received, or when the answer
+ * timeout has passed.
+ *
  * @return :
  *  SDS011_ERROR : could not send command
  *  SDS011_OK    : all good
  *********************************************************************/
 int SDS011::Wait_For_answer()
 {
-    int i = 0;      // prevent deadlock
-     
+    long deadline = now_ms() + _answer_timeout;
+    long left;
+
     while (_PendingConfReq)
     {
-        // max 20 times
-        if(i++ > 20) return(SDS011_ERROR);
+        left = deadline - now_ms();
+
+        // prevent deadlock
+        if (left <= 0) return(SDS011_ERROR);
 
-         // read & parse response from sds
-        read_sds();
+        // read & parse response from sds
+        read_sds(left);
     }
     
     return(SDS011_OK);
 }
 
+/*********************************************************************
+ * @brief : get cached value of a parameter
+ *
+ * @param c : SDS011_MODE, SDS011_SLEEP or SDS011_PERIOD
+ * @param p : return value
+ *
+ * @return : true if the value is known
+ *********************************************************************/
+bool SDS011::Cache_Get(uint8_t c, uint8_t *p)
+{
+    uint8_t period;
+
+    if (! (_reg_valid & (1 << c))) return(false);
+
+    // with a working period the sensor sleeps and wakes up by itself
+    if (c == SDS011_SLEEP && ! (Cache_Get(SDS011_PERIOD, &period) && period == 0))
+        return(false);
+
+    *p = _reg[c];
+
+    if (DEBUG_ON) printf("\n\tCached parameter %02x : %d\n", c, *p);
+
+    return(true);
+}
+
 /*********************************************************************
  * @brief : get current parameter
  * 
@@ -225,9 +512,11 @@ int SDS011::Wait_For_answer()
  *********************************************************************/
 int SDS011::Get_Param(uint8_t c, uint8_t *p)
 {
+    if (Cache_Get(c, p)) return(SDS011_OK);
+
     prepare_packet(c);
 
-    if (_sdsDebug) {
+    if (DEBUG_ON) {
         
         if (c == SDS011_SLEEP) printf("\n\tget working mode\n");
         else if (c == SDS011_MODE) printf("\n\tget reporting mode\\n");
@@ -239,7 +528,7 @@ int SDS011::Get_Param(uint8_t c, uint8_t *p)
 
     // read / display response from sds
     if (Wait_For_answer() == SDS011_ERROR) {
-        if (_sdsDebug) printf("Error during sending\n");
+        if (DEBUG_ON) printf("Error during sending\n");
         return (SDS011_ERROR);
     }
 
@@ -251,20 +540,24 @@ int SDS011::Get_Param(uint8_t c, uint8_t *p)
 /*********************************************************************
  * @brief : initialise packet to be send.
  * @param data1 : the data1 byte to be included
+ * @param packet : packet to initialise (NULL is SDS011_Packet)
  *********************************************************************/
-void SDS011::prepare_packet(uint8_t data1)
+void SDS011::prepare_packet(uint8_t data1, uint8_t *packet)
 {
     int i;
-    for (i = 0; i < SDS011_SENDPACKET_LEN; i++) SDS011_Packet[i]=0x0;
 
-    SDS011_Packet[0] = SDS011_BYTE_BEGIN;
-    SDS011_Packet[1] = SDS011_BYTE_CMD;
-    SDS011_Packet[2] = data1;
-    SDS011_Packet[18] = SDS011_BYTE_END;
+    if (packet == NULL) packet = SDS011_Packet;
+
+    for (i = 0; i < SDS011_SENDPACKET_LEN; i++) packet[i]=0x0;
+
+    packet[0] = SDS011_BYTE_BEGIN;
+    packet[1] = SDS011_BYTE_CMD;
+    packet[2] = data1;
+    packet[18] = SDS011_BYTE_END;
     
     // add device ID
-    SDS011_Packet[15] = _dev_id[0];
-    SDS011_Packet[16] = _dev_id[1];
+    packet[15] = _dev_id[0];
+    packet[16] = _dev_id[1];
 }
 
 /*********************************************************************
@@ -294,18 +587,20 @@ void SDS011::prepare_packet(uint8_t data1)
  *********************************************************************/
 int SDS011::Set_Param (uint8_t mode, uint8_t p) 
 {
+    uint8_t cur;
+
     if (mode == SDS011_PERIOD) {
         
         if (p < 0 || p > 30) {
             
-            if (_sdsDebug)  {
+            if (DEBUG_ON)  {
                 printf("%d is invalid period, must be 0 to 30 minutes\n", p);
             }
             return(SDS011_ERROR);
         }
     }
 
-    if (_sdsDebug) {
+    if (DEBUG_ON) {
         if (mode == SDS011_SLEEP){
             printf("\n\tSet working mode to ");
             if (p == MODE_WORK) printf("Working\n");
@@ -323,13 +618,16 @@ int SDS011::Set_Param (uint8_t mode, uint8_t p)
         }
     }
 
+    // nothing changes
+    if (Cache_Get(mode, &cur) && cur == p) return(SDS011_OK);
+
     prepare_packet(mode);
 
     SDS011_Packet[3] = 1;       // SET mode
     SDS011_Packet[4] = p;       // set parameter
 
     if (send_sds() == SDS011_ERROR) {
-        if (_sdsDebug) printf("Error during sending\n");
+        if (DEBUG_ON) printf("Error during sending\n");
         return (SDS011_ERROR);
     }
 
@@ -353,19 +651,27 @@ int SDS011::Set_Param (uint8_t mode, uint8_t p)
  *********************************************************************/
 int SDS011::Report_Data(uint8_t rmode, float *PM25, float *PM10)
 {
+   long deadline, left;
+
    if(rmode == REPORT_QUERY) {
         
         prepare_packet(SDS011_QDATA);
 
-        if (_sdsDebug) printf("\n\tQuery for data\n");
+        if (DEBUG_ON) printf("\n\tQuery for data\n");
 
         if (send_sds() == SDS011_ERROR) return(SDS011_ERROR);
     }
     else
-        if (_sdsDebug) printf("\n\tObtain data in continuous mode\n");
+        if (DEBUG_ON) printf("\n\tObtain data in continuous mode\n");
         
-    // read / parse response from sds
-    if (read_sds() == SDS011_ERROR) return(SDS011_ERROR);
+    // read / parse response from sds, skipping late configuration answers
+    deadline = now_ms() + _answer_timeout;
+
+    do {
+        left = deadline - now_ms();
+        if (left <= 0 || read_sds(left) == SDS011_ERROR) return(SDS011_ERROR);
+
+    } while (data.cmd_id != SDS011_DATA);
 
     // return received data
     *PM25 = data.pm25;
@@ -388,7 +694,12 @@ int SDS011::Report_Data(uint8_t rmode, float *PM25, float *PM10)
  *********************************************************************/
 int SDS011::Get_Firmware_Version(uint8_t *fwdata)
 {
-    if (_sdsDebug) printf("\n\tRead Version information data\n");
+    if (_reg_valid & (1 << SDS011_FWVER)) {
+        memcpy(fwdata, _fw, 3);
+        return(SDS011_OK);
+    }
+
+    if (DEBUG_ON) printf("\n\tRead Version information data\n");
 
     prepare_packet(SDS011_FWVER);
 
@@ -437,44 +748,87 @@ int SDS011::Set_Humidity_Cor (float h)
  * This is actually a terrible way to handle... but there is no other option
  * on serial-USB.
  *
+ * The request is resent with an exponential backoff plus jitter, until the
+ * connect timeout has passed. Each wait ends as soon as the answer is
+ * received, so a healthy sensor connects in one round trip and a dead
+ * sensor fails after the connect timeout (see Set_Timeout()). The resends
+ * take turns between the firmware request and a wake up, as a sleeping
+ * sensor does not answer anything else. After the answer on a wake up the
+ * firmware is asked right away: connected is when the firmware is known.
+ *
  * @return :
  *  SDS011_ERROR : could not send command
  *  SDS011_OK    : all good
  *********************************************************************/
 int SDS011::Try_Connect(int fd)
 {
-    if (_sdsDebug) printf("\n\tTry to connect\n");
+    long deadline, until, wait, left;
+    int  attempt = 0, resend = 0;
+
+    if (DEBUG_ON) printf("\n\tTry to connect\n");
 
     _fd = fd;
-    
+    _rx_cnt = 0;                // drop anything from an earlier connection
+    _in_cnt = 0;
+
+    deadline = now_ms() + _connect_timeout;
+
     // try to read firmware
     prepare_packet(SDS011_FWVER);
 
-    // sent packet. this is the first time so not connected
-    if (send_sds() == SDS011_ERROR) return (SDS011_ERROR);
+    while (1)
+    {
+        _PendingConfReq = false;      // enable (re)send
 
-    int i = 0;              // prevent deadlock
-    int j = 0;
+        if (send_sds() == SDS011_ERROR) break;
 
-    while (_PendingConfReq) // as long as no answer
-    {
-        usleep(10000);       // wait
-        read_sds();          // check for answer
+        // wait SDS011_RETRY_BASE, doubled every attempt, + up to 50% jitter
+        wait = SDS011_RETRY_BASE << attempt;
 
-        if(i++ == 2 && _PendingConfReq) {
-            i = 0;
-            
-            // resubmit
-            _PendingConfReq = false;      // enable resend
+        if (wait >= SDS011_RETRY_MAX) wait = SDS011_RETRY_MAX;
+        else attempt++;
 
-            if (send_sds() == SDS011_ERROR || j++ > 10){
-                 _fd = 0xff;              // No device connection.
-                 return(SDS011_ERROR);
-            }
+        wait += rand() % (wait / 2 + 1);
+
+        until = now_ms() + wait;
+        if (until > deadline) until = deadline;
+
+        // check for answer
+        while (_PendingConfReq && (left = until - now_ms()) > 0)
+            read_sds(left);
+
+        if (_reg_valid & (1 << SDS011_FWVER)) {
+            trace_state(TRACE_CONNECT, _fd, Get_DevID(), attempt);
+            return(SDS011_OK);
+        }
+
+        if (now_ms() >= deadline) break;
+
+        // answered the wake up: awake now, ask the firmware
+        if (! _PendingConfReq) {
+            prepare_packet(SDS011_FWVER);
+            continue;
         }
+
+        if (DEBUG_ON) printf("\n\tNo answer, resend\n");
+        trace_state(TRACE_RESEND, _fd, Get_DevID(), attempt);
+
+        // a sleeping sensor only answers a wake up (e.g. after a shutdown)
+        if (++resend & 1) {
+            prepare_packet(SDS011_SLEEP);
+            SDS011_Packet[3] = 1;
+            SDS011_Packet[4] = MODE_WORK;
+        }
+        else
+            prepare_packet(SDS011_FWVER);
     }
 
-    return(SDS011_OK);
+    trace_state(TRACE_NOCONNECT, fd, Get_DevID(), attempt);
+
+    _fd = 0xff;                 // No device connection.
+    _PendingConfReq = false;
+
+    return(SDS011_ERROR);
 }
 
 /*********************************************************************
@@ -499,7 +853,7 @@ int SDS011::Set_New_Devid(uint8_t *newid)
     // has device been connected ?
     if (_fd == 0xff)    return(SDS011_ERROR);
     
-    if (_sdsDebug) printf("\n\tSet new Device ID\n");
+    if (DEBUG_ON) printf("\n\tSet new Device ID\n");
 
     // create command
     prepare_packet(SDS011_DEVID);
@@ -509,10 +863,16 @@ int SDS011::Set_New_Devid(uint8_t *newid)
     // send it
     if (send_sds() == SDS011_ERROR)
     {
-        if (_sdsDebug) printf("Error during sending\n");
+        if (DEBUG_ON) printf("Error during sending\n");
         return (SDS011_ERROR);
     }
 
+    // on a bus the answer comes from the new device ID
+    if (_bus) {
+        _dev_id[0] = newid[0];
+        _dev_id[1] = newid[1];
+    }
+
     return(Wait_For_answer());
 }
 
@@ -526,30 +886,68 @@ int SDS011::Set_New_Devid(uint8_t *newid)
  *********************************************************************/
 int SDS011::send_sds(){
 
-    int i;
-
     // has device been connected ?
     if (_fd == 0xff)    return(SDS011_ERROR);
             
     // any pending configuration answer ?
     if (Wait_For_answer() == SDS011_ERROR) return(SDS011_ERROR);
-    
+
+    return(write_sds());
+}
+
+/*********************************************************************
+ * @brief : add CRC + send to SDS-011 right away
+ *
+ * The write and the pending state are updated under _q_lock, so a
+ * command submitted from another thread can not come in between.
+ *
+ * @param packet : packet to send (NULL is SDS011_Packet)
+ *
+ * @return :
+ *  SDS011_ERROR : could not send command
+ *  SDS011_OK    : all good
+ *********************************************************************/
+int SDS011::write_sds(uint8_t *packet){
+
+    int i, n;
+
+    if (packet == NULL) packet = SDS011_Packet;
+
+    // has device been connected ?
+    if (_fd == 0xff)    return(SDS011_ERROR);
+
     // add crc
-    SDS011_Packet[17] = Calc_Checksum(SDS011_Packet+2, 15);
+    packet[17] = Calc_Checksum(packet+2, 15);
 
-    if (_sdsDebug)
+    if (DEBUG_ON)
     {
         printf("Sending:  ");
-        for (i=0 ; i < SDS011_SENDPACKET_LEN; i++) printf("%02X ",SDS011_Packet[i] & 0xff);
+        for (i=0 ; i < SDS011_SENDPACKET_LEN; i++) printf("%02X ",packet[i] & 0xff);
         printf("\n");
     }
 
+    pthread_mutex_lock(&_q_lock);
+
     // send command
-    if (write(_fd, SDS011_Packet, SDS011_SENDPACKET_LEN) != SDS011_SENDPACKET_LEN) return(SDS011_ERROR);
+    n = write(_fd, packet, SDS011_SENDPACKET_LEN);
 
-    // indicate pending config request (EXCEPT when requested data)
-    if (SDS011_Packet[2] != SDS011_QDATA || SDS011_Packet[2] != SDS011_SLEEP)    _PendingConfReq = true;
-    return(SDS011_OK);
+    if (n == SDS011_SENDPACKET_LEN) {
+
+        trace_frame(TRACE_TX, _fd, packet, SDS011_SENDPACKET_LEN);
+
+        // indicate pending config request (EXCEPT when requested data, as the
+        // answer on that is a data packet)
+        if (packet[2] != SDS011_QDATA) {
+            _PendingConfReq = true;
+            _pending_since = now_ms();
+        }
+        else
+            _qdata_sent = true;
+    }
+
+    pthread_mutex_unlock(&_q_lock);
+
+    return(n == SDS011_SENDPACKET_LEN ? SDS011_OK : SDS011_ERROR);
 }
 
 /*********************************************************************
@@ -559,31 +957,554 @@ int SDS011::send_sds(){
  *  SDS011_ERROR : could not send command
  *  SDS011_OK    : all good
  *********************************************************************/
-int SDS011::read_sds() {
-    
-    uint8_t buf[15];
-    uint8_t retry = 5;      // try 5 times to read a valid response
-    
+int SDS011::read_sds(long timeout) {
+
+    struct pollfd pfd;
+    long    deadline = now_ms() + timeout;
+    int     avail, n;
+
     // has device been connected ?
     if (_fd == 0xff) return(SDS011_ERROR);
-    
-    while (retry--)
+
+    // received already while another sensor on the bus was reading
+    if (Inbox_Get() == SDS011_OK) return(SDS011_OK);
+
+    pfd.fd = _fd;
+    pfd.events = POLLIN;
+
+    while (timeout > 0)
     {
-        // read from device
-        if (read(_fd, buf, SDS011_PACKET_LEN) == SDS011_PACKET_LEN )
+        // wait for input
+        n = poll(&pfd, 1, timeout);
+
+        if (n < 0 && errno != EINTR) return(SDS011_ERROR);
+
+        if (n > 0) {
+
+            if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) return(SDS011_ERROR);
+
+            // read what is there, no more than needed to complete the response
+            if (ioctl(_fd, FIONREAD, &avail) < 0 || avail < 1) avail = 1;
+
+            if (avail > SDS011_PACKET_LEN - *_rxp_cnt) avail = SDS011_PACKET_LEN - *_rxp_cnt;
+
+            n = read(_fd, _rxp + *_rxp_cnt, avail);
+
+            if (n > 0 && Collect_Frame(n) == SDS011_OK) return(SDS011_OK);
+        }
+
+        timeout = deadline - now_ms();
+    }
+
+    return(SDS011_ERROR);
+}
+
+/*********************************************************************
+ * @brief : add newly read bytes to the response being collected.
+ *
+ * A response can arrive in pieces, or the reading can start halfway a
+ * response. Bytes are skipped until the begin byte and a packet that
+ * fails the checks is dropped byte-by-byte to find the next begin byte.
+ *
+ * On a bus the response is handed to the sensor it is from, which is
+ * not necessarily this one.
+ *
+ * @param n : number of bytes just read at _rxp + *_rxp_cnt
+ *
+ * @return :
+ *  SDS011_ERROR : no complete valid response (for this sensor) yet
+ *  SDS011_OK    : response processed
+ *********************************************************************/
+int SDS011::Collect_Frame(uint8_t n)
+{
+    uint8_t i;
+
+    *_rxp_cnt += n;
+
+    while (1)
+    {
+        // skip to begin byte
+        for (i = 0; i < *_rxp_cnt && _rxp[i] != SDS011_BYTE_BEGIN; i++);
+
+        if (i > 0) {
+            *_rxp_cnt -= i;
+            memmove(_rxp, _rxp + i, *_rxp_cnt);
+        }
+
+        if (*_rxp_cnt < SDS011_PACKET_LEN) return(SDS011_ERROR);
+
+        if (_bus) {
+            if (Bus_Deliver(_rxp) == SDS011_OK) {
+                *_rxp_cnt = 0;
+                return(Inbox_Get());
+            }
+        }
+        else if (ProcessResponse(_rxp, SDS011_PACKET_LEN) == SDS011_OK) {
+            _rx_cnt = 0;
+
+            // save latest device ID
+            _dev_id[0] = data.devid & 0xff;
+            _dev_id[1] = (data.devid >> 8) & 0xff;
+
+            return(SDS011_OK);
+        }
+
+        // not a valid packet: try from next byte
+        (*_rxp_cnt)--;
+        memmove(_rxp, _rxp + 1, *_rxp_cnt);
+    }
+}
+
+/*********************************************************************
+ * @brief : handle a complete response received by other means
+ *
+ * @return :
+ *  SDS011_ERROR : not a valid response
+ *  SDS011_OK    : response stored in r
+ *********************************************************************/
+int SDS011::Process_Frame(const uint8_t *packet, sds011_response_t *r)
+{
+    if (ProcessResponse(packet, SDS011_PACKET_LEN) == SDS011_ERROR) return(SDS011_ERROR);
+
+    *r = data;
+    return(SDS011_OK);
+}
+
+/*********************************************************************
+ * @brief : hand a complete packet on the bus to the sensor with the
+ * device ID of the packet
+ *
+ * @return :
+ *  SDS011_ERROR : not a valid packet
+ *  SDS011_OK    : packet handled (or dropped if unknown device ID)
+ *********************************************************************/
+int SDS011::Bus_Deliver(const uint8_t *packet)
+{
+    SDS011  *s = NULL;
+    uint16_t devid;
+    int      i;
+
+    if (packet[SDS011_PACKET_LEN - 1] != SDS011_BYTE_END ||
+        packet[8] != Calc_Checksum(packet + 2, 6)) return(SDS011_ERROR);
+
+    devid = (packet[7] << 8) + packet[6];
+
+    for (i = 0; i < _bus->cnt; i++) {
+        if (_bus->dev[i]->Get_DevID() == devid) {
+            s = _bus->dev[i];
             break;
-  
-        // if retries counted down
-        if (retry == 0) return(SDS011_ERROR);
+        }
+    }
+
+    if (s == NULL) {
+        if (DEBUG_ON) printf("Dropped response of unknown device 0x%04x\n", devid);
+        trace_state(TRACE_DROP, _fd, devid, 0);
+        _bus->lost++;
+        return(SDS011_OK);
+    }
+
+    if (s->ProcessResponse(packet, SDS011_PACKET_LEN) == SDS011_ERROR) return(SDS011_ERROR);
+
+    // full: drop the oldest response
+    if (s->_in_cnt == SDS011_INBOX) {
+        memmove(s->_inbox, s->_inbox + 1, --s->_in_cnt * sizeof(sds011_response_t));
     }
-    
-    // parse response
-    if (ProcessResponse(buf, SDS011_PACKET_LEN) == SDS011_ERROR) 
-        return(SDS011_ERROR);
 
-    // save latest device ID
-    _dev_id[0] = data.devid & 0xff;
-    _dev_id[1] = (data.devid >> 8) & 0xff;
+    s->_inbox[s->_in_cnt++] = s->data;
 
     return(SDS011_OK);
 }
+
+/*********************************************************************
+ * @brief : take the oldest response from the inbox into data
+ *
+ * @return :
+ *  SDS011_ERROR : inbox empty
+ *  SDS011_OK    : response in data
+ *********************************************************************/
+int SDS011::Inbox_Get()
+{
+    if (_in_cnt == 0) return(SDS011_ERROR);
+
+    data = _inbox[0];
+    memmove(_inbox, _inbox + 1, --_in_cnt * sizeof(sds011_response_t));
+
+    return(SDS011_OK);
+}
+
+/*********************************************************************
+ * @brief : parse any bytes already waiting without blocking
+ *
+ * @param PM25 : to store the measured PM2.5 value
+ * @param PM10 : to store the measured PM10 value
+ *
+ * @return :
+ *  SDS011_ERROR : no (complete) new measurement available
+ *  SDS011_OK    : new measurement stored in PM25 and PM10
+ *********************************************************************/
+int SDS011::Process_Input(float *PM25, float *PM10)
+{
+    sds011_response_t r;
+
+    while (Read_Response(&r) == SDS011_OK)
+    {
+        if (r.cmd_id == SDS011_DATA) {
+            *PM25 = r.pm25;
+            *PM10 = r.pm10;
+            return(SDS011_OK);
+        }
+    }
+
+    return(SDS011_ERROR);
+}
+
+/*********************************************************************
+ * @brief : follow the variation of the measurements, exponentially
+ * weighted (Welford's update for a weighted mean and variance)
+ *********************************************************************/
+void SDS011::Track_Variation(float pm25, float pm10)
+{
+    double x[2] = {pm25, pm10}, diff, incr;
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        if (_var_cnt == 0) {
+            _var_mean[i] = x[i];
+            _var_sq[i] = 0;
+            continue;
+        }
+
+        diff = x[i] - _var_mean[i];
+        incr = diff / SDS011_VAR_N;
+        _var_mean[i] += incr;
+        _var_sq[i] = (1 - 1.0 / SDS011_VAR_N) * (_var_sq[i] + diff * incr);
+    }
+
+    if (_var_cnt < 0xffff) _var_cnt++;
+}
+
+/*********************************************************************
+ * @brief : how much the measurements vary
+ *
+ * @return : standard deviation relative to the mean, or -1 if not known
+ *********************************************************************/
+float SDS011::Get_Variation()
+{
+    double v, max = 0;
+    int i;
+
+    if (_var_cnt < SDS011_VAR_MIN) return(-1);
+
+    for (i = 0; i < 2; i++) {
+        v = sqrt(_var_sq[i]) / (_var_mean[i] > SDS011_VAR_FLOOR ? _var_mean[i] : SDS011_VAR_FLOOR);
+        if (v > max) max = v;
+    }
+
+    return(max);
+}
+
+/*********************************************************************
+ * @brief : parse any bytes already waiting until a complete response
+ *
+ * @param r : to store the response
+ *
+ * @return :
+ *  SDS011_ERROR : no (complete) response available
+ *  SDS011_OK    : response stored in r
+ *********************************************************************/
+int SDS011::Read_Response(sds011_response_t *r)
+{
+    int avail = 0, n;
+
+    // has device been connected ?
+    if (_fd == 0xff) return(SDS011_ERROR);
+
+    // received already while another sensor on the bus was reading
+    if (Inbox_Get() == SDS011_OK) {
+        *r = data;
+        return(SDS011_OK);
+    }
+
+    // only read what is there, a read() would wait for VTIME otherwise
+    if (ioctl(_fd, FIONREAD, &avail) < 0) return(SDS011_ERROR);
+
+    while (avail > 0)
+    {
+        n = read(_fd, _rxp + *_rxp_cnt, SDS011_PACKET_LEN - *_rxp_cnt);
+
+        if (n <= 0) return(SDS011_ERROR);
+
+        avail -= n;
+
+        if (Collect_Frame(n) == SDS011_OK) {
+            *r = data;
+            return(SDS011_OK);
+        }
+    }
+
+    return(SDS011_ERROR);
+}
+
+/*********************************************************************
+ * @brief : send a command without waiting for the answer
+ *
+ * @param cmd : SDS011_MODE, SDS011_QDATA, SDS011_SLEEP, SDS011_FWVER,
+ *  SDS011_PERIOD or SDS011_DEVID
+ * @param set : 0 = query current value, 1 = set value
+ * @param value : value to set (new device ID with SDS011_DEVID)
+ *
+ * @return :
+ *  SDS011_ERROR : could not send command
+ *  SDS011_OK    : all good
+ *********************************************************************/
+int SDS011::Send_Command(uint8_t cmd, uint8_t set, uint16_t value)
+{
+    // own packet: a blocking call might be waiting to send SDS011_Packet
+    uint8_t packet[SDS011_SENDPACKET_LEN];
+    int ret;
+
+    pthread_mutex_lock(&_q_lock);
+
+    prepare_packet(cmd, packet);
+
+    if (cmd == SDS011_MODE || cmd == SDS011_SLEEP || cmd == SDS011_PERIOD) {
+        packet[3] = set;
+        packet[4] = value;
+    }
+    else if (cmd == SDS011_DEVID) {
+        packet[13] = value & 0xff;
+        packet[14] = (value >> 8) & 0xff;
+
+        // on a bus the answer comes from the new device ID
+        if (_bus) {
+            _dev_id[0] = value & 0xff;
+            _dev_id[1] = (value >> 8) & 0xff;
+        }
+    }
+
+    ret = write_sds(packet);
+
+    pthread_mutex_unlock(&_q_lock);
+
+    return(ret);
+}
+
+/*********************************************************************
+ * @brief : queue a command to be sent as soon as the sensor can take it
+ *
+ * @param cmd : SDS011_MODE, SDS011_QDATA, SDS011_SLEEP, SDS011_FWVER,
+ *  SDS011_PERIOD or SDS011_DEVID
+ * @param set : 0 = query current value, 1 = set value
+ * @param value : value to set (new device ID with SDS011_DEVID)
+ * @param prio : SDS011_PRIO_HIGH, SDS011_PRIO_NORM or SDS011_PRIO_LOW
+ *
+ * @return :
+ *  SDS011_ERROR : not connected, unknown command or queue full
+ *  SDS011_OK    : sent or queued
+ *********************************************************************/
+int SDS011::Submit(uint8_t cmd, uint8_t set, uint16_t value, uint8_t prio)
+{
+    sds011_cmd_t *c;
+    int i, ret = SDS011_OK;
+
+    if (_fd == 0xff) return(SDS011_ERROR);
+
+    if (cmd != SDS011_MODE && cmd != SDS011_QDATA && cmd != SDS011_SLEEP &&
+        cmd != SDS011_FWVER && cmd != SDS011_PERIOD && cmd != SDS011_DEVID) return(SDS011_ERROR);
+
+    // only a set has a value
+    if (cmd == SDS011_QDATA || cmd == SDS011_FWVER) set = 0;
+    if (cmd == SDS011_DEVID) set = 1;
+    if (set == 0) value = 0;
+
+    pthread_mutex_lock(&_q_lock);
+
+    /* merge with the same command if that was the last one submitted. An
+     * older one stays: merging would move this command before the ones
+     * submitted in between (e.g. a sleep set before a working period) */
+    for (i = 0, c = NULL; i < _q_cnt; i++)
+        if (c == NULL || _queue[i].seq > c->seq) c = &_queue[i];
+
+    if (c && c->cmd == cmd && c->set == set) {
+        c->value = value;
+        if (prio < c->prio) c->prio = prio;
+        _q_merged++;
+    }
+    else {
+
+        if (_q_cnt == SDS011_QUEUE_LEN) ret = SDS011_ERROR;
+        else {
+            c = &_queue[_q_cnt++];
+            c->cmd = cmd;
+            c->set = set;
+            c->value = value;
+            c->prio = prio;
+            c->seq = _q_seq++;
+        }
+    }
+
+    Queue_Next();
+
+    pthread_mutex_unlock(&_q_lock);
+
+    return(ret);
+}
+
+/*********************************************************************
+ * @brief : send waiting commands when the answer timeout passed
+ *
+ * @return : number of commands still waiting
+ *********************************************************************/
+int SDS011::Queue_Pump()
+{
+    int cnt;
+
+    pthread_mutex_lock(&_q_lock);
+    Queue_Next();
+    cnt = _q_cnt;
+    pthread_mutex_unlock(&_q_lock);
+
+    return(cnt);
+}
+
+/*********************************************************************
+ * @brief : get number of commands waiting and merged
+ *********************************************************************/
+int SDS011::Queue_Len(uint32_t *merged, uint32_t *timeouts)
+{
+    int cnt;
+
+    pthread_mutex_lock(&_q_lock);
+    cnt = _q_cnt;
+    if (merged) *merged = _q_merged;
+    if (timeouts) *timeouts = _q_timeouts;
+    pthread_mutex_unlock(&_q_lock);
+
+    return(cnt);
+}
+
+/*********************************************************************
+ * @brief : send waiting commands, highest priority first, until a
+ * configuration command is pending (call with _q_lock taken)
+ *********************************************************************/
+void SDS011::Queue_Next()
+{
+    sds011_cmd_t c;
+    int i, best;
+
+    if (_q_cnt == 0 || _fd == 0xff) return;
+
+    // no answer in time: the sensor will not answer anymore
+    if (_PendingConfReq) {
+        if (now_ms() - _pending_since < _answer_timeout) return;
+
+        if (DEBUG_ON) printf("\n\tNo answer on command, send next\n");
+        trace_state(TRACE_TIMEOUT, _fd, Get_DevID(), _q_cnt);
+        _PendingConfReq = false;
+        _q_timeouts++;
+    }
+
+    while (_q_cnt && ! _PendingConfReq)
+    {
+        best = 0;
+
+        for (i = 1; i < _q_cnt; i++) {
+            if (_queue[i].prio < _queue[best].prio ||
+               (_queue[i].prio == _queue[best].prio && _queue[i].seq < _queue[best].seq))
+                best = i;
+        }
+
+        c = _queue[best];
+        _queue[best] = _queue[--_q_cnt];
+
+        if (Send_Command(c.cmd, c.set, c.value) == SDS011_ERROR) return;
+    }
+}
+
+/*********************************************************************
+ * @brief : take one step to bring the sensor to a wanted configuration
+ *
+ * @param want : wanted configuration
+ * @param sets : if not NULL, incremented for each set that is sent
+ *
+ * @return :
+ *  -1 : not connected
+ *   0 : sensor has the wanted configuration
+ *  >0 : number of values that still need a query or set
+ *********************************************************************/
+int SDS011::Reconcile(const sds011_conf_t *want, uint32_t *sets)
+{
+    uint8_t  c[2] = {SDS011_MODE, SDS011_PERIOD};
+    uint8_t  w[2] = {want->rmode, want->period};
+    uint8_t  cmd = 0, set = 0, wmode = want->wmode;
+    uint16_t value = 0;
+    bool     busy, wake = false;
+    int      i, todo = 0;
+
+    if (_fd == 0xff) return(-1);
+
+    // one command at a time: the answer decides the next step
+    pthread_mutex_lock(&_q_lock);
+    busy = _q_cnt || _PendingConfReq;
+    pthread_mutex_unlock(&_q_lock);
+
+    // a sleeping sensor does not take other commands: know that first
+    if (! (_reg_valid & (1 << SDS011_SLEEP))) {
+        if (! busy) Submit(SDS011_SLEEP, 0, 0);
+        return(1);
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        if (w[i] == 0xff) continue;
+
+        if (! (_reg_valid & (1 << c[i]))) {
+            if (todo++ == 0) {cmd = c[i]; set = 0;}
+        }
+        else if (_reg[c[i]] != w[i]) {
+            if (todo++ == 0) {cmd = c[i]; set = 1; value = w[i];}
+        }
+    }
+
+    if (want->devid && want->devid != Get_DevID()) {
+        if (todo++ == 0) {cmd = SDS011_DEVID; set = 1; value = want->devid;}
+    }
+
+    // the firmware for the saved state, not worth a wake up on its own
+    if (! (_reg_valid & (1 << SDS011_FWVER)) && (todo || _reg[SDS011_SLEEP] == MODE_WORK)) {
+        if (todo++ == 0) {cmd = SDS011_FWVER; set = 0;}
+    }
+
+    // woken up only for the other changes: back to sleep
+    if (wmode == 0xff && _woken) wmode = MODE_SLEEP;
+
+    // sleep / work mode as the last step
+    if (todo == 0 && wmode != 0xff && _reg[SDS011_SLEEP] != wmode) {
+        todo++;
+        cmd = SDS011_SLEEP; set = 1; value = wmode;
+    }
+    // wake up for the other changes
+    else if (todo && _reg[SDS011_SLEEP] == MODE_SLEEP) {
+        cmd = SDS011_SLEEP; set = 1; value = MODE_WORK;
+        wake = true;
+    }
+
+    if (todo == 0 || busy) {
+        if (todo == 0) _woken = false;
+        return(todo);
+    }
+
+    if (DEBUG_ON) printf("\n\tReconcile: %s %02x %d\n", set ? "set" : "get", cmd, value);
+
+    if (Submit(cmd, set, value) == SDS011_OK && set) {
+
+        // waking up (and back to sleep) only to look is not a change, but
+        // it is when the sensor is wanted at work
+        if (wake && want->wmode != MODE_WORK) _woken = true;
+        else if (cmd == SDS011_SLEEP && _woken) _woken = false;
+        else if (sets) (*sets)++;
+    }
+
+    return(todo);
+}
@@ -32,6 +32,7 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
 
 // Configuration commands
 #define SDS011_MODE   0x02 // Set data reporting mode (3rd byte)
@@ -66,6 +67,34 @@
 #define MODE_SLEEP    0x0
 #define MODE_WORK     0x1
 
+// debug output (EnableDebugging()): with 0 the debug code is compiled away,
+// no check on each frame and no printf() (make DEBUG=0)
+#ifndef SDS011_DEBUG
+#define SDS011_DEBUG 1
+#endif
+
+// timing (milliseconds)
+#define SDS011_ANSWER_TIMEOUT  2500  // default max wait on an answer
+#define SDS011_CONNECT_TIMEOUT 3000  // default max time for begin()
+#define SDS011_RETRY_BASE      50    // first resend after (+ jitter)
+#define SDS011_RETRY_MAX       800   // max time between resends
+#define SDS011_WARM_TIMEOUT    1000  // max wait on measurement in Warm_Start()
+
+// command queue (see Submit())
+#define SDS011_QUEUE_LEN  8     // max commands waiting per sensor
+#define SDS011_PRIO_HIGH  0     // e.g. data queries
+#define SDS011_PRIO_NORM  1     // configuration
+#define SDS011_PRIO_LOW   2
+
+// variation of the measurements (see Get_Variation())
+#define SDS011_VAR_N     8      // measurements it is weighted over
+#define SDS011_VAR_MIN   3      // measurements needed
+#define SDS011_VAR_FLOOR 1.0    // ug/m3 mean below which it is not relative
+
+// multi-drop bus
+#define SDS011_BUS_MAX   32     // max sensors on one bus
+#define SDS011_INBOX     8      // responses kept per sensor on a bus
+
 typedef struct
 {
     uint8_t cmd_id;  // Command ID (SDS011_DATA or SDS011_CONF)
@@ -81,6 +110,45 @@ typedef struct
     float   pm10;    // PM 10 value
 } sds011_response_t;
 
+typedef struct
+{
+    uint8_t  cmd;    // SDS011_MODE, SDS011_QDATA, SDS011_SLEEP ..
+    uint8_t  set;    // 0 = query current value, 1 = set value
+    uint16_t value;  // value to set (new device ID with SDS011_DEVID)
+    uint8_t  prio;   // SDS011_PRIO_HIGH .. SDS011_PRIO_LOW
+    uint32_t seq;    // order of submit within a priority
+} sds011_cmd_t;
+
+typedef struct
+{
+    uint8_t  rmode;  // REPORT_STREAM or REPORT_QUERY (0xff = keep)
+    uint8_t  wmode;  // MODE_SLEEP or MODE_WORK (0xff = keep)
+    uint8_t  period; // working period 0 - 30 minutes (0xff = keep)
+    uint16_t devid;  // device ID (0 = keep)
+} sds011_conf_t;
+
+typedef struct
+{
+    uint16_t devid;  // device ID (0 = unknown)
+    uint8_t  fw[3];  // firmware year, month, day
+    uint8_t  rmode;  // reporting mode
+    uint8_t  period; // working period
+} sds011_state_t;
+
+class SDS011;
+
+/* Sensors sharing one serial port (multi-drop bus, e.g. an RS-485 string).
+ * Whichever sensor reads the port collects the responses and hands each
+ * one to the sensor with the device ID of the response. Start zeroed. */
+typedef struct
+{
+    uint8_t  rx[SDS011_PACKET_LEN];   // collects bytes of a response
+    uint8_t  rx_cnt;                  // number of bytes in rx
+    SDS011  *dev[SDS011_BUS_MAX];     // sensors on the bus
+    int      cnt;                     // number of sensors on the bus
+    uint32_t lost;                    // responses of unknown device ID
+} sds011_bus;
+
 class SDS011
 {
   public:
@@ -93,20 +161,118 @@ class SDS011
      * @param act : level of debug to set
      *  0 : no debug message
      *  1 : sending and receiving data
+     *
+     * Without effect when the library is compiled with SDS011_DEBUG 0.
      */
     void EnableDebugging(uint8_t act);
 
+    /**
+     * @brief : set the timeouts used on the next calls
+     *
+     * A healthy sensor answers right away, as the wait ends as soon as the
+     * answer is received. The timeouts only limit the time lost on a sensor
+     * that does not answer.
+     *
+     * @param answer : max milliseconds to wait on an answer or measurement
+     * @param connect : max milliseconds for begin() to connect
+     */
+    void Set_Timeout(uint16_t answer, uint16_t connect);
+
+    /**
+     * @brief : add the sensor to a multi-drop bus, before begin()
+     *
+     * All commands are sent to devid instead of to all sensors (0xffff)
+     * and only responses from devid are returned by this instance. The
+     * same fd is given to begin() of all sensors on the bus. Each sensor
+     * still has its own pending configuration request (see
+     * Wait_For_answer()), so commands to one sensor are serialised
+     * without waiting on the others.
+     *
+     * @param bus : bus shared by the sensors on the port
+     * @param devid : device ID of this sensor
+     *
+     * @return :
+     *  SDS011_ERROR : bus is full
+     *  SDS011_OK    : all good
+     */
+    int Join_Bus(sds011_bus *bus, uint16_t devid);
+
+    /**
+     * @brief : remove the sensor from its bus (if any)
+     */
+    void Leave_Bus();
+
     /**
      * @brief : first call to initiatize the library
      * 
      * @param fd: file descriptor of opened device
+     * @param lazy: if true, do not probe the sensor for the firmware.
+     *  The device ID is then learned from the first received response.
+     *  Use when only the streaming data is needed for a fast start.
+     *
+     * A sensor that does not answer the firmware request gets a wake up
+     * as well (it could be asleep), so connecting can wake the sensor.
      * 
      * @return :
      *  SDS011_ERROR : could not send command
      *  SDS011_OK    : all good
      */
-    int begin(int fd);
+    int begin(int fd, bool lazy = false);
     
+    /**
+     * @brief : forget the cached configuration of the sensor
+     *
+     * The reporting mode, sleep / work mode, working period and firmware
+     * are cached from every configuration answer of the sensor, so a get
+     * does not need to ask the sensor and a set that does not change the
+     * value is not sent. begin() starts with an empty cache. Call when
+     * the sensor could have been changed by someone else.
+     */
+    void Invalidate_Cache() {_reg_valid = 0;}
+
+    /**
+     * @brief : connect using the state saved from an earlier connection,
+     * instead of probing the sensor (see begin())
+     *
+     * A measurement that is received already, or else the answer on one
+     * data query, must come from the saved device ID. The saved firmware,
+     * reporting mode and working period are then taken in the cache, so
+     * the calls that follow do not need to ask the sensor.
+     *
+     * @param fd: file descriptor of opened device
+     * @param st: state saved with Get_State()
+     *
+     * @return :
+     *  SDS011_ERROR : no measurement of the saved device ID: call begin()
+     *  SDS011_OK    : connected
+     */
+    int Warm_Start(int fd, const sds011_state_t *st);
+
+    /**
+     * @brief : the check of Warm_Start() on a measurement that was read
+     * by the caller, to connect without blocking (after begin() lazy and
+     * a data query sent with Send_Command()). The saved firmware,
+     * reporting mode and working period are taken in the cache.
+     *
+     * @param st: state saved with Get_State()
+     * @param r : response read with Read_Response()
+     *
+     * @return :
+     *  SDS011_ERROR : not a measurement of the saved device ID
+     *  SDS011_OK    : connected
+     */
+    int Warm_Accept(const sds011_state_t *st, const sds011_response_t *r);
+
+    /**
+     * @brief : get the state to save for Warm_Start() from the cache.
+     * Only the values that are known are filled in st.
+     *
+     * @return :
+     *  SDS011_ERROR : not all values are known
+     *  SDS011_OK    : all values filled in st
+     */
+    int Get_State(sds011_state_t *st);
+
     /**
      * @brief : read firmware version
      * 
@@ -240,11 +406,240 @@ class SDS011
     int Get_data(float *PM25, float *PM10)
         {return(Report_Data(REPORT_STREAM, PM25, PM10));}
 
+    /**
+     * @brief : parse any bytes already waiting on the file descriptor
+     * without blocking. To be used when the caller runs its own poll()
+     * loop on Get_fd() and the sensor is in streaming mode.
+     *
+     * @param PM25 : to store the measured PM2.5 value
+     * @param PM10 : to store the measured PM10 value
+     *
+     * @return :
+     *  SDS011_ERROR : no (complete) new measurement available
+     *  SDS011_OK    : new measurement stored in PM25 and PM10
+     */
+    int Process_Input(float *PM25, float *PM10);
+
+    /**
+     * @brief : how much the measurements vary. Followed on every
+     * measurement that is received (Report_Data(), Read_Response()), as a
+     * standard deviation and mean that are exponentially weighted over
+     * about SDS011_VAR_N measurements. Restarts on begin().
+     *
+     * @return : standard deviation relative to the mean (e.g. 0.1 is
+     *  10 %), of PM2.5 or PM10 whichever is higher, or -1 when there are
+     *  less than SDS011_VAR_MIN measurements
+     */
+    float Get_Variation();
+
+    /**
+     * @brief : send a command without waiting for the answer. To be used
+     * with Read_Response() from the caller's own poll() loop, e.g. to
+     * talk to many sensors at the same time.
+     *
+     * The caller is responsible to not send a next configuration command
+     * before the previous one was answered (see Wait_For_answer()).
+     *
+     * @param cmd : SDS011_MODE, SDS011_QDATA, SDS011_SLEEP, SDS011_FWVER,
+     *  SDS011_PERIOD or SDS011_DEVID
+     * @param set : 0 = query current value, 1 = set value
+     * @param value : value to set (new device ID with SDS011_DEVID)
+     *
+     * @return :
+     *  SDS011_ERROR : could not send command
+     *  SDS011_OK    : all good
+     */
+    int Send_Command(uint8_t cmd, uint8_t set, uint16_t value);
+
+    /**
+     * @brief : queue a command to be sent as soon as the sensor can take it
+     *
+     * A configuration command is only sent after the answer on the
+     * previous one was received, or the answer timeout passed (see
+     * Wait_For_answer()). Waiting commands are sent highest priority
+     * first, so data queries are not held up by configuration traffic.
+     * The same command as the last one submitted is merged: a set replaces
+     * the value of the waiting set (e.g. two Set_Working_Period in a row),
+     * a duplicate query is dropped as the one answer serves both. Merging
+     * with an older one would change the order of the commands.
+     *
+     * Can be called from any thread: the queue, the sending and the
+     * pending state are protected by one lock. The answers are read as
+     * usual with Read_Response() by the owner of the port, which sends
+     * the next waiting command when an answer arrives. The blocking calls
+     * (e.g. Get_Param()) are not to be used from another thread at that
+     * time.
+     *
+     * @param cmd : SDS011_MODE, SDS011_QDATA, SDS011_SLEEP, SDS011_FWVER,
+     *  SDS011_PERIOD or SDS011_DEVID
+     * @param set : 0 = query current value, 1 = set value
+     * @param value : value to set (new device ID with SDS011_DEVID)
+     * @param prio : SDS011_PRIO_HIGH, SDS011_PRIO_NORM or SDS011_PRIO_LOW
+     *
+     * @return :
+     *  SDS011_ERROR : not connected, unknown command or queue full
+     *  SDS011_OK    : sent or queued
+     */
+    int Submit(uint8_t cmd, uint8_t set, uint16_t value, uint8_t prio = SDS011_PRIO_NORM);
+
+    /**
+     * @brief : take one step to bring the sensor to a wanted configuration
+     *
+     * Compares the wanted configuration with the cached one (see
+     * Invalidate_Cache()) and submits the next command that is needed:
+     * a query for a value that is not known yet, or a set for a value
+     * that differs. Nothing is sent for values that match already. A
+     * sleeping sensor is woken up first and set to sleep again last. The
+     * firmware is asked while the sensor is awake, so the state can be
+     * saved afterwards (see Get_State()).
+     *
+     * One command is outstanding at a time, so call again after each
+     * answer (from the caller's poll() loop with Read_Response() and
+     * Queue_Pump()), until it returns 0. Many sensors can be brought to
+     * their configuration at the same time this way.
+     *
+     * @param want : wanted configuration
+     * @param sets : if not NULL, incremented for each set that is sent
+     *
+     * @return :
+     *  -1 : not connected
+     *   0 : sensor has the wanted configuration
+     *  >0 : number of values that still need a query or set
+     */
+    int Reconcile(const sds011_conf_t *want, uint32_t *sets = NULL);
+
+    /**
+     * @brief : send waiting commands when the answer timeout on the
+     * pending configuration command passed. Call regularly when commands
+     * can be waiting (answers trigger the next send by themselves).
+     *
+     * @return : number of commands still waiting
+     */
+    int Queue_Pump();
+
+    /**
+     * @brief : get number of commands waiting and merged
+     *
+     * @param merged : if not NULL, number of commands merged since begin()
+     * @param timeouts : if not NULL, number of commands without answer
+     */
+    int Queue_Len(uint32_t *merged = NULL, uint32_t *timeouts = NULL);
+
+    /**
+     * @brief : parse any bytes already waiting on the file descriptor
+     * without blocking, until a complete response (data or configuration).
+     *
+     * @param r : to store the response
+     *
+     * @return :
+     *  SDS011_ERROR : no (complete) response available
+     *  SDS011_OK    : response stored in r
+     */
+    int Read_Response(sds011_response_t *r);
+
+    /**
+     * @brief : handle a complete response that was received by other
+     * means than the port of the sensor (e.g. a replayed capture), as a
+     * response read from the port.
+     *
+     * @param packet : response of SDS011_PACKET_LEN bytes
+     * @param r : to store the response
+     *
+     * @return :
+     *  SDS011_ERROR : not a valid response
+     *  SDS011_OK    : response stored in r
+     */
+    int Process_Frame(const uint8_t *packet, sds011_response_t *r);
+
+    /**
+     * @brief : get file descriptor set with begin() (0xff if none)
+     */
+    int Get_fd() {return(_fd);}
+
   private:
+
+    uint8_t SDS011_Packet[SDS011_SENDPACKET_LEN]; // packet to send
+    bool    _PendingConfReq;         // indicate configuration request pending
+    uint8_t _dev_id[2];              // holds current device ID
+    float   _RelativeHumidity;       // for humidity correction
+    int     _fd;                     // file description to use
+    bool    _sdsDebug;               // enable debug messages
+    sds011_response_t data;          // holds parsed received data
+
+    uint8_t _rx[SDS011_PACKET_LEN];  // collects bytes of a response
+    uint8_t _rx_cnt;                 // number of bytes in _rx
+    uint8_t *_rxp, *_rxp_cnt;        // _rx or rx of the bus
+
+    sds011_bus *_bus;                // multi-drop bus (NULL if none)
+    sds011_response_t _inbox[SDS011_INBOX]; // responses handed by the bus
+    uint8_t _in_cnt;                 // responses in _inbox
+
+    // cached configuration (see Invalidate_Cache())
+    uint16_t _reg_valid;             // bit (1 << cmd) : _reg[cmd] is valid
+    uint8_t  _reg[SDS011_PERIOD + 1]; // value by command (e.g. SDS011_MODE)
+    uint8_t  _fw[3];                 // firmware (valid with SDS011_FWVER)
+    bool     _qdata_sent;            // data query without answer yet
+    bool     _woken;                 // woken up by Reconcile()
+
+    // variation of the measurements (see Get_Variation())
+    double   _var_mean[2], _var_sq[2]; // PM2.5, PM10 weighted mean and variance
+    uint16_t _var_cnt;               // measurements followed
+
+    sds011_cmd_t _queue[SDS011_QUEUE_LEN]; // commands waiting (see Submit())
+    uint8_t  _q_cnt;                 // commands in _queue
+    uint32_t _q_seq;                 // next sequence number
+    uint32_t _q_merged;              // commands merged
+    uint32_t _q_timeouts;            // commands without answer
+    long     _pending_since;         // now_ms() of pending conf request
+    pthread_mutex_t _q_lock;         // protects queue, sending and pending state (recursive)
+
+    uint16_t _answer_timeout;        // max wait on answer (ms)
+    uint16_t _connect_timeout;       // max wait on connect (ms)
+
+    /**
+     * @brief : add newly read bytes in _rx to the response being collected.
+     * Resynchronises on the begin byte when garbage or a partial packet
+     * is received, and processes the response once complete.
+     *
+     * @param n : number of bytes just read at _rx + _rx_cnt
+     *
+     * @return :
+     *  SDS011_ERROR : no complete valid response yet
+     *  SDS011_OK    : response processed (see data)
+     */
+    int Collect_Frame(uint8_t n);
+
+    /**
+     * @brief : hand a complete packet on the bus to the sensor with the
+     * device ID of the packet
+     *
+     * @return :
+     *  SDS011_ERROR : not a valid packet
+     *  SDS011_OK    : packet handled (or dropped if unknown device ID)
+     */
+    int Bus_Deliver(const uint8_t *packet);
+
+    /**
+     * @brief : take the oldest response from the inbox into data
+     *
+     * @return :
+     *  SDS011_ERROR : inbox empty
+     *  SDS011_OK    : response in data
+     */
+    int Inbox_Get();
+
+    /**
+     * @brief : send waiting commands, highest priority first, until a
+     * configuration command is pending (call with _q_lock taken)
+     */
+    void Queue_Next();
     
     /**
      * @brief : Try to connect to device before executing requested commands
      *
+     * Asks the firmware, with a wake up in between the resends: this can
+     * wake a sleeping sensor.
+     *
      * @param fd: file descriptor of opened device
      *  *
      * @return :
@@ -279,26 +674,41 @@ class SDS011
     /**
      * @brief : initialise packet to be send.
      * @param data1 : the data1 byte to be included
+     * @param packet : packet to initialise (NULL is SDS011_Packet)
      */
-    void prepare_packet(uint8_t data1);
+    void prepare_packet(uint8_t data1, uint8_t *packet = NULL);
     
     /**
      * @brief : read response from sds011
      *
+     * @param timeout : max milliseconds to wait on a complete response
+     *
      * @return :
-     *  SDS011_ERROR : could not send command
+     *  SDS011_ERROR : no valid response received in time
      *  SDS011_OK    : all good
      */
-    int read_sds();
+    int read_sds(long timeout);
     
     /**
-     * @brief : add CRC + send to SDS-011
+     * @brief : add CRC + send to SDS-011, after the answer on a pending
+     * configuration request was received
      *
      * @return :
      *  SDS011_ERROR : could not send command
      *  SDS011_OK    : all good
      */
     int send_sds();
+
+    /**
+     * @brief : add CRC + send to SDS-011 right away
+     *
+     * @param packet : packet to send (NULL is SDS011_Packet)
+     *
+     * @return :
+     *  SDS011_ERROR : could not send command
+     *  SDS011_OK    : all good
+     */
+    int write_sds(uint8_t *packet = NULL);
   
     /**
      * @brief : wait for response on conf request
@@ -309,12 +719,24 @@ class SDS011
      * is still a data packet. The _PendingConfReq-flag will prevent sending
      * another configuration request if not received answer on previous yet
      *
+     * Waits no longer than the answer timeout (see Set_Timeout())
+     *
      * @return :
      *  SDS011_ERROR : could not send command
      *  SDS011_OK    : all good
      */
     int Wait_For_answer();
     
+    /**
+     * @brief : get cached value of a parameter
+     *
+     * @param c : SDS011_MODE, SDS011_SLEEP or SDS011_PERIOD
+     * @param p : return value
+     *
+     * @return : true if the value is known
+     */
+    bool Cache_Get(uint8_t c, uint8_t *p);
+
     /**
      * @brief : get current parameter
      * 
@@ -385,6 +807,11 @@ class SDS011
      *  SDS011_OK    : all good
      */
     int Report_Data (uint8_t rmode, float *PM25, float *PM10);
+
+    /**
+     * @brief : follow the variation of the measurements
+     */
+    void Track_Variation(float pm25, float pm10);
     
 };
 
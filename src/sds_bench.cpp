@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Benchmark of the timers of the event loop (timing wheel).
+ *
+ * The sensors are simulated in the program, as the emulator does it (an
+ * answer after a response delay, some queries without answer), so many
+ * more sensors can be used than there can be PTYs. Each sensor has the
+ * timers the daemon uses: the next query, the answer and a watchdog on
+ * the answer, with a resend after a backoff when no answer came.
+ *
+ * With -r a capture of readings is replayed through the swinging door
+ * compression instead: the compression ratio, the max error of the rebuilt
+ * readings and the throughput are reported.
+ *
+ * It also shows the time to record an event in the flight recorder and to
+ * decode a frame.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sds011_lib.h"
+#include "sds_loop.h"
+#include "sds_filter.h"
+#include "sds_trace.h"
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct bench_sensor
+{
+    loop_timer query;            // next query due
+    loop_timer answer;           // answer of the (simulated) sensor
+    loop_timer wdog;             // no answer in time
+    int        retry;            // resends of the current query
+    long       due;              // time the current query was due
+} bench_sensor;
+
+bench_sensor *sensors;
+int    bench_cnt = 10000;        // number of sensors
+int    bench_interval = 1000;    // ms between queries of a sensor
+int    bench_delay = 5;          // response delay in ms
+int    bench_lost = 1;           // percent of queries without answer
+int    bench_time = 10;          // seconds to run
+char   *bench_replay = NULL;     // capture to compress
+float  bench_dev = 0;            // compression deviation (0 = several)
+
+// statistics
+unsigned long n_start, n_stop, n_expire, n_answer, n_timeout;
+double late_sum;
+long   late_max;
+
+void query_cb(void *arg);
+
+/*********************************************************************
+ * @brief : CPU time of the program in seconds
+ *********************************************************************/
+double cpu_sec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*********************************************************************
+ * @brief : count and start timer
+ *********************************************************************/
+void bench_start(loop_timer *t, long ms, timer_cb cb, void *arg)
+{
+    timer_start(t, ms, cb, arg);
+    n_start++;
+}
+
+/*********************************************************************
+ * @brief : count expiry and how late it is
+ *********************************************************************/
+void bench_expired(loop_timer *t)
+{
+    long late = loop_now() - t->due;
+
+    n_expire++;
+    late_sum += late;
+    if (late > late_max) late_max = late;
+}
+
+/*********************************************************************
+ * @brief : answer received: stop the watchdog
+ *********************************************************************/
+void answer_cb(void *arg)
+{
+    bench_sensor *s = (bench_sensor *) arg;
+
+    bench_expired(&s->answer);
+
+    timer_stop(&s->wdog);
+    n_stop++;
+    n_answer++;
+    s->retry = 0;
+
+    // next query one interval after the previous was due
+    s->due += bench_interval;
+    if (s->due < loop_now()) s->due = loop_now();
+    bench_start(&s->query, s->due - loop_now(), query_cb, s);
+}
+
+/*********************************************************************
+ * @brief : no answer: resend after a backoff
+ *********************************************************************/
+void wdog_cb(void *arg)
+{
+    bench_sensor *s = (bench_sensor *) arg;
+    long backoff = SDS011_RETRY_BASE << s->retry;
+
+    bench_expired(&s->wdog);
+    n_timeout++;
+
+    if (backoff > SDS011_RETRY_MAX) backoff = SDS011_RETRY_MAX;
+    else s->retry++;
+
+    bench_start(&s->query, backoff, query_cb, s);
+}
+
+/*********************************************************************
+ * @brief : send query: plan the answer and the watchdog
+ *********************************************************************/
+void query_cb(void *arg)
+{
+    bench_sensor *s = (bench_sensor *) arg;
+
+    bench_expired(&s->query);
+
+    if (rand() % 100 >= bench_lost)
+        bench_start(&s->answer, bench_delay + rand() % (bench_delay + 1), answer_cb, s);
+
+    bench_start(&s->wdog, SDS011_ANSWER_TIMEOUT, wdog_cb, s);
+}
+
+/*********************************************************************
+ * @brief : time of start and stop of many timers, without the loop
+ *********************************************************************/
+void bench_ops(int cnt)
+{
+    loop_timer *t = (loop_timer *) calloc(cnt, sizeof(loop_timer));
+    double start, stop, cpu;
+    int i;
+
+    if (t == NULL) return;
+
+    cpu = cpu_sec();
+    for (i = 0; i < cnt; i++)
+        timer_start(&t[i], rand() % 60000, answer_cb, NULL);
+    start = cpu_sec() - cpu;
+
+    cpu = cpu_sec();
+    for (i = 0; i < cnt; i++) timer_stop(&t[i]);
+    stop = cpu_sec() - cpu;
+
+    printf("%7d timers : start %5.0f ns, stop %5.0f ns\n", cnt,
+        start * 1e9 / cnt, stop * 1e9 / cnt);
+
+    free(t);
+}
+
+/*********************************************************************
+ * @brief : time to record a frame in the flight recorder
+ *********************************************************************/
+void bench_trace(int cnt)
+{
+    uint8_t frame[SDS011_SENDPACKET_LEN] = { SDS011_BYTE_BEGIN, SDS011_BYTE_CMD, SDS011_QDATA };
+    double cpu;
+    int i;
+
+    cpu = cpu_sec();
+    for (i = 0; i < cnt; i++) trace_frame(TRACE_TX, i & 0xff, frame, sizeof(frame));
+    cpu = cpu_sec() - cpu;
+
+    printf("%7d events : record %4.0f ns\n", cnt, cpu * 1e9 / cnt);
+}
+
+/*********************************************************************
+ * @brief : time to decode a measurement (as received from a sensor),
+ * with the debug output of the library compiled in but not enabled, or
+ * compiled away (make DEBUG=0)
+ *********************************************************************/
+void bench_decode(int cnt)
+{
+    uint8_t frame[SDS011_PACKET_LEN] = { SDS011_BYTE_BEGIN, SDS011_DATA,
+        0x7b, 0x00, 0xc8, 0x01, 0x01, 0x10, 0x00, SDS011_BYTE_END };
+    sds011_response_t r;
+    SDS011 sds;
+    double cpu;
+    int i;
+
+    for (i = 2; i < 8; i++) frame[8] += frame[i];
+
+    cpu = cpu_sec();
+    for (i = 0; i < cnt; i++) sds.Process_Frame(frame, &r);
+    cpu = cpu_sec() - cpu;
+
+    printf("%7d frames : decode %4.0f ns (debug %s)\n", cnt, cpu * 1e9 / cnt,
+        SDS011_DEBUG ? "compiled in" : "compiled away");
+}
+
+/*********************************************************************
+ * @brief : read a capture of readings. A line is either "time pm25 pm10"
+ * or the output of sds ("PM 2.5 x, PM10 y"), then the readings are taken
+ * -i ms apart.
+ *
+ * @return : number of readings (0 on error)
+ *********************************************************************/
+int replay_read(char *file, double **t, float **v)
+{
+    FILE  *fp;
+    char  line[100];
+    double tm;
+    float pm25, pm10;
+    int   cnt = 0, size = 0;
+
+    fp = fopen(file, "r");
+    if (fp == NULL) {
+        printf("can not open %s\n", file);
+        return(0);
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (sscanf(line, "PM 2.5 %f, PM10 %f", &pm25, &pm10) == 2)
+            tm = (double) cnt * bench_interval / 1000;
+        else if (sscanf(line, "%lf %f %f", &tm, &pm25, &pm10) != 3)
+            continue;
+
+        if (cnt == size) {
+            size = size ? size * 2 : 1024;
+            *t = (double *) realloc(*t, size * sizeof(double));
+            *v = (float *) realloc(*v, size * 2 * sizeof(float));
+            if (*t == NULL || *v == NULL) {
+                printf("no memory for %d readings\n", size);
+                cnt = 0;
+                break;
+            }
+        }
+
+        (*t)[cnt] = tm;
+        (*v)[cnt * 2] = pm25;
+        (*v)[cnt * 2 + 1] = pm10;
+        cnt++;
+    }
+
+    fclose(fp);
+    return(cnt);
+}
+
+/*********************************************************************
+ * @brief : compress a capture with a deviation, check the rebuilt
+ * readings and the throughput
+ *********************************************************************/
+void replay_swing(double *t, float *v, int cnt, float dev)
+{
+    sdt_point *arch = (sdt_point *) malloc(cnt * sizeof(sdt_point));
+    swing_door d[2];
+    sdt_point p;
+    double cpu, err, max_err = 0, line;
+    unsigned long in = 0, out = 0, passes = 0;
+    int   i, c, n, a;
+
+    if (arch == NULL) return;
+
+    // rebuild each series from the archived points
+    for (c = 0; c < 2; c++) {
+
+        swing_init(&d[c], dev);
+
+        for (i = n = 0; i < cnt; i++)
+            if (swing_add(&d[c], t[i], v[i * 2 + c], &p)) arch[n++] = p;
+
+        if (swing_flush(&d[c], &p)) arch[n++] = p;
+
+        for (i = a = 0; i < cnt; i++) {
+
+            while (a < n - 2 && arch[a + 1].t < t[i]) a++;
+
+            if (n == 1 || arch[a + 1].t == arch[a].t)
+                line = arch[a].v;
+            else
+                line = arch[a].v + (arch[a + 1].v - arch[a].v) *
+                    (t[i] - arch[a].t) / (arch[a + 1].t - arch[a].t);
+
+            err = fabs(line - v[i * 2 + c]);
+            if (err > max_err) max_err = err;
+        }
+
+        in += d[c].in;
+        out += d[c].out;
+    }
+
+    // throughput: as many passes as fit in a second
+    cpu = cpu_sec();
+
+    do {
+        for (c = 0; c < 2; c++) {
+            swing_init(&d[c], dev);
+            for (i = 0; i < cnt; i++) swing_add(&d[c], t[i], v[i * 2 + c], &p);
+            swing_flush(&d[c], &p);
+        }
+        passes++;
+    } while (cpu_sec() - cpu < 1);
+
+    cpu = cpu_sec() - cpu;
+
+    printf("%6.2f  %9lu  %8lu  %6.1f  %9.3f  %s  %8.1f\n", dev, in, out,
+        (double) in / out, max_err, max_err <= dev + 1e-3 ? "ok " : "BAD",
+        passes * 2.0 * cnt / cpu / 1e6);
+
+    free(arch);
+}
+
+/*********************************************************************
+ * @brief : replay a capture through the swinging door compression
+ *********************************************************************/
+int bench_swing(char *file)
+{
+    float  devs[] = { 0.5, 1, 2, 5 };
+    double *t = NULL;
+    float  *v = NULL;
+    int    cnt, i;
+
+    cnt = replay_read(file, &t, &v);
+
+    if (cnt > 0) {
+        printf("%d readings of PM2.5 and PM10 from %s\n\n", cnt, file);
+        printf("   dev     points  archived   ratio  max error      Mpoints/s\n");
+
+        if (bench_dev) replay_swing(t, v, cnt, bench_dev);
+        else for (i = 0; i < 4; i++) replay_swing(t, v, cnt, devs[i]);
+    }
+
+    free(t);
+    free(v);
+
+    return(cnt > 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+void usage(char *name)
+{
+    printf("%s [options]\n\n"
+    "-n count    number of sensors           (default %d)\n"
+    "-i ms       query interval              (default %d ms)\n"
+    "-d ms       response delay              (default %d ms)\n"
+    "-l percent  queries without answer      (default %d %%)\n"
+    "-s sec      time to run                 (default %d s)\n"
+    "-r file     replay capture of readings through swinging door compression\n"
+    "            (time pm25 pm10, or output of sds with readings -i ms apart)\n"
+    "-e dev      compression deviation       (default 0.5, 1, 2 and 5)\n",
+    name, bench_cnt, bench_interval, bench_delay, bench_lost, bench_time);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long ops;
+    double cpu;
+    long   end;
+    int    opt, i;
+
+    while ((opt = getopt(argc, argv, "n:i:d:l:s:r:e:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': bench_cnt = atoi(optarg); break;
+            case 'i': bench_interval = atoi(optarg); break;
+            case 'd': bench_delay = atoi(optarg); break;
+            case 'l': bench_lost = atoi(optarg); break;
+            case 's': bench_time = atoi(optarg); break;
+            case 'r': bench_replay = optarg; break;
+            case 'e': bench_dev = atof(optarg); break;
+            default : usage(argv[0]); exit(EXIT_FAILURE);
+        }
+    }
+
+    if (bench_cnt < 1 || bench_interval < 1 || bench_delay < 0 || bench_time < 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (bench_replay) exit(bench_swing(bench_replay));
+
+    sensors = (bench_sensor *) calloc(bench_cnt, sizeof(bench_sensor));
+
+    if (sensors == NULL) {
+        printf("no memory for %d sensors\n", bench_cnt);
+        exit(EXIT_FAILURE);
+    }
+
+    srand(time(NULL));
+
+    // cost of an operation does not depend on the number of timers
+    for (i = 1000; i <= 100000; i *= 10) bench_ops(i);
+
+    // the flight recorder is on for every frame
+    bench_trace(1000000);
+    bench_decode(1000000);
+
+    // queries spread over the interval, as the query scheduler does
+    for (i = 0; i < bench_cnt; i++) {
+        sensors[i].due = loop_now() + (long) i * bench_interval / bench_cnt;
+        bench_start(&sensors[i].query, sensors[i].due - loop_now(), query_cb, &sensors[i]);
+    }
+
+    printf("\n%d sensors, query every %d ms, answer after %d ms, %d %% lost, %d s\n",
+        bench_cnt, bench_interval, bench_delay, bench_lost, bench_time);
+
+    n_start = n_stop = n_expire = 0;
+    cpu = cpu_sec();
+    end = loop_now() + bench_time * 1000L;
+
+    while (loop_now() < end) loop_once(end - loop_now());
+
+    cpu = cpu_sec() - cpu;
+    ops = n_start + n_stop + n_expire;
+
+    printf("active timers  : %d\n", timer_count());
+    printf("answers        : %lu, timeouts %lu\n", n_answer, n_timeout);
+    printf("timer ops      : %lu (%lu start, %lu stop, %lu expired), %.0f / s\n",
+        ops, n_start, n_stop, n_expire, (double) ops / bench_time);
+    printf("cpu            : %.3f s (%.1f %%), %.0f ns / op\n",
+        cpu, cpu * 100 / bench_time, cpu * 1e9 / ops);
+    printf("late on expiry : avg %.2f ms, max %ld ms\n",
+        n_expire ? late_sum / n_expire : 0, late_max);
+
+    free(sensors);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,651 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Daemon mode: keep sensors open and streaming and answer queries on
+ * a Unix socket.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sds.h"
+#include "sds_daemon.h"
+#include "sds_fleet.h"
+#include "sds_hotplug.h"
+#include "sds_loop.h"
+#include "sds_plan.h"
+#include "sds_sched.h"
+#include "sds_trace.h"
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define REPLY_LEN  (FLEET_MAX_SENSORS * 160)
+
+char sock_path[SOCK_PATH_LEN] = SOCK_PATH_DEF;
+bool daemon_hotplug = false;
+char *daemon_uevent_sim = NULL;
+int  listen_fd = -1;
+loop_timer laser_timer;          // regular save of the laser time
+char reply[REPLY_LEN];
+
+/*********************************************************************
+ * @brief : add formatted text to reply buffer
+ *
+ * @param len : current length of reply
+ * @return new length of reply
+ *********************************************************************/
+int add_reply(int len, const char *format, ...)
+{
+    va_list arg;
+    int     n;
+
+    if (len >= REPLY_LEN) return(len);
+
+    va_start(arg, format);
+    n = vsnprintf(reply + len, REPLY_LEN - len, format, arg);
+    va_end(arg);
+
+    if (n < 0) return(len);
+    return(len + n > REPLY_LEN ? REPLY_LEN : len + n);
+}
+
+/*********************************************************************
+ * @brief : part of the time the laser of a sensor is on, for the duty
+ * cycle the max (the warm up can end earlier)
+ *********************************************************************/
+double laser_on(sensor_t *s)
+{
+    if (duty_period == 0) return(laser_duty(s->wmode, s->period));
+
+    return(duty_warmup + PLAN_SAMPLE < duty_period ? (double) (duty_warmup + PLAN_SAMPLE) / duty_period : 1);
+}
+
+/*********************************************************************
+ * @brief : create answer on query
+ *
+ * @param cmd : received query
+ * @return length of answer in reply
+ *********************************************************************/
+int create_reply(char *cmd)
+{
+    int i, len = 0;
+    sensor_t *s;
+    double avg, jitter;
+
+    // statistics of the query scheduler for the whole fleet
+    if (strcmp(cmd, "sched") == 0) {
+
+        if (query_interval == 0)
+            return(add_reply(0, "query scheduler off\n"));
+
+        if (qstats.count == 0)
+            return(add_reply(0, "interval=%ld flight=%d count=0 timeouts=%u\n",
+                query_interval, query_flight, qstats.timeouts));
+
+        avg = qstats.lat_sum / qstats.count;
+        jitter = qstats.lat_sq / qstats.count - avg * avg;
+        jitter = jitter > 0 ? sqrt(jitter) : 0;
+
+        return(add_reply(0, "interval=%ld flight=%d/%d count=%u timeouts=%u latency=%ld/%.1f/%ld jitter=%.1f delay=%.1f/%ld\n",
+            query_interval, qstats.max_flight, query_flight, qstats.count, qstats.timeouts,
+            qstats.lat_min, avg, qstats.lat_max, jitter,
+            qstats.delays ? qstats.delay_sum / qstats.delays : 0, qstats.delay_max));
+    }
+
+    // write the flight recorder
+    if (strcmp(cmd, "trace") == 0) {
+
+        trace_state(TRACE_DUMP, 0xff, 0, 0);
+
+        if ((i = trace_save()) < 0)
+            return(add_reply(0, "error could not write flight recorder '%s'\n", trace_file));
+
+        return(add_reply(0, "%d events written to %s\n", i, trace_file));
+    }
+
+    // latest snapshot of the fleet
+    if (strcmp(cmd, "snap") == 0) {
+
+        if (snap_interval == 0)
+            return(add_reply(0, "snapshots off\n"));
+
+        if (sstats.id == 0)
+            return(add_reply(0, "interval=%d snapshot=0\n", snap_interval));
+
+        len = add_reply(0, "interval=%d snapshot=%u time=%ld answered=%d/%d send=%.3f spread=%.3f count=%u incomplete=%u avg=%.3f max=%.3f\n",
+            snap_interval, sstats.id, (long) sstats.time, sstats.answered, sstats.sent,
+            sstats.send / 1000.0, sstats.answered ? (sstats.last - sstats.first) / 1000.0 : 0,
+            sstats.count, sstats.incomplete,
+            sstats.count ? sstats.spread_sum / sstats.count / 1000.0 : 0, sstats.spread_max / 1000.0);
+
+        for (i = 0; i < fleet_cnt; i++)
+        {
+            s = &fleet[i];
+
+            if (s->snap_id != sstats.id)
+                len = add_reply(len, "%s missed\n", s->name);
+            else
+                len = add_reply(len, "%s devid=0x%04x pm25=%.1f pm10=%.1f offset=%.3f\n",
+                    s->name, s->sds.Get_DevID(), s->pm25, s->pm10,
+                    (s->snap_rx - sstats.t_sent) / 1000.0);
+        }
+
+        return(len);
+    }
+
+    for (i = 0; i < fleet_cnt; i++)
+    {
+        s = &fleet[i];
+
+        if (strcmp(cmd, "data") == 0) {
+
+            if (s->fd == 0xff || s->conn != FLEET_CONN_NONE)
+                len = add_reply(len, "%s disconnected\n", s->name);
+            else if (fleet_age(s) < 0)
+                len = add_reply(len, "%s no data\n", s->name);
+            else if (snap_interval)
+                len = add_reply(len, "%s devid=0x%04x pm25=%.1f pm10=%.1f age=%.1f snap=%u\n",
+                   s->name, s->sds.Get_DevID(), s->pm25, s->pm10, fleet_age(s), s->snap_id);
+            else
+                len = add_reply(len, "%s devid=0x%04x pm25=%.1f pm10=%.1f age=%.1f%s\n",
+                   s->name, s->sds.Get_DevID(), s->pm25, s->pm10, fleet_age(s),
+                   s->warming ? " warming" : "");
+        }
+        else if (strcmp(cmd, "stats") == 0) {
+
+            if (s->count == 0)
+                len = add_reply(len, "%s count=0 errors=%u missed=%u early=%u\n", s->name, s->errors,
+                   s->duty_missed, s->duty_early);
+            else
+                len = add_reply(len, "%s count=%u errors=%u missed=%u early=%u pm25=%.1f/%.1f/%.1f pm10=%.1f/%.1f/%.1f\n",
+                   s->name, s->count, s->errors, s->duty_missed, s->duty_early,
+                   s->pm25_min, s->pm25_sum / s->count, s->pm25_max,
+                   s->pm10_min, s->pm10_sum / s->count, s->pm10_max);
+        }
+        else if (strcmp(cmd, "laser") == 0) {
+
+            if (s->fd == 0xff || s->conn != FLEET_CONN_NONE)
+                len = add_reply(len, "%s disconnected\n", s->name);
+            else {
+                fleet_laser(s);
+                len = add_reply(len, "%s devid=0x%04x hours=%.2f on=%.1f%%\n",
+                   s->name, s->sds.Get_DevID(), fleet_laser_hours(s->sds.Get_DevID()),
+                   laser_on(s) * 100);
+            }
+        }
+        else if (strcmp(cmd, "config") == 0) {
+
+            if (s->fd == 0xff || s->conn != FLEET_CONN_NONE)
+                len = add_reply(len, "%s disconnected\n", s->name);
+            else
+                len = add_reply(len, "%s devid=0x%04x firmware=%d-%d-%d report=%s mode=%s period=%d duty=%s rate=%ld interval=%ld\n",
+                   s->name, s->sds.Get_DevID(), s->fw[0], s->fw[1], s->fw[2],
+                   s->rmode == REPORT_QUERY ? "query" : "stream",
+                   s->wmode == MODE_SLEEP ? "sleep" : "work", s->period, duty_name(s->duty),
+                   s->query_min, query_interval ? query_period(s) : 0);
+        }
+        else
+            return(add_reply(0, "error unknown query '%s' [data, stats, config, sched, laser, snap, trace]\n", cmd));
+    }
+
+    return(len);
+}
+
+/*********************************************************************
+ * @brief : handle query from a client (one query per connection)
+ *********************************************************************/
+void client_cb(int fd, short revents, void *arg)
+{
+    struct pollfd pfd;
+    char   cmd[32];
+    int    cfd, n, len, off = 0;
+
+    cfd = accept(fd, NULL, NULL);
+    if (cfd < 0) return;
+
+    // the client sends the query right after connect
+    pfd.fd = cfd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, 200) == 1 && (n = read(cfd, cmd, sizeof(cmd) - 1)) > 0) {
+
+        cmd[n] = 0x0;
+        cmd[strcspn(cmd, "\r\n")] = 0x0;
+
+        len = create_reply(cmd);
+
+        while (off < len) {
+            n = write(cfd, reply + off, len - off);
+            if (n <= 0) break;
+            off += n;
+        }
+    }
+
+    close(cfd);
+}
+
+void sensor_cb(int fd, short revents, void *arg);
+void bus_cb(int fd, short revents, void *arg);
+void connect_retry(sensor_t *s);
+
+/*********************************************************************
+ * @brief : watch the port of a connected sensor (once for a bus)
+ *********************************************************************/
+void sensor_watch(sensor_t *s)
+{
+    if (s->bus == NULL) loop_add(s->fd, sensor_cb, s);
+    else if (s->bus->cnt == 1) loop_add(s->fd, bus_cb, s->bus);
+}
+
+/*********************************************************************
+ * @brief : stop the schedulers and disconnect a sensor
+ *********************************************************************/
+void sensor_close(sensor_t *s)
+{
+    duty_stop(s);
+    query_stop(s);
+    s->snap_wait = 0;
+
+    // the last sensor on a bus stops watching the port
+    if (s->bus == NULL || s->bus->cnt == 1) loop_del(s->fd);
+
+    fleet_disconnect(s);
+}
+
+/*********************************************************************
+ * @brief : handle input from a sensor
+ *********************************************************************/
+void sensor_cb(int fd, short revents, void *arg)
+{
+    sensor_t *s = (sensor_t *) arg;
+    sds011_response_t r;
+
+    if (revents & (POLLHUP | POLLERR | POLLNVAL)) {
+
+        if (s->conn != FLEET_CONN_NONE) {
+            sensor_close(s);
+            connect_retry(s);
+            return;
+        }
+
+        p_printf(RED, (char *) "Lost connection to %s\n", s->name);
+        sensor_close(s);
+        s->errors++;
+        s->next_try = loop_now() + DAEMON_RETRY * 1000;
+        return;
+    }
+
+    while (s->sds.Read_Response(&r) == SDS011_OK)
+    {
+        // still connecting (closed again when that failed)
+        if (s->conn != FLEET_CONN_NONE) {
+            fleet_connect_input(s, &r);
+            if (s->fd == 0xff) return;
+        }
+
+        // the scheduler decides which measurements are samples
+        else if (snap_interval) {
+            if (snap_response(s, &r)) fleet_update(s, r.pm25, r.pm10);
+        }
+        else if (query_interval) {
+            if (query_response(s, &r)) fleet_update(s, r.pm25, r.pm10);
+        }
+        else if (duty_response(s, &r)) {
+            fleet_update(s, r.pm25, r.pm10);
+            adapt_sample(s);
+        }
+
+        // kept, but marked as not stable yet
+        else if (r.cmd_id == SDS011_DATA && s->duty == DUTY_WARMING)
+            fleet_warming(s, r.pm25, r.pm10);
+    }
+
+    // a command without answer must not hold up the next ones
+    s->sds.Queue_Pump();
+}
+
+/*********************************************************************
+ * @brief : handle input from a multi-drop bus
+ *
+ * The first sensor reads the port and the library hands each response
+ * to the sensor it is from, the others only take their responses.
+ *********************************************************************/
+void bus_cb(int fd, short revents, void *arg)
+{
+    sds011_bus *bus = (sds011_bus *) arg;
+    int i;
+
+    for (i = 0; i < fleet_cnt; i++) {
+        if (fleet[i].bus == bus && fleet[i].fd == fd) sensor_cb(fd, revents, &fleet[i]);
+    }
+}
+
+/*********************************************************************
+ * @brief : schedule the next connect attempt of a sensor
+ *********************************************************************/
+void connect_retry(sensor_t *s)
+{
+    // just plugged in: the port might not be ready yet
+    if (s->fast_try) {
+        s->fast_try--;
+        s->next_try = loop_now() + HOTPLUG_FAST;
+    }
+    else
+        s->next_try = loop_now() + DAEMON_RETRY * 1000;
+}
+
+/*********************************************************************
+ * @brief : a connect has finished (see fleet_connect())
+ *********************************************************************/
+void connect_done(sensor_t *s, int ret)
+{
+    if (ret == SDS011_ERROR) {
+        sensor_close(s);
+        connect_retry(s);
+        return;
+    }
+
+    p_printf(GREEN, (char *) "Connected to %s (devid 0x%04x%s)\n",
+        s->name, s->sds.Get_DevID(), s->warm ? ", warm start" : "");
+    s->fast_try = 0;
+    duty_start(s);
+    query_start(s);
+}
+
+/*********************************************************************
+ * @brief : start to connect sensors that are due for a connect attempt.
+ * The connects run from the event loop (see fleet_connect()), so a port
+ * that does not answer does not hold up the others.
+ *
+ * @return : milliseconds until the next attempt that is due
+ *********************************************************************/
+long connect_fleet()
+{
+    sensor_t *s;
+    long now, next = DAEMON_RETRY * 1000;
+    int  i;
+
+    for (i = 0; i < fleet_cnt; i++)
+    {
+        s = &fleet[i];
+
+        if (s->fd != 0xff || s->unplugged) continue;
+
+        now = loop_now();
+
+        if (now >= s->next_try) {
+
+            if (fleet_connect(s, connect_done) == SDS011_OK) {
+                sensor_watch(s);
+                continue;
+            }
+
+            connect_retry(s);
+        }
+
+        if (s->next_try - now < next) next = s->next_try - now;
+    }
+
+    // for a warm start next time
+    fleet_state_save();
+
+    return(next < 0 ? 0 : next);
+}
+
+/*********************************************************************
+ * @brief : handle uevent of a port being plugged in or removed
+ *********************************************************************/
+void hotplug_cb(int fd, short revents, void *arg)
+{
+    hotplug_event ev;
+    sensor_t *s;
+    int i;
+
+    if (hotplug_read(fd, &ev) == SDS011_ERROR) return;
+
+    if (fleet_find(ev.port) == NULL) {
+
+        if (! ev.add) return;
+
+        if (fleet_add(ev.port) == NULL) {
+            p_printf(RED, (char *) "No room for %s (max %d)\n", ev.port, FLEET_MAX_SENSORS);
+            return;
+        }
+    }
+
+    p_printf(YELLOW, (char *) "%s %s\n", ev.add ? "Plugged in" : "Removed", ev.port);
+
+    // all sensors on the port (more than one on a bus)
+    for (i = 0; i < fleet_cnt; i++)
+    {
+        s = &fleet[i];
+
+        if (strcmp(s->port, ev.port) != 0) continue;
+
+        if (ev.add) {
+            // attach on next loop
+            s->unplugged = false;
+            s->next_try = loop_now();
+            s->fast_try = HOTPLUG_FAST_CNT;
+        }
+        else {
+            if (s->fd != 0xff) sensor_close(s);
+            s->unplugged = true;
+        }
+    }
+}
+
+/*********************************************************************
+ * @brief : create the listening Unix socket
+ *
+ * @return : socket or -1 on error
+ *********************************************************************/
+int open_socket()
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return(-1);
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+
+    // remove left over from earlier run
+    unlink(sock_path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return(-1);
+    }
+
+    // clients do not need to be super user
+    chmod(sock_path, 0666);
+
+    return(fd);
+}
+
+/*********************************************************************
+ * @brief : count the laser time of the sensors and save it regularly
+ *********************************************************************/
+void laser_cb(void *arg)
+{
+    int i;
+
+    for (i = 0; i < fleet_cnt; i++) fleet_laser(&fleet[i]);
+
+    fleet_state_save();
+
+    timer_start(&laser_timer, DAEMON_LASER * 1000L, laser_cb, NULL);
+}
+
+/*********************************************************************
+ * @brief : stop on a signal: keep what was received and set all sensors
+ * to sleep at the same time, instead of leaving the lasers on
+ *********************************************************************/
+void daemon_stop()
+{
+    sensor_t *s;
+    long start = loop_now();
+    int  i, open = 0, asleep;
+
+    p_printf(YELLOW, (char *) "\nStopping SDS-011 daemon\n");
+
+    snap_stop();
+
+    for (i = 0; i < fleet_cnt; i++)
+    {
+        s = &fleet[i];
+
+        if (s->fd == 0xff) continue;
+
+        // readings that were received already (a connect is not finished)
+        if (s->conn == FLEET_CONN_NONE) sensor_cb(s->fd, 0, s);
+
+        duty_stop(s);
+        query_stop(s);
+        open++;
+    }
+
+    asleep = fleet_sleep_all(DAEMON_SHUTDOWN);
+
+    // including the laser time till now
+    for (i = 0; i < fleet_cnt; i++) fleet_laser(&fleet[i]);
+
+    fleet_state_save();
+
+    p_printf(asleep < open ? RED : GREEN, (char *) "%d of %d sensors set to sleep in %ld ms\n",
+        asleep, open, loop_now() - start);
+}
+
+/*********************************************************************
+ * @brief : run daemon on the sensors in the fleet table
+ *
+ * @return : only returns on error (SDS011_ERROR)
+ *********************************************************************/
+int daemon_run()
+{
+    long wait;
+    int  fd;
+
+    listen_fd = open_socket();
+
+    if (listen_fd < 0) {
+        p_printf(RED, (char *) "could not create socket %s : %s\n", sock_path, strerror(errno));
+        return(SDS011_ERROR);
+    }
+
+    loop_add(listen_fd, client_cb, NULL);
+
+    p_printf(GREEN, (char *) "Daemon listening on %s\n", sock_path);
+
+    timer_start(&laser_timer, DAEMON_LASER * 1000L, laser_cb, NULL);
+
+    // readings that were not saved before a crash
+    fleet_recover();
+
+    snap_start();
+
+    if (daemon_hotplug) {
+
+        fd = hotplug_open(daemon_uevent_sim);
+
+        if (fd < 0) {
+            p_printf(RED, (char *) "could not open uevent socket : %s\n", strerror(errno));
+            return(SDS011_ERROR);
+        }
+
+        loop_add(fd, hotplug_cb, NULL);
+    }
+
+    while (! loop_signal)
+    {
+        wait = connect_fleet();
+
+        if (wait > 1000) wait = 1000;
+
+        if (loop_once(wait) < 0) {
+            p_printf(RED, (char *) "error in event loop : %s\n", strerror(errno));
+            return(SDS011_ERROR);
+        }
+    }
+
+    daemon_stop();
+
+    return(SDS011_OK);
+}
+
+/*********************************************************************
+ * @brief : remove the socket of the daemon (if running)
+ *********************************************************************/
+void daemon_close()
+{
+    hotplug_close();
+
+    if (listen_fd < 0) return;
+
+    close(listen_fd);
+    unlink(sock_path);
+    listen_fd = -1;
+}
+
+/*********************************************************************
+ * @brief : send query to the daemon and print the answer
+ *
+ * @return :
+ *  SDS011_ERROR : could not connect to daemon
+ *  SDS011_OK    : all good
+ *********************************************************************/
+int client_query(char *cmd)
+{
+    struct sockaddr_un addr;
+    char   buf[1024];
+    int    fd, n;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return(SDS011_ERROR);
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return(SDS011_ERROR);
+    }
+
+    n = snprintf(buf, sizeof(buf), "%s\n", cmd);
+
+    if (write(fd, buf, n) != n) {
+        close(fd);
+        return(SDS011_ERROR);
+    }
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, n, stdout);
+
+    close(fd);
+
+    return(SDS011_OK);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Daemon mode: keep sensors open and streaming and answer queries on
+ * a Unix socket. The client side of the same program sends a query and
+ * prints the answer.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SDS_DAEMON_H
+#define _SDS_DAEMON_H
+
+#define SOCK_PATH_DEF  "/var/run/sds011.sock"
+#define SOCK_PATH_LEN  108       // sizeof(sockaddr_un.sun_path)
+#define DAEMON_RETRY   5         // seconds between reconnect attempts
+#define DAEMON_SHUTDOWN 500      // max ms to set the sensors to sleep on stop
+#define DAEMON_LASER   300       // seconds between saves of the laser time
+
+extern char sock_path[SOCK_PATH_LEN];
+extern bool daemon_hotplug;      // attach / detach sensors on hotplug
+extern char *daemon_uevent_sim;  // simulated uevent socket (NULL = netlink)
+
+/**
+ * @brief : run daemon on the sensors in the fleet table. Sensors that
+ * can not be connected are retried every DAEMON_RETRY seconds.
+ *
+ * With daemon_hotplug, CH341 ports that are plugged in are attached
+ * right away and removed ports are closed, without restarting.
+ *
+ * Supported queries on the socket (one per connection):
+ *  data   : latest measurement of each sensor
+ *  stats  : count, min, max and average since connect
+ *  config : firmware, device ID, reporting/working mode and period
+ *  sched  : latency of the query scheduler
+ *  laser  : laser hours of each sensor and part of the time it is on
+ *
+ * On a signal (see loop_signals()) the readings that were received are
+ * stored, the state is saved and all sensors are set to sleep at the
+ * same time, in at most DAEMON_SHUTDOWN ms.
+ *
+ * @return :
+ *  SDS011_ERROR : error
+ *  SDS011_OK    : stopped on a signal
+ */
+int daemon_run();
+
+/**
+ * @brief : remove the socket of the daemon (if running)
+ */
+void daemon_close();
+
+/**
+ * @brief : send query to the daemon and print the answer
+ *
+ * @param cmd : query to send (data, stats, config)
+ *
+ * @return :
+ *  SDS011_ERROR : could not connect to daemon
+ *  SDS011_OK    : all good
+ */
+int client_query(char *cmd);
+
+#endif /* _SDS_DAEMON_H */
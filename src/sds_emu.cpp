@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Emulator of one or more SDS-011 sensors on pseudo terminals (PTY).
+ * Used to try and benchmark the sds program without hardware.
+ * 
+ * Each emulated sensor gets a PTY, a symbolic link <prefix><n> is made
+ * to the slave side, which can be used with sds -u <prefix><n>.
+ *
+ * With -U the emulator sends uevents (as the kernel does on hotplug) to
+ * the simulation socket of the daemon (sds -S -U path). SIGUSR1 then
+ * unplugs / plugs in the first sensor.
+ *
+ * SIGUSR2 starts a pollution event on all sensors: the readings jump up
+ * and decay back in about a minute.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sds011_lib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define EMU_MAX      256         // max sensors to emulate
+#define EMU_QUEUE    8           // max pending responses per sensor
+#define EMU_PLUME    100.0       // ug/m3 PM2.5 at the start of an event
+#define EMU_PLUME_DECAY 12.0     // seconds to decay to a third
+
+typedef struct emu_reply
+{
+    double   due;                // time to send
+    uint8_t  frame[SDS011_PACKET_LEN];
+} emu_reply;
+
+typedef struct emu_sensor
+{
+    int      fd;                 // master side of PTY (-1 if unplugged)
+    bool     client;             // a client has the slave side open
+    char     link[64];           // symbolic link to slave side
+    uint16_t devid;              // device ID
+    uint8_t  rmode;              // reporting mode
+    uint8_t  wmode;              // sleep / work mode
+    uint8_t  period;             // working period
+    double   wake;               // time of last wake up
+    double   next;               // next streaming measurement
+    float    pm25, pm10;         // current value (random walk)
+    uint8_t  cmd[SDS011_SENDPACKET_LEN]; // received command bytes
+    uint8_t  cmd_cnt;
+    emu_reply queue[EMU_QUEUE];  // pending responses
+    int      q_cnt;
+} emu_sensor;
+
+emu_sensor emu[EMU_MAX];
+int    emu_cnt = 1;              // number of sensors
+bool   emu_bus = false;          // all sensors on one PTY
+int    emu_delay = 5;            // response delay in ms
+int    emu_interval = 1000;      // streaming interval in ms
+int    emu_warmup = 20;          // seconds unstable after wake up
+char   emu_prefix[40] = "/tmp/sds";
+bool   emu_verbose = false;
+char   *emu_uevent = NULL;       // socket to send uevents to
+volatile sig_atomic_t emu_stop = 0;
+volatile sig_atomic_t emu_toggle = 0;
+volatile sig_atomic_t emu_event = 0;
+double emu_event_start = -1e9;   // time of the latest pollution event
+
+/*********************************************************************
+ * @brief : current monotonic time in seconds
+ *********************************************************************/
+double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*********************************************************************
+ * @brief : queue a response frame
+ *********************************************************************/
+void emu_queue(emu_sensor *e, uint8_t cmd_id, uint8_t *d, double delay)
+{
+    emu_reply *r;
+    uint8_t   crc = 0;
+    int       i;
+
+    if (e->q_cnt == EMU_QUEUE) return;   // sensor is overloaded: drop
+
+    r = &e->queue[e->q_cnt++];
+    r->due = now_sec() + delay;
+    r->frame[0] = SDS011_BYTE_BEGIN;
+    r->frame[1] = cmd_id;
+    for (i = 0; i < 4; i++) r->frame[2 + i] = d[i];
+    r->frame[6] = e->devid & 0xff;
+    r->frame[7] = e->devid >> 8;
+    for (i = 2; i < 8; i++) crc += r->frame[i];
+    r->frame[8] = crc;
+    r->frame[9] = SDS011_BYTE_END;
+}
+
+/*********************************************************************
+ * @brief : queue a measurement, unstable during warm up
+ *********************************************************************/
+void emu_measure(emu_sensor *e, double delay)
+{
+    uint8_t d[4];
+    float   pm25, pm10, w;
+    uint16_t v;
+
+    // slow random walk
+    e->pm25 += (rand() % 21 - 10) / 20.0;
+    if (e->pm25 < 1) e->pm25 = 1;
+    e->pm10 = e->pm25 * 1.6;
+
+    pm25 = e->pm25;
+    pm10 = e->pm10;
+
+    // pollution event: a plume that decays
+    w = now_sec() - emu_event_start;
+    if (w < EMU_PLUME_DECAY * 5) {
+        pm25 += EMU_PLUME * exp(-w / EMU_PLUME_DECAY);
+        pm10 += EMU_PLUME * 1.6 * exp(-w / EMU_PLUME_DECAY);
+    }
+
+    // during warm up the readings decay from a high value and are noisy
+    w = now_sec() - e->wake;
+    if (w < emu_warmup) {
+        w = 1 - w / emu_warmup;
+        pm25 += pm25 * 3 * w + (rand() % 100) * w / 5;
+        pm10 += pm10 * 3 * w + (rand() % 100) * w / 5;
+    }
+
+    v = (uint16_t) (pm25 * 10);
+    d[0] = v & 0xff; d[1] = v >> 8;
+    v = (uint16_t) (pm10 * 10);
+    d[2] = v & 0xff; d[3] = v >> 8;
+
+    emu_queue(e, SDS011_DATA, d, delay);
+}
+
+/*********************************************************************
+ * @brief : handle complete command for a sensor
+ *********************************************************************/
+void emu_command(emu_sensor *e, uint8_t *c)
+{
+    uint8_t  d[4] = {c[2], c[3], c[4], 0};
+    uint16_t target = (c[16] << 8) + c[15];
+    double   delay = emu_delay / 1000.0;
+
+    if (target != 0xffff && target != e->devid) return;
+
+    // a sleeping sensor only reacts on wake up
+    if (e->wmode == MODE_SLEEP && !(c[2] == SDS011_SLEEP && c[3] == 1 && c[4] == MODE_WORK)) {
+        if (! (c[2] == SDS011_SLEEP && c[3] == 0)) return;
+    }
+
+    switch (c[2])
+    {
+        case SDS011_QDATA:
+            emu_measure(e, delay);
+            return;
+
+        case SDS011_MODE:
+            if (c[3]) e->rmode = c[4];
+            d[2] = e->rmode;
+            break;
+
+        case SDS011_SLEEP:
+            if (c[3]) {
+                if (c[4] == MODE_WORK && e->wmode == MODE_SLEEP) e->wake = now_sec();
+                e->wmode = c[4];
+            }
+            d[2] = e->wmode;
+            break;
+
+        case SDS011_PERIOD:
+            if (c[3]) e->period = c[4];
+            d[2] = e->period;
+            break;
+
+        case SDS011_DEVID:
+            e->devid = (c[14] << 8) + c[13];
+            d[1] = d[2] = 0;
+            break;
+
+        case SDS011_FWVER:
+            d[1] = 18; d[2] = 11; d[3] = 16;
+            break;
+
+        default:
+            return;
+    }
+
+    emu_queue(e, SDS011_CONF, d, delay);
+}
+
+/*********************************************************************
+ * @brief : collect command bytes received for a sensor
+ *********************************************************************/
+void emu_input(emu_sensor *e, uint8_t *buf, int len)
+{
+    int i, j;
+
+    for (i = 0; i < len; i++)
+    {
+        if (e->cmd_cnt == 0 && buf[i] != SDS011_BYTE_BEGIN) continue;
+
+        e->cmd[e->cmd_cnt++] = buf[i];
+
+        if (e->cmd_cnt < SDS011_SENDPACKET_LEN) continue;
+
+        e->cmd_cnt = 0;
+
+        uint8_t crc = 0;
+        for (j = 2; j < 17; j++) crc += e->cmd[j];
+
+        if (e->cmd[1] != SDS011_BYTE_CMD || e->cmd[17] != crc || e->cmd[18] != SDS011_BYTE_END)
+            continue;
+
+        if (emu_bus) {
+            for (j = 0; j < emu_cnt; j++) emu_command(&emu[j], e->cmd);
+        }
+        else
+            emu_command(e, e->cmd);
+    }
+}
+
+/*********************************************************************
+ * @brief : create PTY and symbolic link for sensor
+ *********************************************************************/
+int emu_open(emu_sensor *e, int n)
+{
+    struct termios tty;
+
+    e->fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (e->fd < 0 || grantpt(e->fd) < 0 || unlockpt(e->fd) < 0) return(-1);
+
+    // never block when nobody reads the slave side: drop instead
+    fcntl(e->fd, F_SETFL, fcntl(e->fd, F_GETFL) | O_NONBLOCK);
+
+    // raw mode on slave, so bytes are passed unchanged
+    tcgetattr(e->fd, &tty);
+    cfmakeraw(&tty);
+    tcsetattr(e->fd, TCSANOW, &tty);
+
+    snprintf(e->link, sizeof(e->link), "%s%d", emu_prefix, n);
+    unlink(e->link);
+
+    if (symlink(ptsname(e->fd), e->link) < 0) return(-1);
+
+    // nothing is sent before a client opens the slave side (see emu_client())
+    e->client = false;
+
+    return(0);
+}
+
+/*********************************************************************
+ * @brief : check whether a client has the slave side open
+ *
+ * Without a client the master reports POLLHUP. A real serial port drops
+ * what the sensor sends while it is closed, so nothing is written then
+ * and what the last client left unread is flushed. Else a client would
+ * find old measurements waiting when it opens the port.
+ *********************************************************************/
+bool emu_client(emu_sensor *e)
+{
+    struct pollfd p;
+    int fd;
+
+    p.fd = e->fd;
+    p.events = 0;
+
+    if (poll(&p, 1, 0) <= 0 || ! (p.revents & POLLHUP)) {
+        e->client = true;
+        return(true);
+    }
+
+    if (e->client) {
+        fd = open(ptsname(e->fd), O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (fd >= 0) {
+            tcflush(fd, TCIFLUSH);
+            close(fd);
+        }
+        e->client = false;
+    }
+
+    return(false);
+}
+
+/*********************************************************************
+ * @brief : send uevent for sensor (if requested with -U)
+ *********************************************************************/
+void emu_send_uevent(emu_sensor *e, const char *action)
+{
+    struct sockaddr_un addr;
+    char   buf[300];
+    int    fd, len;
+
+    if (emu_uevent == NULL) return;
+
+    len = snprintf(buf, sizeof(buf), "%s@/devices/virtual/tty/%s", action, e->link);
+    len++;
+    len += snprintf(buf + len, sizeof(buf) - len, "ACTION=%s", action) + 1;
+    len += snprintf(buf + len, sizeof(buf) - len, "SUBSYSTEM=tty") + 1;
+    len += snprintf(buf + len, sizeof(buf) - len, "DEVNAME=%s", e->link) + 1;
+    len += snprintf(buf + len, sizeof(buf) - len, "PRODUCT=1a86/7523/254") + 1;
+
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0) return;
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, emu_uevent, sizeof(addr.sun_path) - 1);
+
+    sendto(fd, buf, len, 0, (struct sockaddr *) &addr, sizeof(addr));
+    close(fd);
+}
+
+/*********************************************************************
+ * @brief : unplug or plug in sensor
+ *********************************************************************/
+void emu_plug(emu_sensor *e, int n)
+{
+    if (e->fd >= 0) {
+        emu_send_uevent(e, "remove");
+        close(e->fd);
+        unlink(e->link);
+        e->fd = -1;
+        printf("%s unplugged\n", e->link);
+    }
+    else {
+        if (emu_open(e, n) < 0) return;
+        emu_send_uevent(e, "add");
+        printf("%s -> %s plugged in\n", e->link, ptsname(e->fd));
+    }
+
+    e->q_cnt = 0;
+    e->cmd_cnt = 0;
+    fflush(stdout);
+}
+
+void emu_signal(int sig)
+{
+    if (sig == SIGUSR1) emu_toggle = 1;
+    else if (sig == SIGUSR2) emu_event = 1;
+    else emu_stop = 1;
+}
+
+void usage(char *name)
+{
+    printf("%s [options]\n\n"
+    "-n count    number of sensors           (default 1, max %d)\n"
+    "-p prefix   prefix of link to PTY       (default %s)\n"
+    "-b          multi-drop bus: all sensors on one PTY (%s0)\n"
+    "-d ms       response delay              (default %d ms)\n"
+    "-i ms       streaming interval          (default %d ms)\n"
+    "-w sec      warm up after wake          (default %d s)\n"
+    "-U path     send uevents to socket path, SIGUSR1 unplugs / plugs in sensor 0\n"
+    "            (SIGUSR2 starts a pollution event)\n"
+    "-v          show commands\n",
+    name, EMU_MAX, emu_prefix, emu_prefix, emu_delay, emu_interval, emu_warmup);
+}
+
+int main(int argc, char *argv[])
+{
+    struct pollfd pfd[EMU_MAX];
+    uint8_t buf[256];
+    double  t, wait;
+    int     opt, i, j, n, npty;
+
+    while ((opt = getopt(argc, argv, "n:p:bd:i:w:U:vh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': emu_cnt = atoi(optarg); break;
+            case 'p': strncpy(emu_prefix, optarg, sizeof(emu_prefix) - 1); break;
+            case 'b': emu_bus = true; break;
+            case 'd': emu_delay = atoi(optarg); break;
+            case 'i': emu_interval = atoi(optarg); break;
+            case 'w': emu_warmup = atoi(optarg); break;
+            case 'U': emu_uevent = optarg; break;
+            case 'v': emu_verbose = true; break;
+            default : usage(argv[0]); exit(EXIT_FAILURE);
+        }
+    }
+
+    if (emu_cnt < 1 || emu_cnt > EMU_MAX || emu_interval < 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGINT, emu_signal);
+    signal(SIGTERM, emu_signal);
+    signal(SIGUSR1, emu_signal);
+    signal(SIGUSR2, emu_signal);
+    srand(time(NULL));
+
+    npty = emu_bus ? 1 : emu_cnt;
+    t = now_sec();
+
+    for (i = 0; i < emu_cnt; i++)
+    {
+        emu[i].devid = emu_bus ? 0x1000 + i : 0x1000 + (rand() & 0xfff);
+        emu[i].rmode = REPORT_STREAM;
+        emu[i].wmode = MODE_WORK;
+        emu[i].wake = t - emu_warmup;
+        emu[i].next = t + (rand() % emu_interval) / 1000.0;
+        emu[i].pm25 = 5 + rand() % 20;
+
+        if (i < npty) {
+            if (emu_open(&emu[i], i) < 0) {
+                printf("could not create PTY %d : %s\n", i, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            printf("%s -> %s devid 0x%04x\n", emu[i].link, ptsname(emu[i].fd), emu[i].devid);
+            emu_send_uevent(&emu[i], "add");
+        }
+    }
+
+    fflush(stdout);
+
+    while (! emu_stop)
+    {
+        if (emu_toggle) {
+            emu_toggle = 0;
+            emu_plug(&emu[0], 0);
+        }
+
+        if (emu_event) {
+            emu_event = 0;
+            emu_event_start = now_sec();
+        }
+
+        t = now_sec();
+        wait = 0.1;
+
+        // a port without client is looked at again every 10 ms
+        for (i = 0; i < npty; i++)
+            if (emu[i].fd >= 0 && ! emu_client(&emu[i])) wait = 0.01;
+
+        // send due responses and streaming data
+        for (i = 0; i < emu_cnt; i++)
+        {
+            emu_sensor *e = &emu[i];
+            int fd = emu_bus ? emu[0].fd : e->fd;
+            bool client = emu_bus ? emu[0].client : e->client;
+
+            if (fd < 0) continue;           // unplugged
+
+            if (e->wmode == MODE_WORK && e->rmode == REPORT_STREAM && t >= e->next) {
+                emu_measure(e, 0);
+                e->next += emu_interval / 1000.0;
+                if (e->next < t) e->next = t + emu_interval / 1000.0;
+            }
+
+            for (j = 0; j < e->q_cnt; )
+            {
+                if (e->queue[j].due <= t) {
+                    // dropped without client
+                    if (client && write(fd, e->queue[j].frame, SDS011_PACKET_LEN) < 0 && emu_verbose && errno != EAGAIN)
+                        printf("write error %s\n", strerror(errno));
+                    memmove(&e->queue[j], &e->queue[j + 1], (--e->q_cnt - j) * sizeof(emu_reply));
+                }
+                else {
+                    if (e->queue[j].due - t < wait) wait = e->queue[j].due - t;
+                    j++;
+                }
+            }
+
+            if (e->wmode == MODE_WORK && e->rmode == REPORT_STREAM && e->next - t < wait)
+                wait = e->next - t;
+        }
+
+        for (i = 0; i < npty; i++) {
+            pfd[i].fd = emu[i].client ? emu[i].fd : -1; // poll() ignores -1
+            pfd[i].events = POLLIN;
+        }
+
+        if (poll(pfd, npty, (int) (wait * 1000) + 1) <= 0) continue;
+
+        for (i = 0; i < npty; i++)
+        {
+            if (! (pfd[i].revents & POLLIN)) continue;
+
+            n = read(emu[i].fd, buf, sizeof(buf));
+            if (n <= 0) continue;
+
+            if (emu_verbose) {
+                printf("%s received %d bytes\n", emu[i].link, n);
+                fflush(stdout);
+            }
+
+            emu_input(&emu[i], buf, n);
+        }
+    }
+
+    for (i = 0; i < npty; i++) {
+        if (emu[i].fd < 0) continue;
+        emu_send_uevent(&emu[i], "remove");
+        unlink(emu[i].link);
+    }
+
+    exit(EXIT_SUCCESS);
+}
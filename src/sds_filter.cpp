@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Report by exception (deadband) filter and swinging door compression of the
+ * readings.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sds_filter.h"
+#include "sds_loop.h"
+#include <math.h>
+
+/*********************************************************************
+ * @brief : set the deadband and clear the last reading
+ *********************************************************************/
+void deadband_init(deadband *d, float abs, float rel, int heartbeat)
+{
+    d->abs = abs;
+    d->rel = rel;
+    d->heartbeat = heartbeat * 1000L;
+    d->init = false;
+    d->in = d->out = d->beats = 0;
+}
+
+/*********************************************************************
+ * @brief : did a value move out of the band around the last one
+ *********************************************************************/
+bool deadband_moved(deadband *d, float last, float val)
+{
+    float band = fabs(last) * d->rel / 100;
+
+    if (d->abs > band) band = d->abs;
+
+    return(fabs(val - last) > band);
+}
+
+/*********************************************************************
+ * @brief : offer a reading
+ *
+ * @return :
+ *  true  : pass the reading on (first, out of the band or heartbeat)
+ *  false : within the band of the last reading passed on
+ *********************************************************************/
+bool deadband_pass(deadband *d, float pm25, float pm10)
+{
+    bool pass;
+
+    d->in++;
+
+    if (! d->init || (d->abs == 0 && d->rel == 0))
+        pass = true;
+    else if (deadband_moved(d, d->pm25, pm25) || deadband_moved(d, d->pm10, pm10))
+        pass = true;
+    else if (d->heartbeat && loop_now() - d->sent >= d->heartbeat) {
+        pass = true;
+        d->beats++;
+    }
+    else
+        pass = false;
+
+    if (pass) {
+        d->init = true;
+        d->pm25 = pm25;
+        d->pm10 = pm10;
+        d->sent = loop_now();
+        d->out++;
+    }
+
+    return(pass);
+}
+
+/*********************************************************************
+ * @brief : percent of the readings that was passed on
+ *********************************************************************/
+double deadband_ratio(deadband *d)
+{
+    return(d->in ? d->out * 100.0 / d->in : 100);
+}
+
+/*********************************************************************
+ * @brief : set the compression deviation and clear the series
+ *********************************************************************/
+void swing_init(swing_door *d, float dev)
+{
+    d->dev = dev;
+    d->init = d->held = false;
+    d->in = d->out = 0;
+}
+
+/*********************************************************************
+ * @brief : open the doors from the archived point to a point
+ *********************************************************************/
+void swing_open(swing_door *d, double t, float v)
+{
+    double dt = t - d->arch.t;
+
+    d->up = (v + d->dev - d->arch.v) / dt;
+    d->lo = (v - d->dev - d->arch.v) / dt;
+}
+
+/*********************************************************************
+ * @brief : archive the point at the time of the last point on the line
+ * in the middle of the doors. The raw point could be further than the
+ * deviation from the points before it, a point between the doors is
+ * within the deviation of all points since the previous archived point.
+ *********************************************************************/
+void swing_archive(swing_door *d, sdt_point *out)
+{
+    d->arch.v = d->arch.v + (d->up + d->lo) / 2 * (d->last.t - d->arch.t);
+    d->arch.t = d->last.t;
+    d->held = false;
+
+    *out = d->arch;
+    d->out++;
+}
+
+/*********************************************************************
+ * @brief : offer the next point of the series
+ *
+ * @return :
+ *  true  : a point was stored in out
+ *  false : no point to archive (yet)
+ *********************************************************************/
+bool swing_add(swing_door *d, double t, float v, sdt_point *out)
+{
+    double up, lo, dt;
+    bool   ret = false;
+
+    d->in++;
+
+    // first point is always kept
+    if (! d->init) {
+        d->init = true;
+        d->held = false;
+        d->arch.t = t;
+        d->arch.v = v;
+        *out = d->arch;
+        d->out++;
+        return(true);
+    }
+
+    // a time that does not increase can not be on a line
+    if (t <= (d->held ? d->last.t : d->arch.t)) return(false);
+
+    if (d->held) {
+        dt = t - d->arch.t;
+        up = (v + d->dev - d->arch.v) / dt;
+        lo = (v - d->dev - d->arch.v) / dt;
+
+        // doors open beyond parallel: archive and start from there
+        if ((up < d->up ? up : d->up) < (lo > d->lo ? lo : d->lo)) {
+            swing_archive(d, out);
+            ret = true;
+        }
+        else {
+            if (up < d->up) d->up = up;
+            if (lo > d->lo) d->lo = lo;
+        }
+    }
+
+    if (! d->held) {
+        swing_open(d, t, v);
+        d->held = true;
+    }
+
+    d->last.t = t;
+    d->last.v = v;
+
+    return(ret);
+}
+
+/*********************************************************************
+ * @brief : end of the series: archive the last point if it is held
+ *
+ * @return : true if a point was stored in out
+ *********************************************************************/
+bool swing_flush(swing_door *d, sdt_point *out)
+{
+    if (! d->held) return(false);
+
+    swing_archive(d, out);
+
+    return(true);
+}
+
+/*********************************************************************
+ * @brief : compression ratio of cnt series
+ *********************************************************************/
+double swing_ratio(swing_door *d, int cnt)
+{
+    unsigned long in = 0, out = 0;
+    int i;
+
+    for (i = 0; i < cnt; i++) {
+        in += d[i].in;
+        out += d[i].out;
+    }
+
+    return(out ? (double) in / out : 1);
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Report by exception: a reading is only passed on when PM2.5 or PM10 moved
+ * more than a deadband from the last reading that was passed on, or when no
+ * reading was passed on for a heartbeat interval.
+ *
+ * Swinging door compression: of a series only the points are kept that are
+ * needed to rebuild it within a compression deviation, by drawing lines
+ * between the kept points (as process historians do).
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SDS_FILTER_H
+#define _SDS_FILTER_H
+
+#include <stdbool.h>
+
+typedef struct deadband
+{
+    float    abs;                // ug/m3 a reading may move (0 = none)
+    float    rel;                // % of the last reading it may move (0 = none)
+    long     heartbeat;          // ms after which a reading is passed anyway (0 = never)
+
+    bool     init;               // a reading was passed on
+    float    pm25, pm10;         // last reading passed on
+    long     sent;               // loop_now() it was passed on
+
+    unsigned long in;            // readings offered
+    unsigned long out;           // readings passed on
+    unsigned long beats;         // passed on by the heartbeat
+} deadband;
+
+/**
+ * @brief : set the deadband and clear the last reading
+ *
+ * @param abs : absolute deadband in ug/m3
+ * @param rel : relative deadband in % of the last reading
+ * @param heartbeat : seconds after which a reading is passed anyway
+ *
+ * The band is the largest of abs and rel. Without both every reading is
+ * passed on.
+ */
+void deadband_init(deadband *d, float abs, float rel, int heartbeat);
+
+/**
+ * @brief : offer a reading
+ *
+ * @return :
+ *  true  : pass the reading on (first, out of the band or heartbeat)
+ *  false : within the band of the last reading passed on
+ */
+bool deadband_pass(deadband *d, float pm25, float pm10);
+
+/**
+ * @brief : percent of the readings that was passed on
+ */
+double deadband_ratio(deadband *d);
+
+typedef struct sdt_point
+{
+    double   t;                  // seconds
+    float    v;                  // value
+} sdt_point;
+
+typedef struct swing_door
+{
+    float    dev;                // compression deviation
+
+    bool     init;               // a point was archived
+    bool     held;               // last point is not archived
+    sdt_point arch;              // last point archived
+    sdt_point last;              // last point offered
+    double   up;                 // lowest slope of the upper door
+    double   lo;                 // highest slope of the lower door
+
+    unsigned long in;            // points offered
+    unsigned long out;           // points archived
+} swing_door;
+
+/**
+ * @brief : set the compression deviation and clear the series
+ */
+void swing_init(swing_door *d, float dev);
+
+/**
+ * @brief : offer the next point of the series (t must increase). The doors
+ * are opened from the last archived point to the point plus and minus the
+ * deviation. When they open beyond parallel, the previous point is archived
+ * (on the line in the middle of the doors, so each point is rebuilt within
+ * the deviation) and the doors start from there. Uses no memory besides the
+ * swing_door.
+ *
+ * @param out : to store the point to archive
+ *
+ * @return :
+ *  true  : a point was stored in out
+ *  false : no point to archive (yet)
+ */
+bool swing_add(swing_door *d, double t, float v, sdt_point *out);
+
+/**
+ * @brief : end of the series (or a write to the archive is due): archive the
+ * last point if it is held
+ *
+ * @return : true if a point was stored in out
+ */
+bool swing_flush(swing_door *d, sdt_point *out);
+
+/**
+ * @brief : compression ratio of cnt series: points offered per point
+ * archived (1 when nothing was offered)
+ */
+double swing_ratio(swing_door *d, int cnt);
+
+#endif /* _SDS_FILTER_H */
@@ -0,0 +1,1307 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Table of sensors that are kept open by the daemon mode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sds.h"
+#include "sds_fleet.h"
+#include "sds_plan.h"
+#include "sds_loop.h"
+#include "sds_trace.h"
+#include <fcntl.h>
+#include <glob.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+
+sensor_t fleet[FLEET_MAX_SENSORS];
+int      fleet_cnt = 0;
+sds011_bus fleet_bus[FLEET_MAX_BUS];
+int      fleet_bus_cnt = 0;
+bool     fleet_debug = false;
+uint8_t  fleet_report_mode = REPORT_STREAM;
+uint8_t  fleet_work_period = 0xff;
+uint16_t fleet_answer_timeout = SDS011_ANSWER_TIMEOUT;
+uint16_t fleet_connect_timeout = SDS011_CONNECT_TIMEOUT;
+char     fleet_state_file[STATE_FILE_LEN] = FLEET_STATE_FILE;
+
+// saved state by port (see fleet_state_find())
+typedef struct saved_state
+{
+    char           name[PORT_LEN + 8];
+    sds011_state_t st;
+    long           rate;         // ms between queries (0 = not calibrated)
+} saved_state;
+
+saved_state saved[FLEET_MAX_SENSORS];
+int  saved_cnt = -1;             // -1 = not read yet
+bool saved_dirty = false;
+
+// laser time by device ID (see fleet_laser())
+typedef struct laser_count
+{
+    uint16_t       devid;
+    double         sec;          // seconds the laser was on
+} laser_count;
+
+laser_count laser[FLEET_MAX_SENSORS];
+int  laser_cnt = 0;
+
+/*********************************************************************
+ * @brief : read state file, a line per port:
+ *  name devid year month day reporting-mode period [rate]
+ * and a line per device ID with the laser time:
+ *  laser devid seconds
+ *********************************************************************/
+void fleet_state_load()
+{
+    unsigned int devid, fw[3], rmode, period;
+    saved_state *p;
+    char line[100];
+    FILE *fp;
+    int  n;
+
+    saved_cnt = 0;
+
+    if (fleet_state_file[0] == 0x0 || (fp = fopen(fleet_state_file, "r")) == NULL) return;
+
+    while (saved_cnt < FLEET_MAX_SENSORS && fgets(line, sizeof(line), fp))
+    {
+        if (strncmp(line, "laser ", 6) == 0) {
+
+            if (laser_cnt < FLEET_MAX_SENSORS &&
+                sscanf(line + 6, "%x %lf", &devid, &laser[laser_cnt].sec) == 2) {
+                laser[laser_cnt++].devid = devid;
+            }
+            continue;
+        }
+
+        p = &saved[saved_cnt];
+
+        p->rate = 0;            // not in files of an older version
+
+        n = sscanf(line, "%27s %x %u %u %u %u %u %ld", p->name, &devid, &fw[0], &fw[1], &fw[2],
+            &rmode, &period, &p->rate);
+
+        if (n < 7) continue;
+
+        p->st.devid = devid;
+        p->st.fw[0] = fw[0];
+        p->st.fw[1] = fw[1];
+        p->st.fw[2] = fw[2];
+        p->st.rmode = rmode;
+        p->st.period = period;
+        saved_cnt++;
+    }
+
+    fclose(fp);
+}
+
+/*********************************************************************
+ * @brief : find the entry of a sensor in the state file
+ *
+ * @return : entry or NULL if none
+ *********************************************************************/
+saved_state *saved_find(const char *name)
+{
+    int i;
+
+    if (saved_cnt < 0) fleet_state_load();
+
+    for (i = 0; i < saved_cnt; i++)
+        if (strcmp(saved[i].name, name) == 0) return(&saved[i]);
+
+    return(NULL);
+}
+
+/*********************************************************************
+ * @brief : find the saved state of a sensor in the state file
+ *
+ * @return : saved state or NULL if none
+ *********************************************************************/
+sds011_state_t *fleet_state_find(const char *name)
+{
+    saved_state *p = saved_find(name);
+
+    return(p ? &p->st : NULL);
+}
+
+/*********************************************************************
+ * @brief : remember the state of a connected sensor for the next start
+ *********************************************************************/
+void fleet_state_put(const char *name, SDS011 *sds)
+{
+    sds011_state_t st;
+    saved_state *p;
+
+    if (fleet_state_file[0] == 0x0) return;
+
+    p = saved_find(name);
+
+    // unknown values are kept from the saved state
+    if (p) st = p->st;
+    else memset(&st, 0x0, sizeof(st));
+
+    if (sds->Get_State(&st) == SDS011_ERROR && p == NULL) return;
+
+    if (p == NULL) {
+
+        if (saved_cnt == FLEET_MAX_SENSORS) return;
+
+        p = &saved[saved_cnt++];
+        strncpy(p->name, name, sizeof(p->name) - 1);
+        p->rate = 0;
+    }
+    else if (p->st.devid == st.devid && memcmp(p->st.fw, st.fw, 3) == 0 &&
+             p->st.rmode == st.rmode && p->st.period == st.period)
+        return;
+
+    // the query rate was calibrated for another sensor
+    else if (p->st.devid != st.devid)
+        p->rate = 0;
+
+    p->st = st;
+    saved_dirty = true;
+}
+
+/*********************************************************************
+ * @brief : get the calibrated query rate of a sensor
+ *
+ * @return : ms between queries (0 = not calibrated)
+ *********************************************************************/
+long fleet_rate_get(const char *name)
+{
+    saved_state *p = saved_find(name);
+
+    return(p ? p->rate : 0);
+}
+
+/*********************************************************************
+ * @brief : remember the calibrated query rate of a sensor
+ *
+ * @return :
+ *  SDS011_ERROR : no saved state of the sensor
+ *  SDS011_OK    : all good
+ *********************************************************************/
+int fleet_rate_put(const char *name, long ms)
+{
+    saved_state *p;
+
+    if (fleet_state_file[0] == 0x0 || (p = saved_find(name)) == NULL)
+        return(SDS011_ERROR);
+
+    if (p->rate != ms) {
+        p->rate = ms;
+        saved_dirty = true;
+    }
+
+    return(SDS011_OK);
+}
+
+/*********************************************************************
+ * @brief : find the laser counter of a device ID
+ *
+ * @param add : add a counter if there is none
+ *
+ * @return : counter or NULL if none (or no room)
+ *********************************************************************/
+laser_count *laser_find(uint16_t devid, bool add)
+{
+    int i;
+
+    if (saved_cnt < 0) fleet_state_load();
+
+    for (i = 0; i < laser_cnt; i++)
+        if (laser[i].devid == devid) return(&laser[i]);
+
+    if (! add || laser_cnt == FLEET_MAX_SENSORS) return(NULL);
+
+    laser[laser_cnt].devid = devid;
+    laser[laser_cnt].sec = 0;
+
+    return(&laser[laser_cnt++]);
+}
+
+/*********************************************************************
+ * @brief : add the laser time since the last call
+ *********************************************************************/
+void fleet_laser(sensor_t *s)
+{
+    laser_count *l;
+    double sec;
+    long now = loop_now();
+
+    // not counted before connected
+    if (s->fd == 0xff || s->conn != FLEET_CONN_NONE) {
+        s->laser_mark = 0;
+        return;
+    }
+
+    if (s->laser_mark) {
+
+        sec = (now - s->laser_mark) / 1000.0 * laser_duty(s->wmode, s->period);
+
+        if (sec > 0 && (l = laser_find(s->sds.Get_DevID(), true)) != NULL) {
+            l->sec += sec;
+            if (fleet_state_file[0] != 0x0) saved_dirty = true;
+        }
+    }
+
+    s->laser_mark = now;
+}
+
+/*********************************************************************
+ * @brief : laser hours counted for a device ID
+ *********************************************************************/
+double fleet_laser_hours(uint16_t devid)
+{
+    laser_count *l = laser_find(devid, false);
+
+    return(l ? l->sec / 3600 : 0);
+}
+
+/*********************************************************************
+ * @brief : write the state file if a state changed
+ *
+ * Written to a new file that replaces the old one, so a crash or power
+ * loss while writing leaves the previous state.
+ *********************************************************************/
+void fleet_state_save()
+{
+    char tmp[sizeof(fleet_state_file) + 4];
+    sds011_state_t *p;
+    FILE *fp;
+    int  i;
+
+    if (! saved_dirty) return;
+
+    snprintf(tmp, sizeof(tmp), "%s.new", fleet_state_file);
+
+    if ((fp = fopen(tmp, "w")) == NULL) return;
+
+    for (i = 0; i < saved_cnt; i++) {
+        p = &saved[i].st;
+        fprintf(fp, "%s %04x %u %u %u %u %u %ld\n", saved[i].name, p->devid,
+            p->fw[0], p->fw[1], p->fw[2], p->rmode, p->period, saved[i].rate);
+    }
+
+    for (i = 0; i < laser_cnt; i++)
+        fprintf(fp, "laser %04x %.0f\n", laser[i].devid, laser[i].sec);
+
+    if (fclose(fp) == 0 && rename(tmp, fleet_state_file) == 0) saved_dirty = false;
+}
+
+/*********************************************************************
+ * @brief : split "port@devid" for a sensor on a multi-drop bus
+ *
+ * @return : device ID (0 = none)
+ *********************************************************************/
+uint16_t port_split(char *port)
+{
+    char *p = strchr(port, '@');
+
+    if (p == NULL) return(0);
+
+    *p++ = 0x0;
+
+    return((uint16_t) strtol(p, NULL, 16));
+}
+
+/*********************************************************************
+ * @brief : add port to sensor table
+ *
+ * @return : pointer to entry or NULL if table is full
+ *********************************************************************/
+sensor_t *fleet_add(char *port)
+{
+    sensor_t *s;
+    char     name[PORT_LEN + 10];
+    uint16_t addr;
+    int      i;
+
+    if (fleet_cnt == FLEET_MAX_SENSORS) return(NULL);
+
+    strncpy(name, port, sizeof(name) - 1);
+    name[sizeof(name) - 1] = 0x0;
+    addr = port_split(name);
+
+    s = &fleet[fleet_cnt];
+    s->bus = NULL;
+
+    // share the bus with the sensors on the same port
+    if (addr) {
+        for (i = 0; i < fleet_cnt; i++) {
+            if (fleet[i].bus && strcmp(fleet[i].port, name) == 0) {
+                s->bus = fleet[i].bus;
+                break;
+            }
+        }
+
+        if (s->bus == NULL) {
+            if (fleet_bus_cnt == FLEET_MAX_BUS) return(NULL);
+            s->bus = &fleet_bus[fleet_bus_cnt++];
+        }
+    }
+
+    fleet_cnt++;
+
+    strncpy(s->port, name, PORT_LEN - 1);
+    s->port[PORT_LEN - 1] = 0x0;
+    s->addr = addr;
+    s->fd = 0xff;
+
+    strcpy(s->name, s->port);
+    if (addr) sprintf(s->name + strlen(s->name), "@%04x", addr);
+
+    s->want.rmode = s->want.wmode = s->want.period = 0xff;
+    s->want.devid = 0;
+    s->unplugged = false;
+    s->next_try = 0;
+    s->fast_try = 0;
+    s->conn = FLEET_CONN_NONE;
+
+    return(s);
+}
+
+/*********************************************************************
+ * @brief : find port in sensor table
+ *
+ * @return : pointer to entry or NULL if not found
+ *********************************************************************/
+sensor_t *fleet_find(char *port)
+{
+    int i;
+
+    for (i = 0; i < fleet_cnt; i++)
+        if (strcmp(fleet[i].port, port) == 0) return(&fleet[i]);
+
+    return(NULL);
+}
+
+/*********************************************************************
+ * @brief : add all ports that match a pattern to the sensor table
+ *
+ * @return : number of ports added
+ *********************************************************************/
+int fleet_add_glob(const char *pattern)
+{
+    glob_t g;
+    size_t i;
+    int    cnt = 0;
+
+    if (glob(pattern, 0, NULL, &g) != 0) return(0);
+
+    for (i = 0; i < g.gl_pathc; i++) {
+        if (fleet_find(g.gl_pathv[i])) continue;
+        if (fleet_add(g.gl_pathv[i]) == NULL) break;
+        cnt++;
+    }
+
+    globfree(&g);
+
+    return(cnt);
+}
+
+/*********************************************************************
+ * @brief : find sensors on all ports in the table at the same time
+ *
+ * @param timeout : max milliseconds to wait
+ *
+ * @return : number of sensors found
+ *********************************************************************/
+int fleet_discover(long timeout)
+{
+    struct pollfd pfd[FLEET_MAX_SENSORS];
+    sensor_t *map[FLEET_MAX_SENSORS];
+    bool woken[FLEET_MAX_SENSORS];
+    sds011_response_t r;
+    sensor_t *s;
+    long now, deadline, next_send, wait;
+    int  i, n, attempt = 0, resend = 0, pending = 0, found = 0, wake = 0;
+
+    deadline = loop_now() + timeout;
+
+    // open all ports, flush once for all (see open_port())
+    for (i = 0; i < fleet_cnt; i++)
+    {
+        s = &fleet[i];
+        s->found = false;
+        s->fd = 0xff;
+        woken[i] = false;
+
+        // a bus can not answer a request to all sensors
+        if (s->bus) continue;
+
+        s->fd = open_port(s->port, false);
+
+        if (s->fd < 0) {
+            s->fd = 0xff;
+            continue;
+        }
+
+        s->sds.EnableDebugging(fleet_debug);
+        s->sds.begin(s->fd, true);
+        pending++;
+    }
+
+    usleep(10000);
+
+    for (i = 0; i < fleet_cnt; i++)
+        if (fleet[i].fd != 0xff) tcflush(fleet[i].fd, TCIOFLUSH);
+
+    next_send = loop_now();
+
+    while (pending && (now = loop_now()) < deadline)
+    {
+        // (re)send to the ports without answer, with backoff + jitter. A
+        // sleeping sensor only answers a wake up (e.g. after a shutdown),
+        // which is only sent to a port that did not answer the request
+        if (now >= next_send) {
+
+            for (i = 0; i < fleet_cnt; i++) {
+                s = &fleet[i];
+                if (s->fd == 0xff || s->found) continue;
+
+                if (resend & 1) s->sds.Send_Command(SDS011_SLEEP, 1, MODE_WORK);
+                else s->sds.Send_Command(SDS011_FWVER, 0, 0);
+            }
+
+            resend++;
+
+            wait = SDS011_RETRY_BASE << attempt;
+
+            if (wait >= SDS011_RETRY_MAX) wait = SDS011_RETRY_MAX;
+            else attempt++;
+
+            next_send = now + wait + rand() % (wait / 2 + 1);
+        }
+
+        for (i = 0, n = 0; i < fleet_cnt; i++) {
+            s = &fleet[i];
+            if (s->fd == 0xff || s->found) continue;
+            pfd[n].fd = s->fd;
+            pfd[n].events = POLLIN;
+            map[n++] = s;
+        }
+
+        wait = (next_send < deadline ? next_send : deadline) - now;
+
+        if (poll(pfd, n, wait) <= 0) continue;
+
+        for (i = 0; i < n; i++)
+        {
+            if (! pfd[i].revents) continue;
+
+            s = map[i];
+
+            while (s->sds.Read_Response(&r) == SDS011_OK)
+            {
+                if (r.cmd_id != SDS011_CONF) continue;
+
+                // woken up: set to sleep again at the end, ask the firmware
+                if (r.confcmd == SDS011_SLEEP) {
+                    woken[s - fleet] = true;
+                    s->sds.Send_Command(SDS011_FWVER, 0, 0);
+                }
+                else if (r.confcmd == SDS011_FWVER) {
+                    s->fw[0] = r.year;
+                    s->fw[1] = r.month;
+                    s->fw[2] = r.day;
+                    s->found = true;
+                    pending--;
+                    found++;
+                    break;
+                }
+            }
+
+            // not a sensor (or gone): stop polling it
+            if (! s->found && (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL))) {
+                fleet_disconnect(s);
+                pending--;
+            }
+        }
+    }
+
+    // only the sensors that were woken up are set to sleep again
+    for (i = 0; i < fleet_cnt; i++) {
+        fleet[i].wmode = woken[i] ? MODE_WORK : MODE_SLEEP;
+        if (woken[i] && fleet[i].fd != 0xff) wake++;
+    }
+
+    if (wake) fleet_sleep_all(fleet_answer_timeout);
+
+    fleet_close_all();
+
+    return(found);
+}
+
+/*********************************************************************
+ * @brief : bring all sensors in the table to their wanted configuration
+ *
+ * @param timeout : max milliseconds to wait
+ *
+ * @return : number of sensors with the wanted configuration
+ *********************************************************************/
+int fleet_reconcile(long timeout)
+{
+    struct pollfd pfd[FLEET_MAX_SENSORS];
+    sensor_t *map[FLEET_MAX_SENSORS];
+    sds011_response_t r;
+    sensor_t *s;
+    long deadline;
+    int  i, n, pending = 0, synced = 0;
+
+    deadline = loop_now() + timeout;
+
+    // open all ports, flush once for all (see open_port())
+    for (i = 0; i < fleet_cnt; i++)
+    {
+        s = &fleet[i];
+        s->synced = false;
+        s->sets = 0;
+
+        if (fleet_open(s, false) == SDS011_ERROR) continue;
+
+        s->sds.EnableDebugging(fleet_debug);
+        s->sds.Set_Timeout(fleet_answer_timeout, fleet_connect_timeout);
+        pending++;
+    }
+
+    usleep(10000);
+
+    for (i = 0; i < fleet_cnt; i++) {
+        if (fleet[i].fd == 0xff) continue;
+        tcflush(fleet[i].fd, TCIOFLUSH);
+        fleet[i].sds.begin(fleet[i].fd, true);
+    }
+
+    while (pending && loop_now() < deadline)
+    {
+        // next step on all sensors that are not there yet
+        for (i = 0, n = 0, pending = 0; i < fleet_cnt; i++)
+        {
+            s = &fleet[i];
+
+            if (s->fd == 0xff || s->synced) continue;
+
+            if (s->sds.Reconcile(&s->want, &s->sets) == 0) {
+                s->synced = true;
+                synced++;
+                continue;
+            }
+
+            pending++;
+            pfd[n].fd = s->fd;
+            pfd[n].events = POLLIN;
+            map[n++] = s;
+        }
+
+        // wake up regularly for answer timeouts (see Queue_Pump())
+        if (pending == 0 || poll(pfd, n, 50) < 0) continue;
+
+        for (i = 0; i < n; i++)
+        {
+            s = map[i];
+
+            if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                fleet_disconnect(s);
+                continue;
+            }
+
+            while (s->sds.Read_Response(&r) == SDS011_OK);
+
+            s->sds.Queue_Pump();
+        }
+    }
+
+    // the configuration could have changed
+    for (i = 0; i < fleet_cnt; i++)
+        if (fleet[i].synced) fleet_state_put(fleet[i].name, &fleet[i].sds);
+
+    fleet_state_save();
+    fleet_close_all();
+
+    return(synced);
+}
+
+/*********************************************************************
+ * @brief : set all connected sensors to sleep at the same time
+ *
+ * @param timeout : max milliseconds to wait
+ *
+ * @return : number of sensors that are asleep
+ *********************************************************************/
+int fleet_sleep_all(long timeout)
+{
+    struct pollfd pfd[FLEET_MAX_SENSORS];
+    sensor_t *map[FLEET_MAX_SENSORS];
+    sds011_response_t r;
+    sensor_t *s;
+    long now, deadline, next_send, wait;
+    int  i, n, attempt = 0, pending = 0, asleep = 0;
+
+    deadline = loop_now() + timeout;
+
+    for (i = 0; i < fleet_cnt; i++) {
+        s = &fleet[i];
+        if (s->fd == 0xff) continue;
+        if (s->wmode == MODE_SLEEP) asleep++;
+        else pending++;
+    }
+
+    next_send = loop_now();
+
+    while (pending && (now = loop_now()) < deadline)
+    {
+        // (re)send to the sensors without answer, with backoff + jitter
+        if (now >= next_send) {
+
+            for (i = 0; i < fleet_cnt; i++) {
+                s = &fleet[i];
+                if (s->fd != 0xff && s->wmode != MODE_SLEEP) s->sds.Send_Command(SDS011_SLEEP, 1, MODE_SLEEP);
+            }
+
+            wait = SDS011_RETRY_BASE << attempt;
+
+            if (wait >= SDS011_RETRY_MAX) wait = SDS011_RETRY_MAX;
+            else attempt++;
+
+            next_send = now + wait + rand() % (wait / 2 + 1);
+        }
+
+        for (i = 0, n = 0; i < fleet_cnt; i++) {
+            s = &fleet[i];
+            if (s->fd == 0xff || s->wmode == MODE_SLEEP) continue;
+            pfd[n].fd = s->fd;
+            pfd[n].events = POLLIN;
+            map[n++] = s;
+        }
+
+        wait = (next_send < deadline ? next_send : deadline) - now;
+
+        if (poll(pfd, n, wait) <= 0) continue;
+
+        // on a bus the answer can be in the inbox of another sensor
+        for (i = 0; i < n; i++)
+        {
+            s = map[i];
+
+            while (s->sds.Read_Response(&r) == SDS011_OK)
+            {
+                if (r.cmd_id == SDS011_CONF && r.confcmd == SDS011_SLEEP && r.mode == MODE_SLEEP) {
+                    fleet_laser(s);
+                    s->wmode = MODE_SLEEP;
+                    pending--;
+                    asleep++;
+                    break;
+                }
+            }
+
+            // gone: stop polling it
+            if (s->wmode != MODE_SLEEP && (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL))) {
+                fleet_disconnect(s);
+                pending--;
+            }
+        }
+    }
+
+    return(asleep);
+}
+
+/*********************************************************************
+ * @brief : open and configure serial port
+ *
+ * There is a problem with flushing buffers on a serial USB that can
+ * not be solved. The only thing one can try is to flush any buffers
+ * after some delay:
+ *
+ * https://bugzilla.kernel.org/show_bug.cgi?id=5730
+ * https://stackoverflow.com/questions/13013387/clearing-the-serial-ports-buffer
+ *
+ * @param flush : if false, keep what was received already
+ *
+ * @return : file descriptor or -1 on error
+ *********************************************************************/
+int open_port(char *port, bool flush)
+{
+    // do not wait on modem lines during open
+    int fd = open(port, O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK);
+
+    if (fd < 0) return(-1);
+
+    // not a (working) serial port
+    if (! isatty(fd)) {
+        close(fd);
+        return(-1);
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    configure_interface(fd, B9600);
+    set_blocking(fd, 0);
+
+    if (! flush) return(fd);
+
+    usleep(10000);                      // required to make flush work
+    tcflush(fd,TCIOFLUSH);
+
+    return(fd);
+}
+
+/*********************************************************************
+ * @brief : open the port of a sensor, or use the port that is open
+ * already for another sensor on the same bus
+ *
+ * @return :
+ *  SDS011_ERROR : could not open (s->fd is 0xff)
+ *  SDS011_OK    : s->fd is set
+ *********************************************************************/
+int fleet_open(sensor_t *s, bool flush)
+{
+    int i;
+
+    s->fd = 0xff;
+
+    // on a bus: use the port that is open already
+    if (s->bus) {
+        for (i = 0; i < fleet_cnt; i++) {
+            if (fleet[i].bus == s->bus && fleet[i].fd != 0xff) {
+                s->fd = fleet[i].fd;
+                break;
+            }
+        }
+
+        if (s->fd == 0xff) s->bus->rx_cnt = 0;
+
+        if (s->sds.Join_Bus(s->bus, s->addr) == SDS011_ERROR) return(SDS011_ERROR);
+    }
+
+    if (s->fd == 0xff) s->fd = open_port(s->port, flush);
+
+    if (s->fd < 0) {
+        s->fd = 0xff;
+        s->sds.Leave_Bus();
+        return(SDS011_ERROR);
+    }
+
+    return(SDS011_OK);
+}
+
+fleet_conn_cb conn_done = NULL;  // see fleet_connect()
+
+void connect_timer(void *arg);
+
+/*********************************************************************
+ * @brief : end of a connect: take the configuration and reset the
+ * statistics when connected, and tell the caller
+ *********************************************************************/
+void connect_end(sensor_t *s, int ret)
+{
+    sds011_state_t st;
+
+    timer_stop(&s->timer);
+    s->conn = FLEET_CONN_NONE;
+
+    if (ret == SDS011_ERROR) {
+        trace_state(TRACE_NOCONNECT, s->fd, s->sds.Get_DevID(), s->conn_tries);
+        conn_done(s, ret);
+        return;
+    }
+
+    s->sds.Get_State(&st);
+    memcpy(s->fw, st.fw, 3);
+    s->rmode = st.rmode;
+    s->period = st.period;
+
+    fleet_state_put(s->name, &s->sds);
+
+    // the query scheduler does not go faster than the sensor keeps up with
+    s->query_min = fleet_rate_get(s->name);
+
+    // reset statistics, unless recovered after a crash for this device
+    if (s->recovered != s->sds.Get_DevID()) {
+        s->count = 0;
+        s->last.tv_sec = s->last.tv_nsec = 0;
+        s->pm25_sum = s->pm10_sum = 0;
+    }
+
+    s->recovered = 0;
+    s->warming = false;
+
+    // count laser time from now
+    s->laser_mark = 0;
+    fleet_laser(s);
+
+    conn_done(s, ret);
+}
+
+/*********************************************************************
+ * @brief : (re)send the firmware request, with backoff + jitter. A
+ * sleeping sensor only answers a wake up (e.g. after a shutdown), which
+ * is sent instead on every other resend.
+ *********************************************************************/
+void connect_send(sensor_t *s)
+{
+    long wait, left = s->conn_deadline - loop_now();
+    int  ret;
+
+    if (left <= 0) {
+        connect_end(s, SDS011_ERROR);
+        return;
+    }
+
+    if (s->conn_tries) trace_state(TRACE_RESEND, s->fd, s->sds.Get_DevID(), s->conn_tries);
+
+    if (s->conn_tries & 1) ret = s->sds.Send_Command(SDS011_SLEEP, 1, MODE_WORK);
+    else ret = s->sds.Send_Command(SDS011_FWVER, 0, 0);
+
+    if (ret == SDS011_ERROR) {
+        connect_end(s, SDS011_ERROR);
+        return;
+    }
+
+    wait = SDS011_RETRY_BASE << (s->conn_tries < 4 ? s->conn_tries : 4);
+    if (wait > SDS011_RETRY_MAX) wait = SDS011_RETRY_MAX;
+    wait += rand() % (wait / 2 + 1);
+
+    if (s->conn_tries < 0xff) s->conn_tries++;
+
+    timer_start(&s->timer, wait < left ? wait : left, connect_timer, s);
+}
+
+/*********************************************************************
+ * @brief : connect without saved state: ask the firmware
+ *********************************************************************/
+void connect_probe(sensor_t *s)
+{
+    s->conn = FLEET_CONN_PROBE;
+    s->conn_tries = 0;
+    s->conn_deadline = loop_now() + fleet_connect_timeout;
+
+    connect_send(s);
+}
+
+/*********************************************************************
+ * @brief : next step to the reporting mode and working period, ends
+ * the connect when the configuration is known and set
+ *********************************************************************/
+void connect_config(sensor_t *s)
+{
+    sds011_conf_t  want;
+    sds011_state_t st;
+
+    want.rmode = fleet_report_mode;
+    want.wmode = 0xff;
+    want.period = fleet_work_period;
+    want.devid = 0;
+
+    if (s->conn == FLEET_CONN_CONFIG) {
+
+        if (s->sds.Reconcile(&want) != 0) return;
+
+        // a working period that is kept is not known yet without saved state
+        s->conn = FLEET_CONN_PERIOD;
+
+        if (s->sds.Get_State(&st) == SDS011_ERROR) {
+            s->sds.Submit(SDS011_PERIOD, 0, 0);
+            return;
+        }
+    }
+
+    if (s->sds.Get_State(&st) == SDS011_OK) connect_end(s, SDS011_OK);
+}
+
+/*********************************************************************
+ * @brief : the sensor answered: set the configuration, within the
+ * connect timeout
+ *********************************************************************/
+void connect_configure(sensor_t *s)
+{
+    s->conn = FLEET_CONN_CONFIG;
+    s->conn_deadline = loop_now() + fleet_connect_timeout;
+
+    timer_start(&s->timer, fleet_connect_timeout, connect_timer, s);
+
+    connect_config(s);
+}
+
+/*********************************************************************
+ * @brief : timer of a connecting sensor expired
+ *********************************************************************/
+void connect_timer(void *arg)
+{
+    sensor_t *s = (sensor_t *) arg;
+
+    switch (s->conn)
+    {
+        case FLEET_CONN_FLUSH:
+            tcflush(s->fd, TCIOFLUSH);
+            connect_probe(s);
+            break;
+
+        // no measurement of the saved device in time
+        case FLEET_CONN_WARM:
+            connect_probe(s);
+            break;
+
+        // no answer yet
+        case FLEET_CONN_PROBE:
+            connect_send(s);
+            break;
+
+        // configuration not done in time
+        case FLEET_CONN_CONFIG:
+        case FLEET_CONN_PERIOD:
+            connect_end(s, SDS011_ERROR);
+            break;
+    }
+}
+
+/*********************************************************************
+ * @brief : open port and start to connect to sensor
+ *
+ * @return :
+ *  SDS011_ERROR : could not open port
+ *  SDS011_OK    : connecting
+ *********************************************************************/
+int fleet_connect(sensor_t *s, fleet_conn_cb done)
+{
+    sds011_state_t *st = fleet_state_find(s->name);
+    long wait;
+
+    // keep a measurement that is received already for a warm start
+    if (fleet_open(s, false) == SDS011_ERROR) return(SDS011_ERROR);
+
+    s->sds.EnableDebugging(fleet_debug);
+    s->sds.Set_Timeout(fleet_answer_timeout, fleet_connect_timeout);
+    s->sds.begin(s->fd, true);
+
+    conn_done = done;
+    s->warm = false;
+    s->wmode = MODE_SLEEP;                // not known to be awake yet
+    s->conn_tries = 0;
+    s->conn_deadline = loop_now() + fleet_connect_timeout;
+
+    // the saved state saves asking the configuration (see sds011 cache). A
+    // streaming measurement can be waiting, else ask for one
+    if (st && st->devid) {
+
+        if (s->sds.Send_Command(SDS011_QDATA, 0, 0) == SDS011_ERROR) {
+            fleet_disconnect(s);
+            return(SDS011_ERROR);
+        }
+
+        // do not lose much time on a different sensor: probe follows
+        wait = fleet_answer_timeout < SDS011_WARM_TIMEOUT ? fleet_answer_timeout : SDS011_WARM_TIMEOUT;
+
+        s->conn = FLEET_CONN_WARM;
+        timer_start(&s->timer, wait, connect_timer, s);
+    }
+
+    // flush a port that was just opened (see open_port()), but not a bus
+    // that other sensors are using already
+    else if (s->bus == NULL || s->bus->cnt == 1) {
+        s->conn = FLEET_CONN_FLUSH;
+        timer_start(&s->timer, 10, connect_timer, s);
+    }
+    else {
+        s->conn = FLEET_CONN_PROBE;
+        timer_start(&s->timer, 0, connect_timer, s);
+    }
+
+    return(SDS011_OK);
+}
+
+/*********************************************************************
+ * @brief : take the next connect step on a response
+ *********************************************************************/
+void fleet_connect_input(sensor_t *s, const sds011_response_t *r)
+{
+    sds011_state_t *st;
+
+    switch (s->conn)
+    {
+        case FLEET_CONN_WARM:
+            if (r->cmd_id != SDS011_DATA) break;
+
+            st = fleet_state_find(s->name);
+
+            // a measurement of another sensor on the port: probe
+            if (st == NULL || s->sds.Warm_Accept(st, r) == SDS011_ERROR) {
+                connect_probe(s);
+                break;
+            }
+
+            s->warm = true;
+            s->wmode = MODE_WORK;
+            connect_configure(s);
+            break;
+
+        case FLEET_CONN_PROBE:
+            if (r->cmd_id != SDS011_CONF) break;
+
+            // it answered, so it is awake
+            s->wmode = MODE_WORK;
+
+            // woken up: ask the firmware now
+            if (r->confcmd == SDS011_SLEEP) {
+                s->conn_tries = 0;
+                connect_send(s);
+            }
+            else if (r->confcmd == SDS011_FWVER) {
+                trace_state(TRACE_CONNECT, s->fd, s->sds.Get_DevID(), s->conn_tries);
+                connect_configure(s);
+            }
+            break;
+
+        case FLEET_CONN_CONFIG:
+        case FLEET_CONN_PERIOD:
+            if (r->cmd_id == SDS011_CONF && r->confcmd == SDS011_SLEEP) s->wmode = r->mode;
+
+            connect_config(s);
+            break;
+    }
+}
+
+/*********************************************************************
+ * @brief : restore and close the port of a sensor
+ *********************************************************************/
+void fleet_disconnect(sensor_t *s)
+{
+    if (s->fd == 0xff) return;
+
+    trace_state(TRACE_CLOSE, s->fd, s->sds.Get_DevID(), 0);
+
+    fleet_laser(s);
+    s->laser_mark = 0;
+
+    s->sds.Leave_Bus();
+    s->conn = FLEET_CONN_NONE;
+
+    // other sensors on the bus still use the port
+    if (s->bus == NULL || s->bus->cnt == 0) {
+        restore_ser(s->fd);
+        close(s->fd);
+    }
+
+    s->fd = 0xff;
+}
+
+/*********************************************************************
+ * @brief : disconnect all sensors in table
+ *********************************************************************/
+void fleet_close_all()
+{
+    int i;
+
+    for (i = 0; i < fleet_cnt; i++) fleet_disconnect(&fleet[i]);
+}
+
+/*********************************************************************
+ * @brief : store new measurement and update statistics
+ *********************************************************************/
+void fleet_update(sensor_t *s, float pm25, float pm10)
+{
+    s->pm25 = pm25;
+    s->pm10 = pm10;
+    s->warming = false;
+    clock_gettime(CLOCK_MONOTONIC, &s->last);
+
+    if (s->count == 0) {
+        s->pm25_min = s->pm25_max = pm25;
+        s->pm10_min = s->pm10_max = pm10;
+    }
+
+    if (pm25 < s->pm25_min) s->pm25_min = pm25;
+    if (pm25 > s->pm25_max) s->pm25_max = pm25;
+    if (pm10 < s->pm10_min) s->pm10_min = pm10;
+    if (pm10 > s->pm10_max) s->pm10_max = pm10;
+
+    s->pm25_sum += pm25;
+    s->pm10_sum += pm10;
+    s->count++;
+}
+
+/*********************************************************************
+ * @brief : store a measurement during warm up
+ *********************************************************************/
+void fleet_warming(sensor_t *s, float pm25, float pm10)
+{
+    s->pm25 = pm25;
+    s->pm10 = pm10;
+    s->warming = true;
+    clock_gettime(CLOCK_MONOTONIC, &s->last);
+}
+
+/*********************************************************************
+ * @brief : seconds since latest measurement (-1 if none)
+ *********************************************************************/
+double fleet_age(sensor_t *s)
+{
+    struct timespec now;
+
+    if (s->last.tv_sec == 0 && s->last.tv_nsec == 0) return(-1);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return((now.tv_sec - s->last.tv_sec) + (now.tv_nsec - s->last.tv_nsec) / 1e9);
+}
+
+/*********************************************************************
+ * @brief : write the latest reading and statistics of each sensor
+ * (async-signal-safe)
+ *********************************************************************/
+void fleet_crash_write(int fd)
+{
+    struct timespec mono, rt;
+    fleet_read_head h;
+    fleet_reading r;
+    sensor_t *s;
+    int i;
+
+    memset(&h, 0x0, sizeof(h));
+    memcpy(h.magic, FLEET_READ_MAGIC, sizeof(FLEET_READ_MAGIC));
+    h.cnt = fleet_cnt;
+
+    if (write(fd, &h, sizeof(h)) != sizeof(h)) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &rt);
+
+    for (i = 0; i < fleet_cnt; i++)
+    {
+        s = &fleet[i];
+
+        memset(&r, 0x0, sizeof(r));
+        memcpy(r.name, s->name, sizeof(r.name));
+        r.devid = s->fd == 0xff && s->recovered ? s->recovered : s->sds.Get_DevID();
+        r.pm25 = s->pm25;
+        r.pm10 = s->pm10;
+
+        // the wall clock of the reading, the monotonic clock restarts on a boot
+        if (s->last.tv_sec || s->last.tv_nsec)
+            r.epoch_ns = (rt.tv_sec - mono.tv_sec + s->last.tv_sec) * 1000000000LL +
+                rt.tv_nsec - mono.tv_nsec + s->last.tv_nsec;
+
+        r.count = s->count;
+        r.errors = s->errors;
+        r.pm25_min = s->pm25_min;
+        r.pm25_max = s->pm25_max;
+        r.pm10_min = s->pm10_min;
+        r.pm10_max = s->pm10_max;
+        r.pm25_sum = s->pm25_sum;
+        r.pm10_sum = s->pm10_sum;
+
+        if (write(fd, &r, sizeof(r)) != sizeof(r)) return;
+    }
+}
+
+/*********************************************************************
+ * @brief : restore a reading of the flight recorder in a sensor
+ *********************************************************************/
+void fleet_restore(sensor_t *s, fleet_reading *r)
+{
+    struct timespec mono, rt;
+    int64_t ns;
+
+    s->pm25 = r->pm25;
+    s->pm10 = r->pm10;
+    s->count = r->count;
+    s->errors = r->errors;
+    s->pm25_min = r->pm25_min;
+    s->pm25_max = r->pm25_max;
+    s->pm10_min = r->pm10_min;
+    s->pm10_max = r->pm10_max;
+    s->pm25_sum = r->pm25_sum;
+    s->pm10_sum = r->pm10_sum;
+    s->recovered = r->devid;
+
+    if (r->epoch_ns == 0) return;
+
+    // back to the monotonic clock (not before its start)
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &rt);
+
+    ns = mono.tv_sec * 1000000000LL + mono.tv_nsec -
+        (rt.tv_sec * 1000000000LL + rt.tv_nsec - r->epoch_ns);
+
+    if (ns <= 0) ns = 1;
+
+    s->last.tv_sec = ns / 1000000000LL;
+    s->last.tv_nsec = ns % 1000000000LL;
+}
+
+/*********************************************************************
+ * @brief : after a crash restore the latest readings and statistics
+ *
+ * @return : number of sensors recovered (-1 : no crash)
+ *********************************************************************/
+int fleet_recover()
+{
+    trace_head h;
+    fleet_read_head rh;
+    fleet_reading r;
+    char  tm[20];
+    time_t at;
+    int   fd, i, j, cnt = 0;
+
+    if (trace_file[0] == 0x0 || (fd = open(trace_file, O_RDWR)) < 0) return(-1);
+
+    if (read(fd, &h, sizeof(h)) != sizeof(h) || memcmp(h.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        h.crash == 0) {
+        close(fd);
+        return(-1);
+    }
+
+    // the readings follow the events
+    if (lseek(fd, sizeof(h) + h.size * sizeof(trace_event), SEEK_SET) < 0 ||
+        read(fd, &rh, sizeof(rh)) != sizeof(rh) || memcmp(rh.magic, FLEET_READ_MAGIC, sizeof(FLEET_READ_MAGIC)) != 0)
+        rh.cnt = 0;
+
+    for (i = 0; i < (int) rh.cnt && read(fd, &r, sizeof(r)) == sizeof(r); i++)
+    {
+        r.name[sizeof(r.name) - 1] = 0x0;
+
+        for (j = 0; j < fleet_cnt; j++) {
+            if (fleet[j].fd == 0xff && strcmp(fleet[j].name, r.name) == 0) {
+                fleet_restore(&fleet[j], &r);
+                if (r.epoch_ns) cnt++;
+                break;
+            }
+        }
+    }
+
+    at = h.epoch_ns / 1000000000LL;
+    strftime(tm, sizeof(tm), "%Y-%m-%d %H:%M:%S", localtime(&at));
+
+    p_printf(YELLOW, (char *) "Recovered readings of %d sensor(s) after crash on signal %d at %s\n",
+        cnt, h.crash, tm);
+
+    // only once
+    h.crash = 0;
+    if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+        p_printf(RED, (char *) "could not mark %s as recovered\n", trace_file);
+
+    close(fd);
+
+    return(cnt);
+}
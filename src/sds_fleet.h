@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Table of sensors that are kept open by the daemon mode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SDS_FLEET_H
+#define _SDS_FLEET_H
+
+#include "sds011_lib.h"
+#include "sds_loop.h"
+#include "sds_warm.h"
+#include <time.h>
+
+#define FLEET_MAX_SENSORS 256    // max sensors in table
+#define FLEET_MAX_BUS     16     // max multi-drop buses
+#define PORT_LEN          20     // max length of port name
+#define FLEET_RECONCILE   10000  // max ms to reconcile configuration
+#define FLEET_STATE_FILE  "/var/lib/sds011.state" // default state file
+#define STATE_FILE_LEN    100    // max length of state file name
+
+// connect states (see fleet_connect())
+#define FLEET_CONN_NONE   0      // not connecting (closed or connected)
+#define FLEET_CONN_FLUSH  1      // port opened, flush after a short wait
+#define FLEET_CONN_WARM   2      // waiting on a measurement of the saved device
+#define FLEET_CONN_PROBE  3      // asking the firmware, or waking up
+#define FLEET_CONN_CONFIG 4      // setting the reporting mode and period
+#define FLEET_CONN_PERIOD 5      // asking the working period
+
+typedef struct sensor
+{
+    char        port[PORT_LEN];  // device port (e.g. /dev/ttyUSB0)
+    char        name[PORT_LEN + 8]; // port or port@devid on a bus
+    int         fd;              // file descriptor (0xff = not open)
+    SDS011      sds;             // library instance for this sensor
+    uint16_t    addr;            // device ID on a bus (0 = not on a bus)
+    sds011_bus *bus;             // bus shared with other sensors (or NULL)
+
+    // connection management
+    bool        found;           // answered during discovery
+    bool        warm;            // connected with saved state
+    bool        unplugged;       // removed (hotplug): do not reconnect
+    long        next_try;        // loop_now() of next connect attempt
+    uint8_t     fast_try;        // remaining fast attempts after plug in
+    uint8_t     conn;            // connect state (FLEET_CONN_NONE = not connecting)
+    uint8_t     conn_tries;      // requests sent without answer during connect
+    long        conn_deadline;   // loop_now() to give up the connect
+
+    // wanted configuration (see fleet_reconcile())
+    sds011_conf_t want;          // wanted values (0xff / 0 = keep)
+    bool        synced;          // has the wanted configuration
+    uint32_t    sets;            // values that were changed
+
+    // query scheduler (see sds_sched.h)
+    uint8_t     query;           // state
+    long        query_due;       // loop_now() the next query is due
+    long        query_sent;      // loop_now() the query was sent
+    long        query_min;       // ms between queries it keeps up with (0 = unknown)
+    long        query_adapt;     // ms between queries when adaptive (0 = interval)
+
+    // snapshots (see sds_sched.h)
+    uint32_t    snap_wait;       // snapshot the query was sent in (0 = none)
+    uint32_t    snap_id;         // snapshot of the latest measurement (0 = none)
+    long long   snap_rx;         // snap_us() the answer was received
+
+    // duty cycle (see sds_sched.h)
+    uint8_t     duty;            // state
+    uint8_t     duty_tries;      // sends of current command
+    time_t      duty_due;        // time the next sample is due
+    uint32_t    duty_missed;     // samples not taken in time
+    uint32_t    duty_early;      // samples taken when stable before due
+    warm_mon    warmup;          // readings during warm up
+    loop_timer  timer;           // timer of the sensor (also during connect)
+
+    // configuration as read during connect
+    uint8_t     fw[3];           // firmware year, month, day
+    uint8_t     rmode;           // reporting mode
+    uint8_t     wmode;           // sleep / work mode
+    uint8_t     period;          // working period
+
+    // latest measurement
+    float       pm25;            // PM2.5 value
+    float       pm10;            // PM10 value
+    struct timespec last;        // CLOCK_MONOTONIC of latest measurement
+    bool        warming;         // latest measurement is during warm up
+
+    // laser time (see fleet_laser())
+    long        laser_mark;      // loop_now() counted till (0 = not counting)
+
+    // statistics since connect
+    uint16_t    recovered;       // devid of statistics recovered after a crash (0 = none)
+    uint32_t    count;           // measurements received
+    uint32_t    errors;          // lost connections
+    float       pm25_min, pm25_max;
+    float       pm10_min, pm10_max;
+    double      pm25_sum, pm10_sum;
+} sensor_t;
+
+// latest reading and statistics of a sensor, kept with the flight recorder
+// to recover after a crash (see fleet_crash_write())
+#define FLEET_READ_MAGIC "SDSRDG1"
+
+typedef struct fleet_reading
+{
+    char        name[PORT_LEN + 8];
+    uint16_t    devid;
+    float       pm25, pm10;
+    int64_t     epoch_ns;        // CLOCK_REALTIME of the reading (0 = none)
+    uint32_t    count;
+    uint32_t    errors;
+    float       pm25_min, pm25_max;
+    float       pm10_min, pm10_max;
+    double      pm25_sum, pm10_sum;
+} fleet_reading;
+
+typedef struct fleet_read_head
+{
+    char        magic[8];
+    uint32_t    cnt;             // fleet_reading that follow
+    uint32_t    spare;
+} fleet_read_head;
+
+extern sensor_t fleet[FLEET_MAX_SENSORS];
+extern int      fleet_cnt;
+extern bool     fleet_debug;     // enable library debug on connect
+extern uint8_t  fleet_report_mode;      // reporting mode set on connect
+extern uint8_t  fleet_work_period;      // working period set on connect (0xff = keep)
+extern uint16_t fleet_answer_timeout;   // see SDS011::Set_Timeout()
+extern uint16_t fleet_connect_timeout;
+extern char     fleet_state_file[STATE_FILE_LEN]; // saved state ("" = none)
+
+/**
+ * @brief : split "port@devid" (e.g. /dev/ttyUSB0@0x1001) for a sensor
+ * on a multi-drop bus
+ *
+ * @param port : port with optional @devid, the @devid is removed
+ *
+ * @return : device ID (0 = none)
+ */
+uint16_t port_split(char *port);
+
+/**
+ * @brief : find the saved state of a sensor in the state file, to
+ * connect without probing (see SDS011::Warm_Start())
+ *
+ * @param name : port or port@devid
+ *
+ * @return : saved state or NULL if none
+ */
+sds011_state_t *fleet_state_find(const char *name);
+
+/**
+ * @brief : remember the state of a connected sensor (from its cache)
+ * for the next start. Values that are not known in the cache are kept
+ * from the saved state. Written with fleet_state_save().
+ *
+ * @param name : port or port@devid
+ */
+void fleet_state_put(const char *name, SDS011 *sds);
+
+/**
+ * @brief : get the calibrated query rate of a sensor (see sds -c)
+ *
+ * @param name : port or port@devid
+ *
+ * @return : shortest ms between queries the sensor keeps up with
+ *  (0 = not calibrated)
+ */
+long fleet_rate_get(const char *name);
+
+/**
+ * @brief : remember the calibrated query rate of a sensor, its state
+ * must have been saved with fleet_state_put(). Written with
+ * fleet_state_save().
+ *
+ * @param name : port or port@devid
+ * @param ms : shortest ms between queries the sensor keeps up with
+ *
+ * @return :
+ *  SDS011_ERROR : no saved state of the sensor
+ *  SDS011_OK    : all good
+ */
+int fleet_rate_put(const char *name, long ms);
+
+/**
+ * @brief : add the laser time since the last call to the counter of the
+ * device ID of a connected sensor, from its working mode and period (see
+ * laser_duty()). Called on connect, before a change of the working mode
+ * and on disconnect. Call regularly to save the counters with
+ * fleet_state_save().
+ */
+void fleet_laser(sensor_t *s);
+
+/**
+ * @brief : laser hours counted for a device ID, in the state file over
+ * all runs (only while the daemon was connected to the sensor)
+ */
+double fleet_laser_hours(uint16_t devid);
+
+/**
+ * @brief : write the state file if a state changed
+ */
+void fleet_state_save();
+
+/**
+ * @brief : add port to sensor table
+ *
+ * @param port : port, or port@devid for a sensor on a multi-drop bus.
+ *  The sensors with the same port share the bus.
+ *
+ * @return : pointer to entry or NULL if table (or bus table) is full
+ */
+sensor_t *fleet_add(char *port);
+
+/**
+ * @brief : find port in sensor table
+ *
+ * @return : pointer to entry or NULL if not found
+ */
+sensor_t *fleet_find(char *port);
+
+/**
+ * @brief : add all ports that match a pattern to the sensor table
+ *
+ * @param pattern : e.g. /dev/ttyUSB* (see glob())
+ *
+ * @return : number of ports added
+ */
+int fleet_add_glob(const char *pattern);
+
+/**
+ * @brief : find sensors on all ports in the table at the same time
+ *
+ * The firmware request is sent to all ports at once and resent with
+ * backoff to the ports that did not answer yet, until all answered or
+ * the timeout has passed. The resends take turns with a wake up, as a
+ * sleeping sensor does not answer anything else. The sensors that were
+ * woken up are set to sleep again and the ports are closed afterwards.
+ * Sensors that answered have found set, with fw[] and the device ID.
+ *
+ * @param timeout : max milliseconds to wait
+ *
+ * @return : number of sensors found
+ */
+int fleet_discover(long timeout);
+
+/**
+ * @brief : bring all sensors in the table to their wanted configuration
+ * (want) at the same time
+ *
+ * For each sensor only the values that are not known are queried and
+ * only the values that differ are set, one command at a time per sensor
+ * but for all sensors in parallel (see SDS011::Reconcile()). The ports
+ * are closed again afterwards. Sensors that have the wanted configuration
+ * have synced set, and sets holds the number of values changed.
+ *
+ * @param timeout : max milliseconds to wait
+ *
+ * @return : number of sensors with the wanted configuration
+ */
+int fleet_reconcile(long timeout);
+
+/**
+ * @brief : set all connected sensors to sleep at the same time, e.g. to
+ * save laser hours on shutdown
+ *
+ * The sleep command is sent to all sensors at once and resent with
+ * backoff to the ones that did not answer yet, until all are asleep or
+ * the timeout has passed. The ports stay open. Sensors that are known to
+ * sleep already (wmode) are not sent to.
+ *
+ * @param timeout : max milliseconds to wait
+ *
+ * @return : number of sensors that are asleep
+ */
+int fleet_sleep_all(long timeout);
+
+/**
+ * @brief : open and configure serial port for an SDS011 and flush
+ * anything that was received before
+ *
+ * @param flush : if false, keep what was received already, e.g. a
+ *  streaming measurement that can be used right away
+ *
+ * @return : file descriptor or -1 on error
+ */
+int open_port(char *port, bool flush = true);
+
+/**
+ * @brief : open the port of a sensor, or use the port that is open
+ * already for another sensor on the same bus
+ *
+ * @param flush : see open_port()
+ *
+ * @return :
+ *  SDS011_ERROR : could not open (s->fd is 0xff)
+ *  SDS011_OK    : s->fd is set
+ */
+int fleet_open(sensor_t *s, bool flush = true);
+
+/**
+ * @brief : called when a connect has finished (see fleet_connect())
+ *
+ * @param ret : SDS011_OK when connected, SDS011_ERROR when not (the
+ *  port is still open, close it with fleet_disconnect())
+ */
+typedef void (*fleet_conn_cb)(sensor_t *s, int ret);
+
+/**
+ * @brief : open port and start to connect to sensor, read configuration
+ * and set reporting mode to fleet_report_mode (default streaming) and the
+ * working period to fleet_work_period (if set)
+ *
+ * Does not wait on the sensor: the caller watches the port in its event
+ * loop and hands the responses to fleet_connect_input() while s->conn is
+ * not FLEET_CONN_NONE. The resends and the deadline run on s->timer, so
+ * a port that does not answer holds up nothing else.
+ *
+ * @param done : called when connected, or when not within
+ *  fleet_connect_timeout
+ *
+ * @return :
+ *  SDS011_ERROR : could not open port (done is not called)
+ *  SDS011_OK    : connecting
+ */
+int fleet_connect(sensor_t *s, fleet_conn_cb done);
+
+/**
+ * @brief : take the next connect step on a response of a sensor that
+ * is connecting (see fleet_connect())
+ */
+void fleet_connect_input(sensor_t *s, const sds011_response_t *r);
+
+/**
+ * @brief : restore and close the port of a sensor (on a bus: after the
+ * last sensor on the bus disconnected)
+ */
+void fleet_disconnect(sensor_t *s);
+
+/**
+ * @brief : disconnect all sensors in table
+ */
+void fleet_close_all();
+
+/**
+ * @brief : store new measurement and update statistics
+ */
+void fleet_update(sensor_t *s, float pm25, float pm10);
+
+/**
+ * @brief : store a measurement during warm up, not in the statistics
+ */
+void fleet_warming(sensor_t *s, float pm25, float pm10);
+
+/**
+ * @brief : seconds since latest measurement (-1 if none)
+ */
+double fleet_age(sensor_t *s);
+
+/**
+ * @brief : write the latest reading and statistics of each sensor (added
+ * to the flight recorder with trace_add()). Only uses async-signal-safe
+ * calls, to be written on a crash.
+ */
+void fleet_crash_write(int fd);
+
+/**
+ * @brief : after a crash restore the latest readings and statistics of
+ * the sensors from the flight recorder (trace_file). They are kept on the
+ * next connect when it is the same device. The recorder is marked as
+ * recovered, so this is only done once.
+ *
+ * @return : number of sensors recovered (-1 : no crash)
+ */
+int fleet_recover();
+
+#endif /* _SDS_FLEET_H */
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Hotplug: listen on the kernel uevent netlink socket for serial USB
+ * ports of an SDS-011 (CH341) being plugged in or removed.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sds_hotplug.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+
+int  hotplug_fd = -1;
+char hotplug_sim[108] = "";      // path of simulation socket
+
+/*********************************************************************
+ * @brief : open the socket to receive uevents on
+ *
+ * @param sim : NULL for the kernel netlink socket, else path of a Unix
+ *  datagram socket to create.
+ *
+ * @return : socket or -1 on error
+ *********************************************************************/
+int hotplug_open(char *sim)
+{
+    struct sockaddr_nl nl;
+    struct sockaddr_un un;
+
+    if (sim) {
+        hotplug_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (hotplug_fd < 0) return(-1);
+
+        memset(&un, 0x0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strncpy(un.sun_path, sim, sizeof(un.sun_path) - 1);
+        strncpy(hotplug_sim, sim, sizeof(hotplug_sim) - 1);
+        unlink(sim);
+
+        if (bind(hotplug_fd, (struct sockaddr *) &un, sizeof(un)) < 0) {
+            hotplug_close();
+            return(-1);
+        }
+
+        return(hotplug_fd);
+    }
+
+    hotplug_fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (hotplug_fd < 0) return(-1);
+
+    memset(&nl, 0x0, sizeof(nl));
+    nl.nl_family = AF_NETLINK;
+    nl.nl_pid = 0;               // let kernel assign
+    nl.nl_groups = 1;            // kernel events (udev uses group 2)
+
+    if (bind(hotplug_fd, (struct sockaddr *) &nl, sizeof(nl)) < 0) {
+        hotplug_close();
+        return(-1);
+    }
+
+    return(hotplug_fd);
+}
+
+/*********************************************************************
+ * @brief : close the socket (and remove a simulation socket)
+ *********************************************************************/
+void hotplug_close()
+{
+    if (hotplug_fd < 0) return;
+
+    close(hotplug_fd);
+    hotplug_fd = -1;
+
+    if (hotplug_sim[0]) unlink(hotplug_sim);
+    hotplug_sim[0] = 0x0;
+}
+
+/*********************************************************************
+ * @brief : read hexadecimal value from a sysfs file
+ *
+ * @return : value or -1 on error
+ *********************************************************************/
+long read_sysfs_hex(char *path)
+{
+    char  buf[10];
+    FILE  *f = fopen(path, "r");
+
+    if (f == NULL) return(-1);
+
+    if (fgets(buf, sizeof(buf), f) == NULL) {
+        fclose(f);
+        return(-1);
+    }
+
+    fclose(f);
+
+    return(strtol(buf, NULL, 16));
+}
+
+/*********************************************************************
+ * @brief : check in sysfs that a tty belongs to a CH341
+ *
+ * /sys/class/tty/ttyUSBn/device is the port of the usb-serial driver,
+ * 2 levels up is the USB device with the VID and PID.
+ *
+ * @param name : name of the tty (e.g. ttyUSB0)
+ *********************************************************************/
+bool check_sysfs_id(char *name)
+{
+    char path[100];
+
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device/../../idVendor", name);
+    if (read_sysfs_hex(path) != HOTPLUG_VID) return(false);
+
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device/../../idProduct", name);
+    return(read_sysfs_hex(path) == HOTPLUG_PID);
+}
+
+/*********************************************************************
+ * @brief : parse a uevent message
+ *
+ * @return :
+ *  SDS011_ERROR : not a relevant event
+ *  SDS011_OK    : ev is set
+ *********************************************************************/
+int hotplug_parse(char *buf, int len, hotplug_event *ev)
+{
+    char    *p, *action = NULL, *subsystem = NULL, *devname = NULL, *product = NULL;
+    int     off;
+    unsigned vid, pid;
+
+    // messages from udev (libudev header) are not used
+    if (len < 1 || strncmp(buf, "libudev", 7) == 0) return(SDS011_ERROR);
+
+    buf[len - 1] = 0x0;          // make sure the last string ends
+
+    // skip "action@devpath" header
+    for (off = strlen(buf) + 1; off < len; off += strlen(p) + 1)
+    {
+        p = buf + off;
+
+        if (strncmp(p, "ACTION=", 7) == 0) action = p + 7;
+        else if (strncmp(p, "SUBSYSTEM=", 10) == 0) subsystem = p + 10;
+        else if (strncmp(p, "DEVNAME=", 8) == 0) devname = p + 8;
+        else if (strncmp(p, "PRODUCT=", 8) == 0) product = p + 8;
+    }
+
+    if (action == NULL || subsystem == NULL || devname == NULL) return(SDS011_ERROR);
+
+    if (strcmp(subsystem, "tty") != 0) return(SDS011_ERROR);
+
+    if (strcmp(action, "add") == 0) ev->add = true;
+    else if (strcmp(action, "remove") == 0) ev->add = false;
+    else return(SDS011_ERROR);
+
+    // DEVNAME is relative to /dev (a simulated event can give a full path)
+    if (devname[0] == '/')
+        snprintf(ev->port, PORT_LEN, "%s", devname);
+    else
+        snprintf(ev->port, PORT_LEN, "/dev/%s", devname);
+
+    if (! ev->add) return(SDS011_OK);
+
+    // check the device is a CH341
+    if (product) {
+        if (sscanf(product, "%x/%x", &vid, &pid) != 2) return(SDS011_ERROR);
+        if (vid != HOTPLUG_VID || pid != HOTPLUG_PID) return(SDS011_ERROR);
+        return(SDS011_OK);
+    }
+
+    if (devname[0] == '/' || ! check_sysfs_id(devname)) return(SDS011_ERROR);
+
+    return(SDS011_OK);
+}
+
+/*********************************************************************
+ * @brief : read and parse a uevent from the socket
+ *
+ * @return :
+ *  SDS011_ERROR : not a relevant event
+ *  SDS011_OK    : ev is set
+ *********************************************************************/
+int hotplug_read(int fd, hotplug_event *ev)
+{
+    struct sockaddr_nl src;
+    socklen_t slen = sizeof(src);
+    char buf[4096];
+    int  len;
+
+    memset(&src, 0x0, sizeof(src));
+
+    len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &src, &slen);
+    if (len <= 0) return(SDS011_ERROR);
+
+    // on netlink only accept messages from the kernel
+    if (src.nl_family == AF_NETLINK && src.nl_pid != 0) return(SDS011_ERROR);
+
+    return(hotplug_parse(buf, len, ev));
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Hotplug: listen on the kernel uevent netlink socket for serial USB
+ * ports of an SDS-011 (CH341) being plugged in or removed.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SDS_HOTPLUG_H
+#define _SDS_HOTPLUG_H
+
+#include "sds_fleet.h"
+
+// USB VID / PID of the CH341 serial chip on the SDS-011
+#define HOTPLUG_VID   0x1a86
+#define HOTPLUG_PID   0x7523
+
+#define HOTPLUG_FAST      250    // ms between connect attempts after plug in
+#define HOTPLUG_FAST_CNT  8      // number of fast attempts
+
+typedef struct hotplug_event
+{
+    bool    add;                 // true = add, false = remove
+    char    port[PORT_LEN];      // device port (e.g. /dev/ttyUSB0)
+} hotplug_event;
+
+/**
+ * @brief : open the socket to receive uevents on
+ *
+ * @param sim : NULL for the kernel netlink socket, else path of a Unix
+ *  datagram socket to create. Uevents in the same format can be sent to
+ *  that, to simulate plug in / removal (see emu -U).
+ *
+ * @return : socket or -1 on error
+ */
+int hotplug_open(char *sim);
+
+/**
+ * @brief : close the socket (and remove a simulation socket)
+ */
+void hotplug_close();
+
+/**
+ * @brief : parse a uevent message
+ *
+ * An add event is only accepted for a tty of the CH341 (checked with
+ * PRODUCT in the event or in sysfs). A remove event is accepted for any
+ * tty, the caller checks whether the port is known.
+ *
+ * @param buf : received message (action@devpath, followed by KEY=value
+ *  strings, all zero terminated)
+ * @param len : length of message
+ * @param ev : to store the result
+ *
+ * @return :
+ *  SDS011_ERROR : not a relevant event
+ *  SDS011_OK    : ev is set
+ */
+int hotplug_parse(char *buf, int len, hotplug_event *ev);
+
+/**
+ * @brief : read and parse a uevent from the socket
+ *
+ * @return :
+ *  SDS011_ERROR : not a relevant event
+ *  SDS011_OK    : ev is set
+ */
+int hotplug_read(int fd, hotplug_event *ev);
+
+#endif /* _SDS_HOTPLUG_H */
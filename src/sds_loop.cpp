@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Single threaded event loop used by the daemon mode.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sds_loop.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+typedef struct loop_entry
+{
+    loop_cb  cb;             // callback
+    void    *arg;            // argument for callback
+} loop_entry;
+
+struct pollfd loop_fds[LOOP_MAX_FD];
+loop_entry    loop_ent[LOOP_MAX_FD];
+int           loop_cnt = 0;
+
+loop_timer    *wheel[WHEEL_LEVELS][WHEEL_SLOTS];  // timers per slot
+int           wheel_cnt[WHEEL_LEVELS];          // timers per level
+long          wheel_now = 0;                    // next tick to handle
+int           timer_cnt = 0;                    // active timers
+
+volatile sig_atomic_t loop_signal = 0;          // latest signal caught
+int           sig_pipe[2] = {-1, -1};           // self-pipe of the handler
+
+/*********************************************************************
+ * @brief : put timer in the slot of the wheel for its due time
+ *
+ * Level 0 has a slot for each of the next WHEEL_SLOTS ticks, a slot of
+ * level x holds the timers of WHEEL_SLOTS^x ticks, that are moved to a
+ * lower level when the level below wraps around (cascade).
+ *********************************************************************/
+void wheel_add(loop_timer *t)
+{
+    long delta = t->due - wheel_now;
+    long tick = t->due;
+    int  level = 0, slot;
+
+    if (delta < 0)
+        tick = wheel_now;             // late: on the next tick
+    else {
+        while (level < WHEEL_LEVELS - 1 && (delta >> (WHEEL_BITS * (level + 1))))
+            level++;
+
+        // beyond the wheel: in the last slot, to cascade again
+        if (delta >> (WHEEL_BITS * WHEEL_LEVELS))
+            tick = wheel_now + (1L << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+
+    slot = (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    t->level = level;
+    t->next = wheel[level][slot];
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = &wheel[level][slot];
+    wheel[level][slot] = t;
+    wheel_cnt[level]++;
+}
+
+/*********************************************************************
+ * @brief : take timer out of the wheel
+ *********************************************************************/
+void wheel_del(loop_timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    wheel_cnt[t->level]--;
+}
+
+/*********************************************************************
+ * @brief : move the timers of a slot to the lower levels
+ *********************************************************************/
+void wheel_cascade(int level, int slot)
+{
+    loop_timer *t = wheel[level][slot], *next;
+
+    wheel[level][slot] = NULL;
+
+    for ( ; t != NULL; t = next) {
+        next = t->next;
+        wheel_cnt[level]--;
+        wheel_add(t);
+    }
+}
+
+/*********************************************************************
+ * @brief : handle tick wheel_now: cascade and call the callbacks
+ *
+ * A callback can start and stop timers, also ones in this slot, so the
+ * slot is taken from the start again after each callback.
+ *********************************************************************/
+void wheel_tick()
+{
+    loop_timer *t;
+    int level = 0;
+
+    // higher levels first when lower ones wrap around
+    while (level < WHEEL_LEVELS - 1 && ((wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK) == 0) {
+        level++;
+        wheel_cascade(level, (wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    }
+
+    while ((t = wheel[0][wheel_now & WHEEL_MASK]) != NULL) {
+        timer_stop(t);
+        t->cb(t->arg);
+    }
+}
+
+/*********************************************************************
+ * @brief : start (or restart) a one-shot timer
+ *
+ * @return :
+ *  0  : started
+ *********************************************************************/
+int timer_start(loop_timer *t, long ms, timer_cb cb, void *arg)
+{
+    long now = loop_now();
+
+    // wheel not used for a while: no need to catch up
+    if (timer_cnt == 0 && wheel_now < now) wheel_now = now;
+
+    timer_stop(t);
+
+    t->due = now + ms;
+    t->cb = cb;
+    t->arg = arg;
+    t->active = true;
+    timer_cnt++;
+
+    wheel_add(t);
+
+    return(0);
+}
+
+/*********************************************************************
+ * @brief : stop timer (if active)
+ *********************************************************************/
+void timer_stop(loop_timer *t)
+{
+    if (! t->active) return;
+
+    wheel_del(t);
+    t->active = false;
+    timer_cnt--;
+}
+
+/*********************************************************************
+ * @brief : number of active timers
+ *********************************************************************/
+int timer_count()
+{
+    return(timer_cnt);
+}
+
+/*********************************************************************
+ * @brief : milliseconds until the first timer expires
+ *
+ * On each level the first slot with timers is looked up. A timer on
+ * level 0 expires on the tick of its slot, the timers in a slot of a
+ * higher level expire after the tick the slot cascades on: waking up
+ * then is early enough, without walking the timers of the slot.
+ *
+ * @param timeout : max to return (-1 is endless)
+ *********************************************************************/
+int timer_wait(int timeout)
+{
+    long now = loop_now(), first = 0, tick;
+    bool found = false;
+    int  level, i, pos, shift;
+
+    if (timer_cnt == 0) return(timeout);
+
+    for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+        if (wheel_cnt[level] == 0) continue;
+
+        // the current slot of a higher level holds the next round, unless
+        // wheel_now is the tick it still has to cascade on
+        shift = WHEEL_BITS * level;
+        pos = level > 0 && (wheel_now & ((1L << shift) - 1)) ? 1 : 0;
+
+        for (i = pos; i < WHEEL_SLOTS + pos; i++)
+            if (wheel[level][((wheel_now >> shift) + i) & WHEEL_MASK] != NULL) break;
+
+        tick = ((wheel_now >> shift) + i) << shift;
+
+        if (! found || tick < first) first = tick;
+        found = true;
+    }
+
+    if (first <= now) return(0);
+
+    if (timeout < 0 || first - now < timeout) timeout = first - now;
+
+    return(timeout);
+}
+
+/*********************************************************************
+ * @brief : call the callbacks of the expired timers
+ *
+ * Each tick since the last call is handled, but a stretch without timers
+ * on level 0 is skipped up to the next cascade.
+ *********************************************************************/
+void timer_expire()
+{
+    long now = loop_now(), next;
+
+    while (wheel_now <= now)
+    {
+        if (timer_cnt == 0) {
+            wheel_now = now + 1;
+            break;
+        }
+
+        if (wheel_cnt[0] == 0 && (wheel_now & WHEEL_MASK)) {
+            next = (wheel_now | WHEEL_MASK) + 1;
+            wheel_now = next <= now ? next : now + 1;
+            continue;
+        }
+
+        wheel_tick();
+        wheel_now++;
+    }
+}
+
+/*********************************************************************
+ * @brief : add file descriptor to monitor for input
+ *
+ * @return :
+ *  0  : added (or callback updated when fd was already added)
+ *  -1 : no room
+ *********************************************************************/
+int loop_add(int fd, loop_cb cb, void *arg)
+{
+    int i;
+
+    for (i = 0; i < loop_cnt; i++)
+        if (loop_fds[i].fd == fd) break;
+
+    if (i == loop_cnt) {
+        if (loop_cnt == LOOP_MAX_FD) return(-1);
+        loop_cnt++;
+    }
+
+    loop_fds[i].fd = fd;
+    loop_fds[i].events = POLLIN;
+    loop_fds[i].revents = 0;
+    loop_ent[i].cb = cb;
+    loop_ent[i].arg = arg;
+
+    return(0);
+}
+
+/*********************************************************************
+ * @brief : stop monitoring file descriptor
+ *
+ * The entry is only marked here, as this can be called from a callback
+ * while loop_once() is walking the list. It is removed after dispatch.
+ *********************************************************************/
+void loop_del(int fd)
+{
+    int i;
+
+    for (i = 0; i < loop_cnt; i++) {
+        if (loop_fds[i].fd == fd) {
+            loop_fds[i].fd = -1;       // poll() ignores negative fd
+            loop_fds[i].revents = 0;
+        }
+    }
+}
+
+/*********************************************************************
+ * @brief : wait for events and call the callbacks
+ *
+ * @param timeout : max milliseconds to wait (-1 is endless)
+ *
+ * @return number of events handled or -1 on error
+ *********************************************************************/
+int loop_once(int timeout)
+{
+    int i, j, ret, cnt = loop_cnt;
+
+    ret = poll(loop_fds, cnt, timer_wait(timeout));
+
+    if (ret < 0) return(errno == EINTR ? 0 : -1);
+
+    for (i = 0; i < cnt; i++) {
+        if (loop_fds[i].fd >= 0 && loop_fds[i].revents)
+            loop_ent[i].cb(loop_fds[i].fd, loop_fds[i].revents, loop_ent[i].arg);
+    }
+
+    // remove deleted entries
+    for (i = 0, j = 0; i < loop_cnt; i++) {
+        if (loop_fds[i].fd < 0) continue;
+        loop_fds[j] = loop_fds[i];
+        loop_ent[j++] = loop_ent[i];
+    }
+
+    loop_cnt = j;
+
+    timer_expire();
+
+    return(ret);
+}
+
+/*********************************************************************
+ * @brief : monotonic time in milliseconds
+ *********************************************************************/
+long loop_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return(ts.tv_sec * 1000L + ts.tv_nsec / 1000000L);
+}
+
+/*********************************************************************
+ * @brief : start a periodic timer
+ *
+ * @return :
+ *  0  : started
+ *  -1 : error
+ *********************************************************************/
+int tick_start(loop_tick *t, long ms, bool align)
+{
+    struct itimerspec its;
+    struct timespec now;
+    long long next;
+    int flags = 0;
+
+    t->ticks = t->missed = 0;
+    t->period = ms;
+
+    // wall clock for alignment, else not affected by setting the clock
+    t->fd = timerfd_create(align ? CLOCK_REALTIME : CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (t->fd < 0) return(-1);
+
+    its.it_interval.tv_sec = ms / 1000;
+    its.it_interval.tv_nsec = (ms % 1000) * 1000000L;
+
+    if (align) {
+        // next multiple of the period since the epoch
+        clock_gettime(CLOCK_REALTIME, &now);
+        next = ((now.tv_sec * 1000LL + now.tv_nsec / 1000000L) / ms + 1) * ms;
+        its.it_value.tv_sec = next / 1000;
+        its.it_value.tv_nsec = (next % 1000) * 1000000L;
+        flags = TFD_TIMER_ABSTIME;
+    }
+    else
+        its.it_value = its.it_interval;
+
+    if (timerfd_settime(t->fd, flags, &its, NULL) < 0) {
+        tick_stop(t);
+        return(-1);
+    }
+
+    return(0);
+}
+
+/*********************************************************************
+ * @brief : signal handler: only what is async-signal-safe
+ *********************************************************************/
+void sig_handler(int sig)
+{
+    int  err = errno;
+    char c = sig;
+    ssize_t r;
+
+    loop_signal = sig;
+
+    // fails only when full: a wake up is waiting already
+    r = write(sig_pipe[1], &c, 1);
+    (void) r;
+
+    errno = err;
+}
+
+/*********************************************************************
+ * @brief : empty the self-pipe, the caller checks loop_signal
+ *********************************************************************/
+void sig_read(int fd, short revents, void *arg)
+{
+    char buf[16];
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+/*********************************************************************
+ * @brief : catch signals on a self-pipe
+ *
+ * @return :
+ *  0  : all good
+ *  -1 : error
+ *********************************************************************/
+int loop_signals(const int *sigs, int cnt)
+{
+    struct sigaction act;
+    int i;
+
+    if (sig_pipe[0] < 0 && pipe2(sig_pipe, O_NONBLOCK | O_CLOEXEC) < 0) return(-1);
+
+    memset(&act, 0x0, sizeof(act));
+    act.sa_handler = &sig_handler;
+    sigemptyset(&act.sa_mask);
+
+    // no SA_RESTART: a blocking wait returns, to check loop_signal
+    for (i = 0; i < cnt; i++)
+        if (sigaction(sigs[i], &act, NULL) < 0) return(-1);
+
+    return(loop_add(sig_pipe[0], sig_read, NULL));
+}
+
+/*********************************************************************
+ * @brief : wait on the next tick
+ *
+ * @return : number of missed ticks or -1 on error (or signal)
+ *********************************************************************/
+int tick_wait(loop_tick *t)
+{
+    uint64_t exp;
+
+    // the kernel counts the expiries since the last read
+    while (read(t->fd, &exp, sizeof(exp)) != sizeof(exp))
+        if (errno != EINTR || loop_signal) return(-1);
+
+    t->ticks += exp;
+    t->missed += exp - 1;
+
+    return((int) (exp - 1));
+}
+
+/*********************************************************************
+ * @brief : stop periodic timer
+ *********************************************************************/
+void tick_stop(loop_tick *t)
+{
+    if (t->fd < 0) return;
+
+    close(t->fd);
+    t->fd = -1;
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Single threaded event loop used by the daemon mode. Sensors, sockets
+ * and timers register a file descriptor with a callback.
+ *
+ * The timers are kept in a hashed hierarchical timing wheel: start and
+ * stop take constant time, however many sensors have a timer running.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SDS_LOOP_H
+#define _SDS_LOOP_H
+
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LOOP_MAX_FD     300      // max file descriptors to monitor
+
+// timing wheel: WHEEL_LEVELS levels of WHEEL_SLOTS slots of 1 ms,
+// 5 x 6 bits covers 2^30 ms (12 days), later timers wait in the last level
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS    5
+
+/**
+ * @brief : callback on event
+ *
+ * @param fd : file descriptor with event
+ * @param revents : poll() events (POLLIN, POLLHUP, POLLERR..)
+ * @param arg : argument provided on loop_add()
+ */
+typedef void (*loop_cb)(int fd, short revents, void *arg);
+
+/**
+ * @brief : callback on timer expiry
+ *
+ * @param arg : argument provided on timer_start()
+ */
+typedef void (*timer_cb)(void *arg);
+
+typedef struct loop_timer
+{
+    long      due;               // loop_now() to expire
+    timer_cb  cb;                // callback
+    void      *arg;              // argument for callback
+    bool      active;            // timer is running
+    uint8_t   level;             // level of the wheel it is in
+    struct loop_timer *next;     // next in slot of the wheel
+    struct loop_timer **pprev;   // link that points to this timer
+} loop_timer;
+
+/**
+ * @brief : start (or restart) a one-shot timer, called from loop_once()
+ *
+ * @param t : timer (a zeroed timer is not active)
+ * @param ms : milliseconds from now
+ * @param cb : callback on expiry
+ * @param arg : argument for callback
+ *
+ * @return :
+ *  0  : started
+ */
+int timer_start(loop_timer *t, long ms, timer_cb cb, void *arg);
+
+/**
+ * @brief : stop timer (if active)
+ */
+void timer_stop(loop_timer *t);
+
+/**
+ * @brief : number of active timers
+ */
+int timer_count();
+
+/**
+ * @brief : add file descriptor to monitor for input
+ *
+ * @return :
+ *  0  : added (or callback updated when fd was already added)
+ *  -1 : no room
+ */
+int loop_add(int fd, loop_cb cb, void *arg);
+
+/**
+ * @brief : stop monitoring file descriptor (can be called from callback)
+ */
+void loop_del(int fd);
+
+/**
+ * @brief : wait for events and call the callbacks, including the timers
+ * that expired
+ *
+ * @param timeout : max milliseconds to wait (-1 is endless). The wait is
+ *  shorter when a timer expires earlier.
+ *
+ * @return number of events handled or -1 on error
+ */
+int loop_once(int timeout);
+
+/**
+ * @brief : monotonic time in milliseconds, to plan events on
+ */
+long loop_now();
+
+extern volatile sig_atomic_t loop_signal; // latest signal caught (0 = none)
+
+/**
+ * @brief : catch signals on a self-pipe. The handler only sets
+ * loop_signal and writes to a pipe that is monitored by the loop, so
+ * loop_once() returns at once and the program can stop from its own
+ * context. Blocking waits (e.g. tick_wait()) return as well.
+ *
+ * @param sigs : signals to catch
+ * @param cnt : number of signals
+ *
+ * @return :
+ *  0  : all good
+ *  -1 : error
+ */
+int loop_signals(const int *sigs, int cnt);
+
+typedef struct loop_tick
+{
+    int       fd;                // timerfd (-1 = not started)
+    long      period;            // ms between ticks
+    uint64_t  ticks;             // ticks passed
+    uint64_t  missed;            // ticks passed while busy
+} loop_tick;
+
+/**
+ * @brief : start a periodic timer. The ticks are planned by the kernel on
+ * absolute times, so the time spent on handling a tick does not add up
+ * and the period does not drift.
+ *
+ * @param t : periodic timer
+ * @param ms : milliseconds between ticks
+ * @param align :
+ *  true  : ticks on wall clock multiples of the period (e.g. on :00, :05
+ *          with 5 seconds), the first tick is on the next multiple
+ *  false : first tick is one period from now
+ *
+ * @return :
+ *  0  : started
+ *  -1 : error
+ */
+int tick_start(loop_tick *t, long ms, bool align);
+
+/**
+ * @brief : wait on the next tick
+ *
+ * @return : number of ticks that passed without a wait on them (missed
+ *  deadlines, because handling took longer than the period) or -1 on error
+ *  or when a signal was caught (see loop_signals())
+ */
+int tick_wait(loop_tick *t);
+
+/**
+ * @brief : stop periodic timer
+ */
+void tick_stop(loop_tick *t);
+
+#endif /* _SDS_LOOP_H */
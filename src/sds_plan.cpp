@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Laser life: part of the time the laser is on and a planner of the
+ * working period or duty cycle that uses the fewest laser hours.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sds_plan.h"
+#include "sds011_lib.h"
+#include "sds_sched.h"
+
+/*********************************************************************
+ * @brief : part of the time the laser is on
+ *********************************************************************/
+double laser_duty(uint8_t wmode, uint8_t period)
+{
+    if (wmode == MODE_SLEEP) return(0);
+
+    if (period == 0) return(1);
+
+    return(PLAN_PERIOD_WORK / (period * 60.0));
+}
+
+/*********************************************************************
+ * @brief : find the way to sample with the fewest laser hours
+ *
+ * With the same laser time the working period is preferred, as the
+ * sensor then does it by itself.
+ *********************************************************************/
+void plan_laser(int interval, int warmup, laser_plan *p)
+{
+    double duty;
+    int period;
+
+    // always possible: the sensor measures every second
+    p->type = PLAN_CONTINUOUS;
+    p->period = 0;
+    p->interval = 1;
+    p->duty = 1;
+
+    // the sensor wakes up by itself each period
+    if (interval >= 60) {
+
+        period = interval / 60;
+        if (period > 30) period = 30;
+
+        duty = laser_duty(MODE_WORK, period);
+
+        if (duty < p->duty) {
+            p->type = PLAN_PERIOD;
+            p->period = period;
+            p->interval = period * 60;
+            p->duty = duty;
+        }
+    }
+
+    // the daemon wakes up the sensor for the warm up and the sample
+    if (interval >= warmup + DUTY_SLACK) {
+
+        duty = (double) (warmup + PLAN_SAMPLE) / interval;
+
+        if (duty < p->duty) {
+            p->type = PLAN_DUTY;
+            p->period = 0;
+            p->interval = interval;
+            p->duty = duty;
+        }
+    }
+}
+
+/*********************************************************************
+ * @brief : description of the plan
+ *********************************************************************/
+const char *plan_name(laser_plan *p)
+{
+    switch(p->type)
+    {
+        case PLAN_PERIOD: return("working period");
+        case PLAN_DUTY:   return("duty cycle");
+        default:          return("continuous");
+    }
+}
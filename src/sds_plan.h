@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Laser life: the laser of the SDS-011 has a limited life (about 8000
+ * hours). How fast it is used depends on the working mode and period,
+ * or on the duty cycle of the daemon. The planner picks the way to get
+ * the wanted samples with the fewest laser hours.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SDS_PLAN_H
+#define _SDS_PLAN_H
+
+#include <stdint.h>
+
+#define PLAN_PERIOD_WORK 30      // seconds a sensor works each working period
+#define PLAN_SAMPLE      1       // seconds laser on after warm up for a sample
+#define PLAN_HOURS_YEAR  8760    // hours in a year
+
+// ways to take samples
+#define PLAN_CONTINUOUS  0       // working all the time
+#define PLAN_PERIOD      1       // working period of the sensor (-P)
+#define PLAN_DUTY        2       // duty cycle of the daemon (-Y)
+
+typedef struct laser_plan
+{
+    uint8_t  type;               // PLAN_CONTINUOUS, PLAN_PERIOD or PLAN_DUTY
+    uint8_t  period;             // working period in minutes (PLAN_PERIOD)
+    int      interval;           // seconds between samples
+    double   duty;               // part of the time the laser is on
+} laser_plan;
+
+/**
+ * @brief : part of the time the laser is on
+ *
+ * @param wmode : MODE_SLEEP or MODE_WORK
+ * @param period : working period in minutes (0 = continuous), the sensor
+ *  then works PLAN_PERIOD_WORK seconds each period
+ *
+ * @return : 0 (off) to 1 (on all the time)
+ */
+double laser_duty(uint8_t wmode, uint8_t period);
+
+/**
+ * @brief : find the way to take a sample at least every interval seconds
+ * with the fewest laser hours: the working period of the sensor (the
+ * interval in whole minutes, max 30), a duty cycle of the daemon (needs
+ * the warm up plus DUTY_SLACK) or working continuously.
+ *
+ * @param interval : max seconds between samples (data resolution)
+ * @param warmup : max seconds of warm up after wake up (see -W)
+ * @param p : to store the plan
+ */
+void plan_laser(int interval, int warmup, laser_plan *p);
+
+/**
+ * @brief : name of the way samples are taken in the plan
+ */
+const char *plan_name(laser_plan *p);
+
+#endif /* _SDS_PLAN_H */
@@ -0,0 +1,545 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Schedulers in the event loop of the daemon: duty cycle and query.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sds.h"
+#include "sds_sched.h"
+#include "sds_trace.h"
+#include <string.h>
+
+int duty_period = 0;
+int duty_warmup = DUTY_WARMUP_DEF;
+
+long query_interval = 0;
+int  adapt_max = 0;
+int  query_flight = QUERY_FLIGHT_DEF;
+query_stats qstats;
+
+int  snap_interval = 0;
+snap_stats sstats;
+loop_timer snap_timer;                       // next snapshot
+loop_timer snap_wdog;                        // answers of the snapshot
+
+int  in_flight = 0;                          // queries in flight
+sensor_t *waiting[FLEET_MAX_SENSORS];        // FIFO of due queries
+int  wait_head = 0, wait_cnt = 0;
+
+void duty_timer(void *arg);
+void query_timer(void *arg);
+void snap_take(void *arg);
+
+/*********************************************************************
+ * @brief : name of duty cycle state
+ *********************************************************************/
+const char *duty_name(uint8_t state)
+{
+    switch(state)
+    {
+        case DUTY_TO_SLEEP: return("to-sleep");
+        case DUTY_SLEEP:    return("sleep");
+        case DUTY_TO_WORK:  return("to-work");
+        case DUTY_WARMING:  return("warming");
+        case DUTY_SAMPLE:   return("sample");
+        default:            return("off");
+    }
+}
+
+/*********************************************************************
+ * @brief : change the duty cycle state (kept in the flight recorder)
+ *********************************************************************/
+void duty_enter(sensor_t *s, uint8_t state)
+{
+    if (s->duty != state) trace_state(TRACE_DUTY, s->fd, s->sds.Get_DevID(), state);
+
+    s->duty = state;
+}
+
+/*********************************************************************
+ * @brief : send sleep or work command and wait on answer
+ *
+ * @param mode : MODE_SLEEP or MODE_WORK
+ *********************************************************************/
+void duty_send(sensor_t *s, uint8_t mode)
+{
+    duty_enter(s, mode == MODE_SLEEP ? DUTY_TO_SLEEP : DUTY_TO_WORK);
+    s->duty_tries++;
+
+    s->sds.Submit(SDS011_SLEEP, 1, mode);
+
+    timer_start(&s->timer, DUTY_ANSWER, duty_timer, s);
+}
+
+/*********************************************************************
+ * @brief : plan wake up for the next sample that still allows the
+ * full warm up
+ *********************************************************************/
+void duty_plan(sensor_t *s)
+{
+    time_t now = time(NULL);
+
+    s->duty_due = ((now + duty_warmup) / duty_period + 1) * duty_period;
+    duty_enter(s, DUTY_SLEEP);
+    s->duty_tries = 0;
+
+    timer_start(&s->timer, (s->duty_due - duty_warmup - now) * 1000L, duty_timer, s);
+}
+
+/*********************************************************************
+ * @brief : timer of sensor expired
+ *********************************************************************/
+void duty_timer(void *arg)
+{
+    sensor_t *s = (sensor_t *) arg;
+
+    switch(s->duty)
+    {
+        case DUTY_SLEEP:            // time to wake up
+            duty_send(s, MODE_WORK);
+            break;
+
+        case DUTY_TO_SLEEP:         // no answer
+        case DUTY_TO_WORK:
+            if (s->duty_tries < DUTY_TRIES) {
+                duty_send(s, s->duty == DUTY_TO_SLEEP ? MODE_SLEEP : MODE_WORK);
+                break;
+            }
+
+            p_printf(RED, (char *) "%s did not answer on %s\n", s->name,
+                s->duty == DUTY_TO_SLEEP ? "sleep" : "wake up");
+
+            if (s->duty == DUTY_TO_WORK) s->duty_missed++;
+
+            duty_plan(s);           // try again next cycle
+            break;
+
+        case DUTY_WARMING:          // take the next measurement
+            duty_enter(s, DUTY_SAMPLE);
+            timer_start(&s->timer, DUTY_ANSWER * DUTY_TRIES, duty_timer, s);
+            break;
+
+        case DUTY_SAMPLE:           // no measurement
+            s->duty_missed++;
+            s->duty_tries = 0;
+            duty_send(s, MODE_SLEEP);
+            break;
+    }
+}
+
+/*********************************************************************
+ * @brief : start the duty cycle on a connected sensor
+ *********************************************************************/
+void duty_start(sensor_t *s)
+{
+    if (duty_period == 0) return;
+
+    s->duty_tries = 0;
+    duty_send(s, MODE_SLEEP);
+}
+
+/*********************************************************************
+ * @brief : stop the duty cycle
+ *********************************************************************/
+void duty_stop(sensor_t *s)
+{
+    timer_stop(&s->timer);
+    duty_enter(s, DUTY_OFF);
+}
+
+/*********************************************************************
+ * @brief : handle response from a sensor
+ *
+ * @return :
+ *  true  : measurement is a sample to use
+ *  false : response was handled (or measurement during warm up)
+ *********************************************************************/
+bool duty_response(sensor_t *s, sds011_response_t *r)
+{
+    int warm;
+
+    if (r->cmd_id == SDS011_CONF && r->confcmd == SDS011_SLEEP) {
+
+        // laser time till now was in the previous mode
+        fleet_laser(s);
+        s->wmode = r->mode;
+
+        if (s->duty == DUTY_TO_SLEEP && r->mode == MODE_SLEEP) {
+            duty_plan(s);
+        }
+        else if (s->duty == DUTY_TO_WORK && r->mode == MODE_WORK) {
+            duty_enter(s, DUTY_WARMING);
+            s->duty_tries = 0;
+            warm_start(&s->warmup, duty_warmup);
+            timer_start(&s->timer, (s->duty_due - time(NULL)) * 1000L, duty_timer, s);
+        }
+
+        return(false);
+    }
+
+    if (r->cmd_id != SDS011_DATA) return(false);
+
+    if (s->duty == DUTY_OFF) return(true);
+
+    // the sample is taken as soon as the readings are stable
+    if (s->duty == DUTY_WARMING) {
+        warm = warm_check(&s->warmup, r->pm25, r->pm10);
+        if (warm == WARM_BUSY) return(false);
+
+        // at the max warm up it is taken as when due, not early
+        if (warm == WARM_READY) s->duty_early++;
+    }
+    else if (s->duty != DUTY_SAMPLE)
+        return(false);
+
+    else if (time(NULL) > s->duty_due + DUTY_SLACK) s->duty_missed++;
+
+    // got sample: laser off until next
+    s->duty_tries = 0;
+    duty_send(s, MODE_SLEEP);
+
+    return(true);
+}
+
+/*********************************************************************
+ * @brief : ms between queries of a sensor: the interval, unless the
+ * sensor is calibrated to keep up with less (see sds -c)
+ *********************************************************************/
+long query_period(sensor_t *s)
+{
+    long ms = s->query_adapt ? s->query_adapt : query_interval;
+
+    return(s->query_min > ms ? s->query_min : ms);
+}
+
+/*********************************************************************
+ * @brief : adapt the interval to how fast the readings change
+ *********************************************************************/
+void adapt_sample(sensor_t *s)
+{
+    float v;
+    long  ms;
+    int   period, max;
+
+    if (adapt_max == 0 || (v = s->sds.Get_Variation()) < 0) return;
+
+    if (query_interval) {
+
+        ms = s->query_adapt ? s->query_adapt : query_interval;
+
+        if (v > ADAPT_HIGH) ms = query_interval;
+        else if (v < ADAPT_LOW) ms = (long) (ms * ADAPT_GROW);
+
+        if (ms < query_interval) ms = query_interval;
+        if (ms > adapt_max * 1000L) ms = adapt_max * 1000L;
+
+        s->query_adapt = ms;
+        return;
+    }
+
+    // streaming: the sensor samples once each working period
+    max = adapt_max / 60 < 30 ? adapt_max / 60 : 30;
+    period = s->period;
+
+    if (v > ADAPT_HIGH) period = 0;
+    else if (v < ADAPT_LOW) period = period ? period * 2 : 1;
+
+    if (period > max) period = max;
+
+    if (period == s->period) return;
+
+    // laser time till now was with the previous period
+    fleet_laser(s);
+    s->period = period;
+    s->sds.Submit(SDS011_PERIOD, 1, period);
+}
+
+/*********************************************************************
+ * @brief : send query to sensor and wait on answer
+ *********************************************************************/
+void query_send(sensor_t *s)
+{
+    long delay, now = loop_now();
+
+    // the first query after a connect is late when the loop was blocked
+    // connecting other sensors: not a delay of the scheduler
+    if (s->query_sent) {
+        delay = now - s->query_due;
+        qstats.delay_sum += delay;
+        qstats.delays++;
+        if (delay > qstats.delay_max) qstats.delay_max = delay;
+    }
+
+    s->query = QUERY_BUSY;
+    s->query_sent = now;
+
+    if (++in_flight > qstats.max_flight) qstats.max_flight = in_flight;
+
+    s->sds.Submit(SDS011_QDATA, 0, 0, SDS011_PRIO_HIGH);
+
+    timer_start(&s->timer, fleet_answer_timeout, query_timer, s);
+}
+
+/*********************************************************************
+ * @brief : query of sensor done: plan next and send a waiting query
+ *********************************************************************/
+void query_done(sensor_t *s)
+{
+    sensor_t *w;
+    long now = loop_now();
+
+    in_flight--;
+
+    // next due in the same phase, skip the ones that were missed
+    do {
+        s->query_due += query_period(s);
+    } while (s->query_due <= now);
+
+    s->query = QUERY_IDLE;
+    timer_start(&s->timer, s->query_due - now, query_timer, s);
+
+    while (wait_cnt && in_flight < query_flight)
+    {
+        w = waiting[wait_head];
+        wait_head = (wait_head + 1) % FLEET_MAX_SENSORS;
+        wait_cnt--;
+
+        if (w->query == QUERY_WAIT) query_send(w);
+    }
+}
+
+/*********************************************************************
+ * @brief : timer of sensor expired
+ *********************************************************************/
+void query_timer(void *arg)
+{
+    sensor_t *s = (sensor_t *) arg;
+
+    switch(s->query)
+    {
+        case QUERY_IDLE:            // query is due
+            if (in_flight < query_flight) {
+                query_send(s);
+            }
+            else if (wait_cnt < FLEET_MAX_SENSORS) {
+                s->query = QUERY_WAIT;
+                waiting[(wait_head + wait_cnt++) % FLEET_MAX_SENSORS] = s;
+            }
+            break;
+
+        case QUERY_BUSY:            // no answer
+            qstats.timeouts++;
+            query_done(s);
+            break;
+    }
+}
+
+/*********************************************************************
+ * @brief : start querying a connected sensor
+ *********************************************************************/
+void query_start(sensor_t *s)
+{
+    long now = loop_now(), offset;
+
+    if (query_interval == 0) return;
+
+    s->query_adapt = 0;
+
+    // phase within the interval from position in table
+    offset = (long) (s - fleet) * query_interval / fleet_cnt;
+
+    s->query_due = now - now % query_interval + offset;
+    if (s->query_due <= now) s->query_due += query_period(s);
+
+    s->query = QUERY_IDLE;
+    s->query_sent = 0;
+    timer_start(&s->timer, s->query_due - now, query_timer, s);
+}
+
+/*********************************************************************
+ * @brief : stop querying
+ *********************************************************************/
+void query_stop(sensor_t *s)
+{
+    timer_stop(&s->timer);
+
+    if (s->query == QUERY_BUSY) in_flight--;
+
+    // a waiting entry is skipped when its turn comes
+    s->query = QUERY_OFF;
+}
+
+/*********************************************************************
+ * @brief : handle response from a sensor
+ *
+ * @return :
+ *  true  : measurement is an answer on a query
+ *  false : response was not an answer on a query
+ *********************************************************************/
+bool query_response(sensor_t *s, sds011_response_t *r)
+{
+    long lat;
+
+    if (r->cmd_id != SDS011_DATA || s->query != QUERY_BUSY) return(false);
+
+    lat = loop_now() - s->query_sent;
+
+    if (qstats.count == 0 || lat < qstats.lat_min) qstats.lat_min = lat;
+    if (lat > qstats.lat_max) qstats.lat_max = lat;
+    qstats.lat_sum += lat;
+    qstats.lat_sq += (double) lat * lat;
+    qstats.count++;
+
+    // the next query is planned on the adapted interval
+    adapt_sample(s);
+
+    timer_stop(&s->timer);
+    query_done(s);
+
+    return(true);
+}
+
+/*********************************************************************
+ * @brief : monotonic time in microseconds
+ *********************************************************************/
+long long snap_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return(ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+/*********************************************************************
+ * @brief : plan the next snapshot on a multiple of the interval
+ *********************************************************************/
+void snap_plan()
+{
+    struct timespec now;
+    long long ms, period = snap_interval * 1000LL;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000L;
+
+    timer_start(&snap_timer, period - ms % period, snap_take, NULL);
+}
+
+/*********************************************************************
+ * @brief : all answers are in, or the time to wait passed
+ *********************************************************************/
+void snap_close(void *arg)
+{
+    long long spread;
+    int i;
+
+    timer_stop(&snap_wdog);
+
+    for (i = 0; i < fleet_cnt; i++) fleet[i].snap_wait = 0;
+
+    if (sstats.sent == 0) return;
+
+    if (sstats.answered < sstats.sent) sstats.incomplete++;
+
+    if (sstats.answered) {
+        spread = sstats.last - sstats.first;
+        sstats.spread_sum += spread;
+        if (spread > sstats.spread_max) sstats.spread_max = spread;
+    }
+
+    sstats.count++;
+}
+
+/*********************************************************************
+ * @brief : send a data query to all connected sensors at once
+ *********************************************************************/
+void snap_take(void *arg)
+{
+    sensor_t *s;
+    int i;
+
+    // answers of the previous one are late by now
+    if (sstats.id && snap_wdog.active) snap_close(NULL);
+
+    sstats.id++;
+    sstats.time = time(NULL);
+    sstats.sent = sstats.answered = 0;
+    sstats.t_sent = snap_us();
+
+    for (i = 0; i < fleet_cnt; i++)
+    {
+        s = &fleet[i];
+
+        // through the queue: waits for a pending answer (e.g. on a bus)
+        if (s->fd == 0xff || s->conn != FLEET_CONN_NONE || s->sds.Submit(SDS011_QDATA, 0, 0, SDS011_PRIO_HIGH) == SDS011_ERROR) continue;
+
+        s->snap_wait = sstats.id;
+        sstats.sent++;
+    }
+
+    sstats.send = snap_us() - sstats.t_sent;
+
+    timer_start(&snap_wdog, SNAP_TIMEOUT, snap_close, NULL);
+    snap_plan();
+}
+
+/*********************************************************************
+ * @brief : start taking snapshots of the fleet
+ *********************************************************************/
+void snap_start()
+{
+    if (snap_interval == 0) return;
+
+    memset(&sstats, 0x0, sizeof(sstats));
+    snap_plan();
+}
+
+/*********************************************************************
+ * @brief : stop taking snapshots
+ *********************************************************************/
+void snap_stop()
+{
+    timer_stop(&snap_timer);
+    timer_stop(&snap_wdog);
+}
+
+/*********************************************************************
+ * @brief : handle response from a sensor
+ *
+ * @return :
+ *  true  : measurement is an answer in the current snapshot
+ *  false : response was not part of a snapshot
+ *********************************************************************/
+bool snap_response(sensor_t *s, sds011_response_t *r)
+{
+    if (r->cmd_id != SDS011_DATA || s->snap_wait == 0) return(false);
+
+    s->snap_id = s->snap_wait;
+    s->snap_rx = snap_us();
+    s->snap_wait = 0;
+
+    if (sstats.answered++ == 0) sstats.first = s->snap_rx;
+    sstats.last = s->snap_rx;
+
+    if (sstats.answered == sstats.sent) snap_close(NULL);
+
+    return(true);
+}
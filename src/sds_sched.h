@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Schedulers in the event loop of the daemon, as timer driven state
+ * machines per sensor:
+ *
+ * Duty cycle: wake up, warm up, sample and sleep for many sensors. The
+ * warm up of all sensors overlaps and the lasers are off in between.
+ *
+ * Query: in query reporting mode, spread the data queries of all sensors
+ * evenly over the interval, with a max number of queries in flight, so a
+ * shared USB hub does not get a burst of queries and answers.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SDS_SCHED_H
+#define _SDS_SCHED_H
+
+#include "sds_fleet.h"
+
+#define DUTY_WARMUP_DEF 30       // default seconds warm up after wake up
+#define DUTY_ANSWER     1000     // ms to wait on answer before resend
+#define DUTY_TRIES      3        // sends of a command before giving up
+#define DUTY_SLACK      5        // seconds a sample can be late
+
+// states of the duty cycle
+#define DUTY_OFF        0        // no duty cycle
+#define DUTY_TO_SLEEP   1        // sleep command sent
+#define DUTY_SLEEP      2        // laser off, wait to wake up
+#define DUTY_TO_WORK    3        // work command sent
+#define DUTY_WARMING    4        // laser on, warming up
+#define DUTY_SAMPLE     5        // wait on measurement
+
+// states of the query scheduler
+#define QUERY_OFF       0        // no query scheduler
+#define QUERY_IDLE      1        // wait till next query is due
+#define QUERY_WAIT      2        // due, but max queries are in flight
+#define QUERY_BUSY      3        // query sent, wait on answer
+
+#define QUERY_FLIGHT_DEF 4       // default max queries in flight
+
+// snapshots (see snap_start())
+#define SNAP_TIMEOUT    1000     // ms to wait on the answers of a snapshot
+
+// adaptive sampling (see adapt_sample())
+#define ADAPT_HIGH      0.20     // variation that sets the shortest interval
+#define ADAPT_LOW       0.05     // variation below which the interval grows
+#define ADAPT_GROW      1.5      // growth of the interval on stable air
+
+extern int duty_period;          // seconds between samples (0 = off)
+extern int duty_warmup;          // max seconds to warm up
+
+extern long query_interval;      // ms between queries of a sensor (0 = off)
+extern int  adapt_max;           // max seconds between samples (0 = not adaptive)
+extern int  query_flight;        // max queries in flight
+
+typedef struct query_stats
+{
+    uint32_t count;              // answered queries
+    uint32_t timeouts;           // queries without answer
+    int      max_flight;         // max queries in flight seen
+    double   lat_sum, lat_sq;    // latency query to answer (ms)
+    long     lat_min, lat_max;
+    uint32_t delays;             // queries in delay statistics
+    double   delay_sum;          // delay due to sent (ms)
+    long     delay_max;
+} query_stats;
+
+extern query_stats qstats;
+
+extern int snap_interval;        // seconds between snapshots (0 = off)
+
+typedef struct snap_stats
+{
+    // latest snapshot
+    uint32_t id;                 // snapshot ID (0 = none yet)
+    time_t   time;               // wall clock it was taken
+    int      sent;               // sensors queried
+    int      answered;           // answers within SNAP_TIMEOUT
+    long long t_sent;            // snap_us() first query sent
+    long long send;              // us to send all queries
+    long long first, last;       // snap_us() of first and last answer
+
+    // all snapshots
+    uint32_t count;              // snapshots closed
+    uint32_t incomplete;         // snapshots with a missing answer
+    double   spread_sum;         // us first to last answer
+    long long spread_max;
+} snap_stats;
+
+extern snap_stats sstats;
+
+/**
+ * @brief : start querying a connected sensor (in query reporting mode).
+ * The phase of the sensor within the interval follows from its position
+ * in the table, so the queries are spread evenly. A sensor that is
+ * calibrated to keep up with less is queried at its own rate.
+ */
+void query_start(sensor_t *s);
+
+/**
+ * @brief : stop querying (e.g. on disconnect)
+ */
+void query_stop(sensor_t *s);
+
+/**
+ * @brief : handle response from a sensor
+ *
+ * @return :
+ *  true  : measurement is an answer on a query
+ *  false : response was not an answer on a query
+ */
+bool query_response(sensor_t *s, sds011_response_t *r);
+
+/**
+ * @brief : ms between queries of a sensor: the (adaptive) interval, or
+ * what the sensor is calibrated to keep up with when that is more
+ */
+long query_period(sensor_t *s);
+
+/**
+ * @brief : adaptive sampling: after each sample, the interval follows
+ * how fast the readings change (see SDS011::Get_Variation()). Above
+ * ADAPT_HIGH it is back to the shortest at once, to follow an event at
+ * full resolution, below ADAPT_LOW it grows by ADAPT_GROW to save
+ * traffic and laser time, up to adapt_max seconds. In query mode this is the query
+ * interval (at least query_interval), in streaming mode the working
+ * period of the sensor (continuous up to adapt_max / 60 minutes).
+ */
+void adapt_sample(sensor_t *s);
+
+/**
+ * @brief : start taking snapshots of the fleet: every snap_interval
+ * seconds (on multiples on the wall clock) a data query is sent to all
+ * connected sensors at once, without queue or flight limit. The answers
+ * are tagged with the snapshot ID (snap_id in the sensor) and the spread
+ * between the first and last answer is kept in sstats.
+ */
+void snap_start();
+
+/**
+ * @brief : stop taking snapshots
+ */
+void snap_stop();
+
+/**
+ * @brief : handle response from a sensor
+ *
+ * @return :
+ *  true  : measurement is an answer in the current snapshot
+ *  false : response was not part of a snapshot
+ */
+bool snap_response(sensor_t *s, sds011_response_t *r);
+
+/**
+ * @brief : monotonic time in microseconds, to measure the spread of a
+ * snapshot
+ */
+long long snap_us();
+
+/**
+ * @brief : start the duty cycle on a connected sensor. The sensor is set
+ * to sleep, and woken up duty_warmup seconds before each sample is due.
+ * Samples are due on multiples of duty_period (wall clock), so the
+ * sensors wake up and warm up at the same time. The sample is taken as
+ * soon as the readings are stable (see sds_warm.h), at the latest when
+ * it is due.
+ */
+void duty_start(sensor_t *s);
+
+/**
+ * @brief : stop the duty cycle (e.g. on disconnect)
+ */
+void duty_stop(sensor_t *s);
+
+/**
+ * @brief : handle response from a sensor
+ *
+ * @return :
+ *  true  : measurement is a sample to use
+ *  false : response was handled (or measurement during warm up)
+ */
+bool duty_response(sensor_t *s, sds011_response_t *r);
+
+/**
+ * @brief : name of duty cycle state
+ */
+const char *duty_name(uint8_t state);
+
+#endif /* _SDS_SCHED_H */
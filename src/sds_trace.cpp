@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Flight recorder of frames and changes of state.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sds_trace.h"
+#include "sds011_lib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+char trace_file[TRACE_FILE_LEN] = TRACE_FILE;
+
+static trace_event trace_ring[TRACE_SIZE];
+static uint32_t    trace_seq = 0;         // next event
+static int         trace_fd = -1;         // trace_file opened for a crash
+static uint64_t    trace_t0;              // trace_clock() at trace_start()
+static uint64_t    trace_ns0;             // CLOCK_MONOTONIC at trace_start()
+static volatile sig_atomic_t trace_crashed = 0;   // signal of a crash
+static trace_add_cb trace_cb = NULL;      // adds data after the events
+
+/*********************************************************************
+ * @brief : CLOCK_MONOTONIC in ns
+ *********************************************************************/
+static uint64_t trace_mono()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*********************************************************************
+ * @brief : take the next event in the ring
+ *********************************************************************/
+static inline trace_event *trace_next(uint8_t type, int fd)
+{
+    uint32_t seq = __atomic_fetch_add(&trace_seq, 1, __ATOMIC_RELAXED);
+    trace_event *e = &trace_ring[seq & (TRACE_SIZE - 1)];
+
+    e->ticks = trace_clock();
+    e->seq = seq;
+    e->type = type;
+    e->fd = fd;
+
+    return(e);
+}
+
+/*********************************************************************
+ * @brief : record a frame (the begin and command bytes of a frame that
+ * is sent are always the same, the rest fits)
+ *********************************************************************/
+void trace_frame(uint8_t type, int fd, const uint8_t *p, int len)
+{
+    trace_event *e = trace_next(type, fd);
+
+    if (type == TRACE_TX && len == SDS011_SENDPACKET_LEN) {
+        p += 2;
+        len -= 3;
+    }
+
+    if (len > (int) sizeof(e->data)) len = sizeof(e->data);
+
+    memcpy(e->data, p, len);
+    e->what = len;
+}
+
+/*********************************************************************
+ * @brief : record a change of state
+ *********************************************************************/
+void trace_state(uint8_t what, int fd, uint16_t devid, int32_t value)
+{
+    trace_event *e = trace_next(TRACE_STATE, fd);
+
+    e->what = what;
+    memcpy(e->data, &devid, sizeof(devid));
+    memcpy(e->data + 2, &value, sizeof(value));
+}
+
+/*********************************************************************
+ * @brief : write all of a buffer (async-signal-safe)
+ *********************************************************************/
+static int trace_write(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *) buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n <= 0) return(-1);
+        p += n;
+        len -= n;
+    }
+
+    return(0);
+}
+
+/*********************************************************************
+ * @brief : write the ring to a file descriptor, oldest event first
+ *
+ * @return : number of events written, -1 on error
+ *********************************************************************/
+int trace_dump(int fd)
+{
+    struct timespec ts;
+    trace_head h;
+    int64_t ns;
+    uint32_t seq = __atomic_load_n(&trace_seq, __ATOMIC_RELAXED);
+    uint32_t start = seq & (TRACE_SIZE - 1);
+
+    memset(&h, 0x0, sizeof(h));
+    memcpy(h.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    h.seq = seq;
+    h.size = seq < TRACE_SIZE ? seq : TRACE_SIZE;
+
+    h.ticks = trace_clock();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h.epoch_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    // rate of the counter since the start (fast enough on a signal)
+    ns = trace_mono() - trace_ns0;
+    h.rate = trace_ns0 && ns > 0 ? (double) (h.ticks - trace_t0) / ns : 1;
+    h.crash = trace_crashed;
+
+    if (trace_write(fd, &h, sizeof(h)) < 0) return(-1);
+
+    // not full yet: from the first event, else from the oldest
+    if (seq < TRACE_SIZE) {
+        if (trace_write(fd, trace_ring, seq * sizeof(trace_event)) < 0) return(-1);
+    }
+    else {
+        if (trace_write(fd, &trace_ring[start], (TRACE_SIZE - start) * sizeof(trace_event)) < 0 ||
+            trace_write(fd, trace_ring, start * sizeof(trace_event)) < 0) return(-1);
+    }
+
+    if (trace_cb) trace_cb(fd);
+
+    return(h.size);
+}
+
+/*********************************************************************
+ * @brief : set the function that adds data after the events
+ *********************************************************************/
+void trace_add(trace_add_cb cb)
+{
+    trace_cb = cb;
+}
+
+/*********************************************************************
+ * @brief : write the ring to trace_file (async-signal-safe)
+ *
+ * @return : number of events written, -1 on error
+ *********************************************************************/
+int trace_save()
+{
+    int fd, ret;
+
+    if (trace_file[0] == 0x0) return(-1);
+
+    fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return(-1);
+
+    ret = trace_dump(fd);
+    close(fd);
+
+    return(ret);
+}
+
+/*********************************************************************
+ * @brief : write the ring on request (SIGUSR1)
+ *********************************************************************/
+static void trace_sig_dump(int sig)
+{
+    int err = errno;
+
+    trace_state(TRACE_DUMP, 0xff, 0, sig);
+    trace_save();
+
+    errno = err;
+}
+
+/*********************************************************************
+ * @brief : write the ring on a crash to the file that was opened before,
+ * then crash with the default action
+ *********************************************************************/
+static void trace_sig_crash(int sig)
+{
+    off_t len;
+
+    trace_state(TRACE_CRASH, 0xff, 0, sig);
+    trace_crashed = sig;
+
+    if (trace_fd >= 0 && lseek(trace_fd, 0, SEEK_SET) == 0 && trace_dump(trace_fd) >= 0) {
+
+        // an earlier dump could be longer
+        len = lseek(trace_fd, 0, SEEK_CUR);
+        if (len > 0) ftruncate(trace_fd, len);
+    }
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*********************************************************************
+ * @brief : open trace_file for a crash and catch the signals to write
+ * the ring on
+ *
+ * @return : SDS011_OK or SDS011_ERROR
+ *********************************************************************/
+int trace_start()
+{
+    const int crash[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    struct sigaction act;
+    int i;
+
+    trace_t0 = trace_clock();
+    trace_ns0 = trace_mono();
+
+    if (trace_file[0] == 0x0) return(SDS011_OK);
+
+    // not truncated: an earlier crash is kept till the next dump
+    trace_fd = open(trace_file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (trace_fd < 0) return(SDS011_ERROR);
+
+    memset(&act, 0x0, sizeof(act));
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    act.sa_handler = trace_sig_dump;
+
+    if (sigaction(SIGUSR1, &act, NULL) < 0) return(SDS011_ERROR);
+
+    // once: a crash in the handler is not caught again
+    act.sa_flags = SA_RESETHAND;
+    act.sa_handler = trace_sig_crash;
+
+    for (i = 0; i < (int) (sizeof(crash) / sizeof(crash[0])); i++)
+        if (sigaction(crash[i], &act, NULL) < 0) return(SDS011_ERROR);
+
+    return(SDS011_OK);
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Flight recorder: the frames that are sent and received and the changes
+ * of state are kept in binary in a ring in memory, always on and cheap
+ * enough for every frame. The ring is written to a file on a query, a
+ * signal (SIGUSR1) or a crash, and decoded offline with 'tracedec'. Other
+ * data (e.g. the latest readings) can be added after the events, to be
+ * recovered on a restart after a crash.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SDS_TRACE_H
+#define _SDS_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define TRACE_SIZE      8192     // events in the ring (power of 2)
+#define TRACE_MAGIC     "SDSTRC1"
+#define TRACE_FILE      "/var/lib/sds011.trace" // default trace file
+#define TRACE_FILE_LEN  100      // max length of trace file name
+
+// type of event
+#define TRACE_TX        1        // frame sent (bytes 2 - 17)
+#define TRACE_RX        2        // frame received
+#define TRACE_STATE     3        // change of state
+
+// changes of state (what)
+#define TRACE_CONNECT   1        // connected (value : attempts, 0 = warm start)
+#define TRACE_NOCONNECT 2        // could not connect
+#define TRACE_RESEND    3        // no answer on connect (value : attempt)
+#define TRACE_TIMEOUT   4        // no answer on a queued command
+#define TRACE_DROP      5        // response of unknown device on a bus
+#define TRACE_CLOSE     6        // disconnected
+#define TRACE_DUTY      7        // duty cycle (value : state)
+#define TRACE_DUMP      8        // ring written on request (value : signal)
+#define TRACE_CRASH     9        // ring written on crash (value : signal)
+
+typedef struct trace_event
+{
+    uint64_t ticks;              // trace_clock()
+    uint32_t seq;                // number of the event
+    uint8_t  type;               // TRACE_TX, TRACE_RX, TRACE_STATE
+    uint8_t  what;               // state, or length of the frame
+    uint16_t fd;                 // port (0xff = none, as in SDS011)
+    uint8_t  data[16];           // frame, or devid (2) + value (4) of state
+} trace_event;
+
+// start of a trace file, followed by the events oldest first
+typedef struct trace_head
+{
+    char     magic[8];
+    uint32_t size;               // events that follow
+    uint32_t seq;                // events recorded since start
+    uint64_t ticks;              // trace_clock() of the dump
+    uint64_t epoch_ns;           // CLOCK_REALTIME of the dump
+    double   rate;               // ticks per ns
+    int32_t  crash;              // signal of a crash (0 = on request)
+    uint32_t spare;
+} trace_head;
+
+// adds data after the events, with async-signal-safe calls only
+typedef void (*trace_add_cb)(int fd);
+
+extern char trace_file[TRACE_FILE_LEN]; // to write the ring to ("" = none)
+
+/**
+ * @brief : time stamp of an event. The counter of the CPU where it can be
+ * read fast (a clock_gettime() can take more than the rest of recording
+ * an event), converted to time with the rate measured at the dump.
+ */
+static inline uint64_t trace_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return(__builtin_ia32_rdtsc());
+#elif defined(__aarch64__)
+    uint64_t t;
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (t));
+    return(t);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+}
+
+/**
+ * @brief : record a frame (lock free, any thread)
+ *
+ * @param type : TRACE_TX or TRACE_RX
+ */
+void trace_frame(uint8_t type, int fd, const uint8_t *p, int len);
+
+/**
+ * @brief : record a change of state (lock free, any thread)
+ */
+void trace_state(uint8_t what, int fd, uint16_t devid, int32_t value);
+
+/**
+ * @brief : write the ring to a file descriptor, oldest event first, and
+ * the data of trace_add(). Only uses async-signal-safe calls.
+ *
+ * @return : number of events written, -1 on error
+ */
+int trace_dump(int fd);
+
+/**
+ * @brief : set the function that adds data after the events when the
+ * ring is written (e.g. fleet_crash_write())
+ */
+void trace_add(trace_add_cb cb);
+
+/**
+ * @brief : write the ring to trace_file
+ *
+ * @return : number of events written, -1 on error
+ */
+int trace_save();
+
+/**
+ * @brief : open trace_file to write the ring on a crash (as the file can
+ * not be opened safely then), write it on SIGUSR1 and on SIGSEGV, SIGBUS,
+ * SIGFPE, SIGILL and SIGABRT. After a crash the signal is raised again
+ * with the default action (e.g. for a core dump).
+ *
+ * @return : SDS011_OK or SDS011_ERROR
+ */
+int trace_start();
+
+#endif /* _SDS_TRACE_H */
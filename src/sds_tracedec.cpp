@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Decoder of the flight recorder (see sds_trace.h): shows each event of a
+ * trace file with its time, the frame in hex and what it means.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sds011_lib.h"
+#include "sds_trace.h"
+#include "sds_fleet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*********************************************************************
+ * @brief : meaning of a frame that was sent (bytes 2 - 17)
+ *********************************************************************/
+void decode_tx(uint8_t *d)
+{
+    uint16_t devid = d[13] | (d[14] << 8);
+
+    switch(d[0])
+    {
+        case SDS011_MODE:
+            if (d[1]) printf("set reporting mode %s", d[2] == REPORT_QUERY ? "query" : "stream");
+            else printf("get reporting mode");
+            break;
+        case SDS011_QDATA:
+            printf("query data");
+            break;
+        case SDS011_DEVID:
+            printf("set device ID 0x%02x%02x", d[12], d[11]);
+            break;
+        case SDS011_SLEEP:
+            if (d[1]) printf("set %s", d[2] == MODE_SLEEP ? "sleep" : "work");
+            else printf("get working mode");
+            break;
+        case SDS011_FWVER:
+            printf("get firmware");
+            break;
+        case SDS011_PERIOD:
+            if (d[1]) printf("set working period %d", d[2]);
+            else printf("get working period");
+            break;
+        default:
+            printf("unknown command 0x%02x", d[0]);
+    }
+
+    if (devid == 0xffff) printf(" (all)");
+    else printf(" (0x%04x)", devid);
+}
+
+/*********************************************************************
+ * @brief : meaning of a frame that was received
+ *********************************************************************/
+void decode_rx(uint8_t *d, int len)
+{
+    if (len != SDS011_PACKET_LEN || d[0] != SDS011_BYTE_BEGIN) {
+        printf("invalid frame");
+        return;
+    }
+
+    if (d[1] == SDS011_DATA)
+        printf("data pm25=%.1f pm10=%.1f", (d[2] | (d[3] << 8)) / 10.0, (d[4] | (d[5] << 8)) / 10.0);
+    else if (d[1] == SDS011_CONF)
+        printf("reply on 0x%02x : %d %d", d[2], d[3], d[4]);
+    else
+        printf("unknown reply 0x%02x", d[1]);
+
+    printf(" (0x%02x%02x)", d[7], d[6]);
+}
+
+/*********************************************************************
+ * @brief : meaning of a change of state
+ *********************************************************************/
+void decode_state(trace_event *e)
+{
+    const char *names[] = { "?", "connected", "could not connect", "no answer, resend",
+        "no answer on command", "dropped response", "disconnected", "duty cycle",
+        "written on request", "written on crash" };
+    // as duty_name() (the states of sds_sched.h)
+    const char *duty[] = { "off", "to-sleep", "sleep", "to-work", "warming", "sample" };
+    uint16_t devid;
+    int32_t  value;
+
+    memcpy(&devid, e->data, sizeof(devid));
+    memcpy(&value, e->data + 2, sizeof(value));
+
+    printf("%60s%s", "", e->what <= TRACE_CRASH ? names[e->what] : "?");
+
+    switch(e->what)
+    {
+        case TRACE_CONNECT:
+            if (value == 0) printf(" (warm start)");
+            else printf(" after %d attempt(s)", value);
+            break;
+        case TRACE_NOCONNECT:
+        case TRACE_RESEND:
+            printf(" (attempt %d)", value);
+            break;
+        case TRACE_TIMEOUT:
+            printf(" (%d queued)", value);
+            break;
+        case TRACE_DUTY:
+            printf(" %s", value < 6 ? duty[value] : "?");
+            break;
+        case TRACE_DUMP:
+        case TRACE_CRASH:
+            if (value) printf(" (signal %d)", value);
+            return;
+    }
+
+    printf(" (0x%04x)", devid);
+}
+
+int main(int argc, char *argv[])
+{
+    trace_head  h;
+    trace_event e;
+    fleet_read_head rh;
+    fleet_reading r;
+    FILE   *fp;
+    char   tm[20];
+    time_t sec;
+    uint64_t ns;
+    uint32_t i, lost = 0;
+    int    j;
+
+    if (argc != 2) {
+        printf("%s trace-file\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    fp = fopen(argv[1], "rb");
+
+    if (fp == NULL || fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        printf("%s is not a trace file\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%u events of %u recorded\n\n", h.size, h.seq);
+
+    for (i = 0; i < h.size && fread(&e, sizeof(e), 1, fp) == 1; i++)
+    {
+        // overwritten while it was written, or a frame longer than it holds
+        if (e.seq != h.seq - h.size + i ||
+           ((e.type == TRACE_TX || e.type == TRACE_RX) && e.what > sizeof(e.data))) {
+            lost++;
+            continue;
+        }
+
+        // wall clock of the event from the time of the dump
+        ns = h.epoch_ns - (uint64_t) ((h.ticks - e.ticks) / h.rate);
+        sec = ns / 1000000000ULL;
+        strftime(tm, sizeof(tm), "%H:%M:%S", localtime(&sec));
+
+        printf("%s.%06lu %3d ", tm, (unsigned long) (ns % 1000000000ULL / 1000),
+            e.fd == 0xff ? -1 : e.fd);
+
+        if (e.type == TRACE_TX) {
+            printf("TX AA B4 ");
+            for (j = 0; j < e.what; j++) printf("%02X ", e.data[j]);
+            printf("AB ");
+            decode_tx(e.data);
+        }
+        else if (e.type == TRACE_RX) {
+            printf("RX ");
+            for (j = 0; j < e.what; j++) printf("%02X ", e.data[j]);
+            printf("%*s", (SDS011_SENDPACKET_LEN - e.what) * 3, "");
+            decode_rx(e.data, e.what);
+        }
+        else
+            decode_state(&e);
+
+        printf("\n");
+    }
+
+    if (lost) printf("\n%u events were overwritten during the dump (or damaged)\n", lost);
+
+    if (h.crash) printf("\nwritten on crash (signal %d)\n", h.crash);
+
+    // latest readings of the sensors (see fleet_crash_write())
+    if (fread(&rh, sizeof(rh), 1, fp) == 1 && memcmp(rh.magic, FLEET_READ_MAGIC, sizeof(FLEET_READ_MAGIC)) == 0) {
+
+        printf("\nlatest readings of %u sensor(s)\n\n", rh.cnt);
+
+        for (i = 0; i < rh.cnt && fread(&r, sizeof(r), 1, fp) == 1; i++)
+        {
+            r.name[sizeof(r.name) - 1] = 0x0;
+
+            if (r.epoch_ns == 0 || r.count == 0) {
+                printf("%s devid=0x%04x no data\n", r.name, r.devid);
+                continue;
+            }
+
+            sec = r.epoch_ns / 1000000000LL;
+            strftime(tm, sizeof(tm), "%H:%M:%S", localtime(&sec));
+
+            printf("%s devid=0x%04x pm25=%.1f pm10=%.1f at %s count=%u pm25=%.1f/%.1f/%.1f pm10=%.1f/%.1f/%.1f\n",
+                r.name, r.devid, r.pm25, r.pm10, tm, r.count,
+                r.pm25_min, r.pm25_sum / r.count, r.pm25_max,
+                r.pm10_min, r.pm10_sum / r.count, r.pm10_max);
+        }
+    }
+
+    fclose(fp);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Warm up monitor: follow the readings after wake up till they are stable.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "sds_warm.h"
+#include "sds_loop.h"
+#include <math.h>
+
+int warm_tol = WARM_TOL_DEF;
+
+/*********************************************************************
+ * @brief : start to follow the warm up
+ *********************************************************************/
+void warm_start(warm_mon *w, int max)
+{
+    w->cnt = 0;
+    w->wake = loop_now();
+    w->max = max;
+}
+
+/*********************************************************************
+ * @brief : seconds since wake up
+ *********************************************************************/
+double warm_time(warm_mon *w)
+{
+    return((loop_now() - w->wake) / 1000.0);
+}
+
+/*********************************************************************
+ * @brief : are the readings in the window stable
+ *
+ * @param v : window of readings, oldest first at position start
+ *********************************************************************/
+bool warm_stable(float *v, int start)
+{
+    double mean = 0, var = 0, sxy = 0, sxx = 0, x, d, tol;
+    int i;
+
+    for (i = 0; i < WARM_WINDOW; i++) mean += v[i];
+    mean /= WARM_WINDOW;
+
+    // spread and least squares slope against the reading number
+    for (i = 0; i < WARM_WINDOW; i++) {
+        x = ((i - start + WARM_WINDOW) % WARM_WINDOW) - (WARM_WINDOW - 1) / 2.0;
+        d = v[i] - mean;
+        var += d * d;
+        sxy += x * d;
+        sxx += x * x;
+    }
+
+    tol = mean * warm_tol / 100;
+    if (tol < WARM_FLOOR) tol = WARM_FLOOR;
+
+    return(sqrt(var / WARM_WINDOW) <= tol && fabs(sxy / sxx) * (WARM_WINDOW - 1) <= tol);
+}
+
+/*********************************************************************
+ * @brief : check the max time without a reading
+ *
+ * @return : WARM_BUSY or WARM_FORCED
+ *********************************************************************/
+int warm_expired(warm_mon *w)
+{
+    return(loop_now() - w->wake >= w->max * 1000L ? WARM_FORCED : WARM_BUSY);
+}
+
+/*********************************************************************
+ * @brief : add a reading during warm up
+ *
+ * @return : WARM_BUSY, WARM_READY or WARM_FORCED
+ *********************************************************************/
+int warm_check(warm_mon *w, float pm25, float pm10)
+{
+    int pos = w->cnt % WARM_WINDOW;
+
+    w->pm25[pos] = pm25;
+    w->pm10[pos] = pm10;
+    w->cnt++;
+
+    if (warm_expired(w) == WARM_FORCED) return(WARM_FORCED);
+
+    if (w->cnt < WARM_WINDOW || loop_now() - w->wake < WARM_MIN * 1000L)
+        return(WARM_BUSY);
+
+    // the oldest reading is the one after the newest
+    pos = w->cnt % WARM_WINDOW;
+
+    if (warm_stable(w->pm25, pos) && warm_stable(w->pm10, pos)) return(WARM_READY);
+
+    return(WARM_BUSY);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2019 Paulvha.  version 1.0
+ *
+ * Warm up monitor: after wake up the readings of a sensor are high and
+ * noisy until the fan and laser are stable. Instead of waiting a fixed
+ * time, the readings are followed till they are stable, with a max time.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _SDS_WARM_H
+#define _SDS_WARM_H
+
+#define WARM_WINDOW     5        // readings in the stability test
+#define WARM_MIN        5        // seconds before readings can be stable
+#define WARM_TOL_DEF    10       // default % readings can vary when stable
+#define WARM_FLOOR      1.0      // ug/m3 variation that is always stable
+
+// result of warm_check()
+#define WARM_BUSY       0        // still warming up
+#define WARM_READY      1        // readings are stable
+#define WARM_FORCED     2        // max warm up time passed
+
+typedef struct warm_mon
+{
+    float    pm25[WARM_WINDOW];  // latest readings
+    float    pm10[WARM_WINDOW];
+    int      cnt;                // readings since wake up
+    long     wake;               // loop_now() of wake up
+    int      max;                // max seconds to warm up
+} warm_mon;
+
+extern int warm_tol;             // % readings can vary when stable
+
+/**
+ * @brief : start to follow the warm up of a sensor that just woke up
+ *
+ * @param max : seconds after which the sensor is taken as warm anyway
+ */
+void warm_start(warm_mon *w, int max);
+
+/**
+ * @brief : add a reading during warm up. The readings are stable when,
+ * over the last WARM_WINDOW readings, both the standard deviation and
+ * the trend (least squares slope times the window) are within warm_tol %
+ * of the mean (or WARM_FLOOR for low values), after at least WARM_MIN
+ * seconds.
+ *
+ * @return : WARM_BUSY, WARM_READY or WARM_FORCED
+ */
+int warm_check(warm_mon *w, float pm25, float pm10);
+
+/**
+ * @brief : check the max time without a reading (e.g. on a timer)
+ *
+ * @return : WARM_BUSY or WARM_FORCED
+ */
+int warm_expired(warm_mon *w);
+
+/**
+ * @brief : seconds since wake up
+ */
+double warm_time(warm_mon *w);
+
+#endif /* _SDS_WARM_H */
@@ -17,16 +17,22 @@
 #include <sys/ioctl.h>
 #include <linux/usbdevice_fs.h>
 
-struct termios tty_back;
-bool restore = false;
+/* paulvha : keep original settings per file descriptor, so they can be
+ * restored when more than one port is opened */
+#define MAX_BACK 300
+
+struct termios tty_back[MAX_BACK];
+bool restore[MAX_BACK];
 
 void configure_interface(int fd, int speed)
 {
     struct termios tty;
 
-    if (tcgetattr(fd, &tty_back) < 0) {
-        perror("tcgetattr");
-        exit(1);
+    if (fd >= 0 && fd < MAX_BACK) {
+        if (tcgetattr(fd, &tty_back[fd]) < 0) {
+            perror("tcgetattr");
+            exit(1);
+        }
     }
 
     if (tcgetattr(fd, &tty) < 0) {
@@ -58,7 +64,7 @@ void configure_interface(int fd, int speed)
         exit(1);
     }
 
-    restore=true;
+    if (fd >= 0 && fd < MAX_BACK) restore[fd] = true;
 }
 
 void set_blocking(int fd, int mcount)
@@ -82,11 +88,12 @@ void set_blocking(int fd, int mcount)
 // paulvha : added to restore
 void restore_ser(int fd)
 {
-    if (restore)
+    if (fd >= 0 && fd < MAX_BACK && restore[fd])
     {
-        if (tcsetattr(fd, TCSANOW, &tty_back) < 0) {
+        restore[fd] = false;
+
+        if (tcsetattr(fd, TCSANOW, &tty_back[fd]) < 0) {
             perror("reset tcsetattr");
-            exit(1);
         }
     }
 }